@@ -9,6 +9,50 @@ extern "C" {
   #include <stdlib.h>
   typedef unsigned index_t;
 
+  /* _dpdist2 and _spdist2 use gemm if the dimension is at least 
+   * _D2_PDIST2_GEMM_MIN_DIM and d*n*m is at least _D2_PDIST2_GEMM_MIN; 
+   * see test_pdist2 for the crossover */
+#ifndef _D2_PDIST2_GEMM_MIN
+#define _D2_PDIST2_GEMM_MIN 4096
+#endif
+#ifndef _D2_PDIST2_GEMM_MIN_DIM
+#define _D2_PDIST2_GEMM_MIN_DIM 8
+#endif
+#define _D2_PDIST2_USE_GEMM(d, n, m) \
+  ((d) >= _D2_PDIST2_GEMM_MIN_DIM && (d) * (n) * (m) >= _D2_PDIST2_GEMM_MIN)
+
+  /* given A dimension-major, _dpdist2_dmajor and _spdist2_dmajor are used
+   * instead of the other kernels if the dimension is below 
+   * _D2_PDIST2_DMAJOR_MAX_DIM or gemm would not be used */
+#ifndef _D2_PDIST2_DMAJOR_MAX_DIM
+#define _D2_PDIST2_DMAJOR_MAX_DIM 32
+#endif
+#define _D2_PDIST2_USE_DMAJOR(d, n, m) \
+  ((d) < _D2_PDIST2_DMAJOR_MAX_DIM || !_D2_PDIST2_USE_GEMM(d, n, m))
+
+  /* the alignment in bytes of aligned arrays, and the length n rounded up
+   * to whole multiples of it for entries of the given size */
+#define _D2_ALIGN 64
+#define _D2_ALIGN_LEN(n, size) \
+  (((n) * (size) + _D2_ALIGN - 1) / _D2_ALIGN * _D2_ALIGN / (size))
+
+  /* the row/column primitives, _dexp/_sexp and _dexprnd/_sexprnd dispatch
+   * to AVX2 kernels if the cpu supports them; _d2_simd_enable(0) forces the scalar kernels,
+   * and the return value tells which ones are in use */
+  int _d2_simd_enable(int enable);
+
+  /* a counter-based generator: the draw of counter ctr in the stream key is
+   * the finalizer of splitmix64 applied to key + (ctr+1) * 0x9E3779B97F4A7C15,
+   * so it does not depend on which thread draws it, or in which order */
+  static inline unsigned long long _d2_mix64(unsigned long long z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+  }
+  static inline unsigned long long _d2_counter_hash(unsigned long long key, unsigned long long ctr) {
+    return _d2_mix64(key + (ctr + 1) * 0x9E3779B97F4A7C15ULL);
+  }
+
   // assertation
   void _dgzero(size_t n, double *a); //assert (a>0)
 
@@ -16,6 +60,7 @@ extern "C" {
   void _dadd(size_t, double *a, double b); // a(:) += b;
   void _dvmul(size_t n, const double *a, const double *b, double *c);// c = a .* b
   void _dexp(size_t n, double *a);//inplace a -> exp(a);
+  void _dexprnd(size_t n, unsigned long long key, unsigned long long ctr, double *a); // a(i) = -log(u(key, ctr+i)), u uniform in (0,1)
 
   // column-wise op
   void _dgcmv(size_t m, size_t n, double *a, const double *b); // a(:,*) = a(:,*) .+ b
@@ -24,10 +69,12 @@ extern "C" {
   void _dicms(size_t m, size_t n, double *a, const double *b); // a = diag(1./b) * a
   void _dcsum(size_t m, size_t n, const double *a, double *b); // b(*) = sum(a(:,*))
   void _dcsum2(size_t m, size_t n, const double *a, double *b); // b(*) += sum(a(:,*))
+  void _dcsqnorm(size_t m, size_t n, const double *a, double *b); // b(*) = sum(a(:,*).^2)
   void _dcnorm(size_t m, size_t n, double *a, double *sa); // replace a(:,*) -> a(:,*) / sum(a(:,*))
   void _dccenter(size_t m, size_t n, double *a, double *sa); // replace a(:,*) -> a(:,*) - mean(a(:,*))
   void _dcmax(size_t m, size_t n, const double *a, double *b);
   void _dcmin(size_t m, size_t n, const double *a, double *b);
+  void _dgcmv2_cmax(size_t m, size_t n, const double *a, const double *b, double *c); // c(*) = max(-a(:,*) .+ b)
   // row-wise op
   void _dgrmv(size_t m, size_t n, double *a, const double *b); // a(*,:) = a(*,:) .+ b
   void _dgrms(size_t m, size_t n, double *a, const double *b); // a = a * diag(b) 
@@ -38,6 +85,7 @@ extern "C" {
   void _drcenter(size_t m, size_t n, double *a, double *sa); // replace a(*,:) -> a(*,:) - mean(a(*,:))
   void _drmax(size_t m, size_t n, const double *a, double *b);
   void _drmin(size_t m, size_t n, const double *a, double *b);
+  void _dgrmv_rmin(size_t m, size_t n, const double *a, const double *b, double *c); // c(*) = min(a(*,:) .+ b)
 
 
 
@@ -49,6 +97,18 @@ extern "C" {
    * n, m: number of data entry
    */
   void _dpdist2(const size_t d, const size_t n, const size_t m, const double * A, const double * B, double *C);
+  /* the two kernels behind _dpdist2: the direct one for small shapes and 
+   * the gemm-based one, where the squared norms An (length n) and Bn 
+   * (length m) of columns of A and B can be precomputed or NULL (then they
+   * are computed in a buffer allocated by the call) */
+  void _dpdist2_direct(const size_t d, const size_t n, const size_t m, const double * A, const double * B, double *C);
+  void _dpdist2_norm(const size_t d, const size_t n, const size_t m, const double * A, const double * B, 
+		      const double *An, const double *Bn, double *C);
+  /* the same as _dpdist2_direct, with A stored dimension-major, i.e., 
+   * A(k,i) at At[k*lda + i], where At is _D2_ALIGN aligned and lda is a
+   * multiple of _D2_ALIGN_LEN(1, sizeof(double)); At[k*lda + i] for n <= i < lda
+   * is read, so it must be allocated, but is not used */
+  void _dpdist2_dmajor(const size_t d, const size_t n, const size_t m, const double * At, const size_t lda, const double * B, double *C);
   void _dpdist2_sym(const size_t d, const size_t n, const size_t m, const double *A, const index_t *Bi, double *C, const double *vocab);
   void _dpdist2_sym2(const size_t d, const size_t n, const size_t m, const index_t *Ai, const index_t *Bi, double *C, const double *vocab);
   void _dpdist2_submat(const size_t m, const size_t *Bi, double *C, const size_t vocab_size, const double *dist_mat);
@@ -62,6 +122,7 @@ extern "C" {
   void _sadd(size_t, float *a, float b); // a(:) += b;
   void _svmul(size_t n, const float *a, const float *b, float *c);// c = a .* b
   void _sexp(size_t n, float *a);//inplace a -> exp(a);
+  void _sexprnd(size_t n, unsigned long long key, unsigned long long ctr, float *a); // a(i) = -log(u(key, ctr+i)), u uniform in (0,1)
 
   // column-wise op
   void _sgcmv(size_t m, size_t n, float *a, const float *b); // a(:,*) = a(:,*) .+ b
@@ -70,10 +131,12 @@ extern "C" {
   void _sicms(size_t m, size_t n, float *a, const float *b); // a = diag(1./b) * a
   void _scsum(size_t m, size_t n, const float *a, float *b); // b(*) = sum(a(:,*))
   void _scsum2(size_t m, size_t n, const float *a, float *b); // b(*) += sum(a(:,*))
+  void _scsqnorm(size_t m, size_t n, const float *a, float *b); // b(*) = sum(a(:,*).^2)
   void _scnorm(size_t m, size_t n, float *a, float *sa); // replace a(:,*) -> a(:,*) / sum(a(:,*))
   void _sccenter(size_t m, size_t n, float *a, float *sa); // replace a(:,*) -> a(:,*) - mean(a(:,*))
   void _scmax(size_t m, size_t n, const float *a, float *b);
   void _scmin(size_t m, size_t n, const float *a, float *b);
+  void _sgcmv2_cmax(size_t m, size_t n, const float *a, const float *b, float *c); // c(*) = max(-a(:,*) .+ b)
   // row-wise op
   void _sgrmv(size_t m, size_t n, float *a, const float *b); // a(*,:) = a(*,:) .+ b
   void _sgrms(size_t m, size_t n, float *a, const float *b); // a = a * diag(b) 
@@ -84,6 +147,7 @@ extern "C" {
   void _srcenter(size_t m, size_t n, float *a, float *sa); // replace a(*,:) -> a(*,:) - mean(a(*,:))
   void _srmax(size_t m, size_t n, const float *a, float *b);
   void _srmin(size_t m, size_t n, const float *a, float *b);
+  void _sgrmv_rmin(size_t m, size_t n, const float *a, const float *b, float *c); // c(*) = min(a(*,:) .+ b)
 
 
   /* compute squared Euclidean distance matrix
@@ -94,6 +158,18 @@ extern "C" {
    * n, m: number of data entry
    */
   void _spdist2(const size_t d, const size_t n, const size_t m, const float * A, const float * B, float *C);
+  /* the two kernels behind _spdist2: the direct one for small shapes and 
+   * the gemm-based one, where the squared norms An (length n) and Bn 
+   * (length m) of columns of A and B can be precomputed or NULL (then they
+   * are computed in a buffer allocated by the call) */
+  void _spdist2_direct(const size_t d, const size_t n, const size_t m, const float * A, const float * B, float *C);
+  void _spdist2_norm(const size_t d, const size_t n, const size_t m, const float * A, const float * B, 
+		      const float *An, const float *Bn, float *C);
+  /* the same as _spdist2_direct, with A stored dimension-major, i.e., 
+   * A(k,i) at At[k*lda + i], where At is _D2_ALIGN aligned and lda is a
+   * multiple of _D2_ALIGN_LEN(1, sizeof(float)); At[k*lda + i] for n <= i < lda
+   * is read, so it must be allocated, but is not used */
+  void _spdist2_dmajor(const size_t d, const size_t n, const size_t m, const float * At, const size_t lda, const float * B, float *C);
   void _spdist2_sym(const size_t d, const size_t n, const size_t m, const float *A, const index_t *Bi, float *C, const float *vocab);
   void _spdist2_sym2(const size_t d, const size_t n, const size_t m, const index_t *Ai, const index_t *Bi, float *C, const float *vocab);
   void _spdist2_submat(const size_t m, const size_t *Bi, float *C, const size_t vocab_size, const float *dist_mat);
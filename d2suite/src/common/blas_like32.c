@@ -5,11 +5,16 @@
 
 #include "blas_like.h"
 #include "blas_util.h"
+#include "blas_like_avx.h"
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
 #include <float.h>
 #define real_t float 
+/* sums of many floats are accumulated in double */
+#define acc_t double
+/* the rows whose sums _srsum keeps on the stack at a time */
+#define _D2_RSUM_BLOCK 256
 #define _D2_MALLOC_SCALAR(n) (real_t*) malloc((n)*sizeof(real_t))
 #define _D2_FREE(x) free(x)
 
@@ -28,10 +33,11 @@ void _sadd(size_t n, real_t *a, real_t b) {
 void _scmax(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa = a;
-  for (j=0; j<n; ++j) b[j] = DBL_MIN;
-  for (i=0; i<m; ++i, ++pa) {
-    for (j=0; j<n; ++j)
-      b[j] = MAX(b[j], pa[j*m]);
+  if (_D2_USE_AVX2) {_scmax_avx2(m, n, a, b); return;}
+  for (j=0; j<n; ++j, pa += m) {
+    b[j] = -FLT_MAX;
+    for (i=0; i<m; ++i)
+      b[j] = MAX(b[j], pa[i]);
   }
 }
 
@@ -39,10 +45,11 @@ void _scmax(size_t m, size_t n, const real_t *a, real_t *b) {
 void _scmin(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa = a;
-  for (j=0; j<n; ++j) b[j] = DBL_MAX;
-  for (i=0; i<m; ++i, ++pa) {
-    for (j=0; j<n; ++j)
-      b[j] = MIN(b[j], pa[j*m]);
+  if (_D2_USE_AVX2) {_scmin_avx2(m, n, a, b); return;}
+  for (j=0; j<n; ++j, pa += m) {
+    b[j] = FLT_MAX;
+    for (i=0; i<m; ++i)
+      b[j] = MIN(b[j], pa[i]);
   }
 }
 
@@ -50,7 +57,8 @@ void _scmin(size_t m, size_t n, const real_t *a, real_t *b) {
 void _srmax(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa =a;
-  for (j=0; j<m; ++j) b[j] = DBL_MIN;
+  if (_D2_USE_AVX2) {_srmax_avx2(m, n, a, b); return;}
+  for (j=0; j<m; ++j) b[j] = -FLT_MAX;
   for (i=0; i<n; ++i, pa += m) {
     for (j=0; j<m; ++j)
       b[j] = MAX(b[j], pa[j]);
@@ -61,18 +69,44 @@ void _srmax(size_t m, size_t n, const real_t *a, real_t *b) {
 void _srmin(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa =a;
-  for (j=0; j<m; ++j) b[j] = DBL_MAX;
+  if (_D2_USE_AVX2) {_srmin_avx2(m, n, a, b); return;}
+  for (j=0; j<m; ++j) b[j] = FLT_MAX;
   for (i=0; i<n; ++i, pa += m) {
     for (j=0; j<m; ++j)
       b[j] = MIN(b[j], pa[j]);
   }
 }
 
+// c = cmax(-a(:,*) .+ b), without forming -a(:,*) .+ b
+void _sgcmv2_cmax(size_t m, size_t n, const real_t *a, const real_t *b, real_t *c) {
+  size_t i,j;
+  const real_t *pa = a;
+  if (_D2_USE_AVX2) {_sgcmv2_cmax_avx2(m, n, a, b, c); return;}
+  for (j=0; j<n; ++j, pa += m) {
+    c[j] = -FLT_MAX;
+    for (i=0; i<m; ++i)
+      c[j] = MAX(c[j], b[i] - pa[i]);
+  }
+}
+
+// c = rmin(a(*,:) .+ b), without forming a(*,:) .+ b
+void _sgrmv_rmin(size_t m, size_t n, const real_t *a, const real_t *b, real_t *c) {
+  size_t i,j;
+  const real_t *pa = a;
+  if (_D2_USE_AVX2) {_sgrmv_rmin_avx2(m, n, a, b, c); return;}
+  for (j=0; j<m; ++j) c[j] = FLT_MAX;
+  for (i=0; i<n; ++i, pa += m) {
+    for (j=0; j<m; ++j)
+      c[j] = MIN(c[j], pa[j] + b[i]);
+  }
+}
+
 // a(:,*) = a(:,*) .+ b
 void _sgcmv(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa;
   const real_t *pb;
+  if (_D2_USE_AVX2) {_sgcmv_avx2(m, n, a, b); return;}
   for (i=0,pa=a; i<n; ++i)
     for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
       *pa += *pb;
@@ -83,6 +117,7 @@ void _sgcmv2(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa;
   const real_t *pb;
+  if (_D2_USE_AVX2) {_sgcmv2_avx2(m, n, a, b); return;}
   for (i=0,pa=a; i<n; ++i)
     for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
       *pa = -*pa + *pb;
@@ -93,6 +128,7 @@ void _sgrmv(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa =a;
   const real_t *pb =b;
+  if (_D2_USE_AVX2) {_sgrmv_avx2(m, n, a, b); return;}
   for (i=0; i<n; ++i,++pb)
     for (j=0; j<m; ++j, ++pa)
       *pa += *pb;
@@ -103,6 +139,7 @@ void _sgcms(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa = a;
   const real_t *pb;
+  if (_D2_USE_AVX2) {_sgcms_avx2(m, n, a, b); return;}
   for (i=0; i<n; ++i)
     for (j=0, pb=b; j<m; ++j, ++pa, ++pb)
       *pa *= *pb;
@@ -113,6 +150,7 @@ void _sgrms(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa = a;
   const real_t *pb = b;
+  if (_D2_USE_AVX2) {_sgrms_avx2(m, n, a, b); return;}
   for (i=0; i<n; ++i,++pb)
     for (j=0; j<m; ++j, ++pa)
       *pa *= *pb;
@@ -124,6 +162,7 @@ void _sicms(size_t m, size_t n, real_t *a, const real_t *b) {
   real_t *pa;
   const real_t *pb;
   for (j=0; j<m; ++j) assert(b[j] > 0);
+  if (_D2_USE_AVX2) {_sicms_avx2(m, n, a, b); return;}
   for (i=0,pa=a; i<n; ++i)
     for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
       *pa /= *pb;
@@ -135,6 +174,7 @@ void _sirms(size_t m, size_t n, real_t *a, const real_t *b) {
   real_t *pa;
   const real_t *pb;
   for (i=0; i<n; ++i) assert(b[i] > 0);
+  if (_D2_USE_AVX2) {_sirms_avx2(m, n, a, b); return;}
   for (i=0,pa=a,pb=b; i<n; ++i,++pb) {
     for (j=0; j<m; ++j, ++pa)
       *pa /= *pb;
@@ -146,10 +186,12 @@ void _scsum(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa;
   real_t *pb;
+  if (_D2_USE_AVX2) {_scsum_avx2(m, n, a, b); return;}
   for (i=0,pa=a,pb=b; i<n; ++i, ++pb) {
-    *pb = 0;
+    acc_t s = 0;
     for (j=0; j<m; ++j, ++pa)
-      *pb += *pa;
+      s += *pa;
+    *pb = s;
   }
 }
 
@@ -159,8 +201,10 @@ void _scsum2(size_t m, size_t n, const real_t *a, real_t *b) {
   const real_t *pa;
   real_t *pb;
   for (i=0,pa=a,pb=b; i<n; ++i, ++pb) {
+    acc_t s = *pb;
     for (j=0; j<m; ++j, ++pa)
-      *pb += *pa;
+      s += *pa;
+    *pb = s;
   }
 }
 
@@ -170,11 +214,21 @@ void _srsum(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa;
   real_t *pb;
-  for (j=0,pb=b; j<m; ++j, ++pb) 
-    *pb = 0;
-  for (i=0,pa=a; i<n; ++i)
-    for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
-      *pb += *pa;  
+  size_t j0, mb;
+  acc_t s[_D2_RSUM_BLOCK];
+  if (_D2_USE_AVX2) {_srsum_avx2(m, n, a, b); return;}
+  // rows are summed in blocks whose accumulators stay on the stack, and
+  // each block is read column by column, contiguously
+  for (j0=0; j0<m; j0+=mb) {
+    mb = MIN(m - j0, _D2_RSUM_BLOCK);
+    for (j=0; j<mb; ++j)
+      s[j] = 0;
+    for (i=0,pa=a+j0; i<n; ++i, pa+=m)
+      for (j=0; j<mb; ++j)
+	s[j] += pa[j];
+    for (j=0,pb=b+j0; j<mb; ++j, ++pb)
+      *pb = s[j];
+  }
 }
 
 // b(*) += sum(a(*,:))
@@ -264,16 +318,118 @@ void _svmul(size_t n, const real_t *a, const real_t *b, real_t *c) {
     *c = (*a) * (*b);
 }
 
+// b(*) = sum(a(:,*).^2)
+void _scsqnorm(size_t m, size_t n, const real_t *a, real_t *b) {
+  size_t i,j;
+  const real_t *pa;
+  real_t *pb;
+  for (i=0,pa=a,pb=b; i<n; ++i, ++pb) {
+    acc_t s = 0;
+    for (j=0; j<m; ++j, ++pa)
+      s += (*pa) * (*pa);
+    *pb = s;
+  }
+}
+
+/* direct kernel for small shapes: 4 x 2 blocks of C are accumulated in 
+ * registers while running over the dimension d */
+void _spdist2_direct(const size_t d, const size_t n, const size_t m,
+		     const real_t * A, const real_t * B, real_t *C) {
+  size_t i, j, k;
+  for (j=0; j+1<m; j+=2) {
+    const real_t *b0 = B + j*d, *b1 = b0 + d;
+    for (i=0; i+3<n; i+=4) {
+      const real_t *a0 = A + i*d, *a1 = a0 + d, *a2 = a1 + d, *a3 = a2 + d;
+      real_t c00=0, c10=0, c20=0, c30=0, c01=0, c11=0, c21=0, c31=0, t;
+      for (k=0; k<d; ++k) {
+	t = a0[k] - b0[k]; c00 += t*t;
+	t = a1[k] - b0[k]; c10 += t*t;
+	t = a2[k] - b0[k]; c20 += t*t;
+	t = a3[k] - b0[k]; c30 += t*t;
+	t = a0[k] - b1[k]; c01 += t*t;
+	t = a1[k] - b1[k]; c11 += t*t;
+	t = a2[k] - b1[k]; c21 += t*t;
+	t = a3[k] - b1[k]; c31 += t*t;
+      }
+      C[j*n+i] = c00; C[j*n+i+1] = c10; C[j*n+i+2] = c20; C[j*n+i+3] = c30;
+      C[j*n+n+i] = c01; C[j*n+n+i+1] = c11; C[j*n+n+i+2] = c21; C[j*n+n+i+3] = c31;
+    }
+    for (; i<n; ++i) {
+      const real_t *a0 = A + i*d;
+      real_t c00=0, c01=0, t;
+      for (k=0; k<d; ++k) {
+	t = a0[k] - b0[k]; c00 += t*t;
+	t = a0[k] - b1[k]; c01 += t*t;
+      }
+      C[j*n+i] = c00; C[j*n+n+i] = c01;
+    }
+  }
+  for (; j<m; ++j) {
+    const real_t *b0 = B + j*d;
+    for (i=0; i<n; ++i) {
+      const real_t *a0 = A + i*d;
+      real_t c00=0, t;
+      for (k=0; k<d; ++k) {
+	t = a0[k] - b0[k]; c00 += t*t;
+      }
+      C[j*n+i] = c00;
+    }
+  }
+}
+
+/* dimension-major A: every column of C is accumulated over the rows of At,
+ * which are contiguous and aligned */
+void _spdist2_dmajor(const size_t d, const size_t n, const size_t m,
+		     const real_t * At, const size_t lda, const real_t * B, real_t *C) {
+  size_t i, j, k;
+  if (_D2_USE_AVX2) {_spdist2_dmajor_avx2(d, n, m, At, lda, B, C); return;}
+  for (j=0; j<m; ++j, B+=d, C+=n) {
+    for (i=0; i<n; ++i) C[i] = 0;
+    for (k=0; k<d; ++k) {
+      const real_t *a = At + k*lda, b = B[k];
+      for (i=0; i<n; ++i) C[i] += (a[i] - b) * (a[i] - b);
+    }
+  }
+}
+
 void _spdist2(const size_t d, const size_t n, const size_t m, 
 	      const real_t * A, const real_t * B, real_t *C) {
-  size_t i, j, ki, kj, k;
+  if (!_D2_PDIST2_USE_GEMM(d, n, m))
+    _spdist2_direct(d, n, m, A, B, C);
+  else
+    _spdist2_norm(d, n, m, A, B, NULL, NULL, C);
+}
+
+void _spdist2_norm(const size_t d, const size_t n, const size_t m,
+		   const real_t * A, const real_t * B, 
+		   const real_t *An, const real_t *Bn, real_t *C) {
+  size_t i, j;
+  real_t *pC;
+  real_t *An_tmp = NULL, *Bn_tmp = NULL;
   assert(d>0 && n>0 && m>0);
 
-  for (i=0; i<m*n; ++i) C[i] = 0;
-  for (i=0; i<m; ++i)
-    for (j=0; j<n; ++j)
-      for (k=0, kj=j*d, ki=i*d; k<d; ++k, ++kj, ++ki) 
-	C[i*n + j] += (A[kj] -  B[ki]) * (A[kj] -  B[ki]);
+  // norms that are not given are computed in temporary buffers, and the
+  // direct kernel is used if they cannot be allocated
+  if (!An) An = An_tmp = _D2_MALLOC_SCALAR(n);
+  if (!Bn) Bn = Bn_tmp = _D2_MALLOC_SCALAR(m);
+  if (!An || !Bn) {
+    _D2_FREE(An_tmp); _D2_FREE(Bn_tmp);
+    _spdist2_direct(d, n, m, A, B, C);
+    return;
+  }
+  if (An_tmp) _scsqnorm(d, n, A, An_tmp);
+  if (Bn_tmp) _scsqnorm(d, m, B, Bn_tmp);
+
+  // C = ||a||^2 + ||b||^2 - 2 A' * B
+  cblas_sgemm(CblasColMajor, CblasTrans, CblasNoTrans, n, m, d, -2., A, d, B, d, 0., C, n);
+  for (j=0, pC=C; j<m; ++j)
+    for (i=0; i<n; ++i, ++pC) {
+      *pC += An[i] + Bn[j];
+      if (*pC < 0) *pC = 0; // rounding errors
+    }
+
+  if (An_tmp) _D2_FREE(An_tmp);
+  if (Bn_tmp) _D2_FREE(Bn_tmp);
 }
 
 void _spdist2_sym(const size_t d, const size_t n, const size_t m, const real_t *A, const index_t *Bi, real_t *C, const real_t *vocab) {
@@ -320,5 +476,14 @@ void _spdist_symbolic(const size_t d, const size_t n, const size_t m,
 // inplace a -> exp(a)
 void _sexp(size_t n, real_t *a) {
   size_t i;
+  if (_D2_USE_AVX2) {_sexp_avx2(n, a); return;}
   for (i=0; i<n; ++i, ++a) *a = exp(*a);
 }
+
+// a(i) = -log(u) with u = ((h >> 12) + .5) * 2^-52 in (0,1), h = _d2_counter_hash(key, ctr+i)
+void _sexprnd(size_t n, unsigned long long key, unsigned long long ctr, real_t *a) {
+  size_t i;
+  if (_D2_USE_AVX2) {_sexprnd_avx2(n, key, ctr, a); return;}
+  for (i=0; i<n; ++i)
+    a[i] = (real_t) -log(((_d2_counter_hash(key, ctr + i) >> 12) + .5) * 2.220446049250313E-16);
+}
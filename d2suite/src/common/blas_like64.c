@@ -5,6 +5,7 @@
 
 #include "blas_like.h"
 #include "blas_util.h"
+#include "blas_like_avx.h"
 #include <stdio.h>
 #include <assert.h>
 #include <stdint.h>
@@ -29,10 +30,11 @@ void _dadd(size_t n, real_t *a, real_t b) {
 void _dcmax(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa = a;
-  for (j=0; j<n; ++j) b[j] = DBL_MIN;
-  for (i=0; i<m; ++i, ++pa) {
-    for (j=0; j<n; ++j)
-      b[j] = MAX(b[j], pa[j*m]);
+  if (_D2_USE_AVX2) {_dcmax_avx2(m, n, a, b); return;}
+  for (j=0; j<n; ++j, pa += m) {
+    b[j] = -DBL_MAX;
+    for (i=0; i<m; ++i)
+      b[j] = MAX(b[j], pa[i]);
   }
 }
 
@@ -40,10 +42,11 @@ void _dcmax(size_t m, size_t n, const real_t *a, real_t *b) {
 void _dcmin(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa = a;
-  for (j=0; j<n; ++j) b[j] = DBL_MAX;
-  for (i=0; i<m; ++i, ++pa) {
-    for (j=0; j<n; ++j)
-      b[j] = MIN(b[j], pa[j*m]);
+  if (_D2_USE_AVX2) {_dcmin_avx2(m, n, a, b); return;}
+  for (j=0; j<n; ++j, pa += m) {
+    b[j] = DBL_MAX;
+    for (i=0; i<m; ++i)
+      b[j] = MIN(b[j], pa[i]);
   }
 }
 
@@ -51,7 +54,8 @@ void _dcmin(size_t m, size_t n, const real_t *a, real_t *b) {
 void _drmax(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa =a;
-  for (j=0; j<m; ++j) b[j] = DBL_MIN;
+  if (_D2_USE_AVX2) {_drmax_avx2(m, n, a, b); return;}
+  for (j=0; j<m; ++j) b[j] = -DBL_MAX;
   for (i=0; i<n; ++i, pa += m) {
     for (j=0; j<m; ++j)
       b[j] = MAX(b[j], pa[j]);
@@ -62,6 +66,7 @@ void _drmax(size_t m, size_t n, const real_t *a, real_t *b) {
 void _drmin(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa =a;
+  if (_D2_USE_AVX2) {_drmin_avx2(m, n, a, b); return;}
   for (j=0; j<m; ++j) b[j] = DBL_MAX;
   for (i=0; i<n; ++i, pa += m) {
     for (j=0; j<m; ++j)
@@ -69,11 +74,36 @@ void _drmin(size_t m, size_t n, const real_t *a, real_t *b) {
   }
 }
 
+// c = cmax(-a(:,*) .+ b), without forming -a(:,*) .+ b
+void _dgcmv2_cmax(size_t m, size_t n, const real_t *a, const real_t *b, real_t *c) {
+  size_t i,j;
+  const real_t *pa = a;
+  if (_D2_USE_AVX2) {_dgcmv2_cmax_avx2(m, n, a, b, c); return;}
+  for (j=0; j<n; ++j, pa += m) {
+    c[j] = -DBL_MAX;
+    for (i=0; i<m; ++i)
+      c[j] = MAX(c[j], b[i] - pa[i]);
+  }
+}
+
+// c = rmin(a(*,:) .+ b), without forming a(*,:) .+ b
+void _dgrmv_rmin(size_t m, size_t n, const real_t *a, const real_t *b, real_t *c) {
+  size_t i,j;
+  const real_t *pa = a;
+  if (_D2_USE_AVX2) {_dgrmv_rmin_avx2(m, n, a, b, c); return;}
+  for (j=0; j<m; ++j) c[j] = DBL_MAX;
+  for (i=0; i<n; ++i, pa += m) {
+    for (j=0; j<m; ++j)
+      c[j] = MIN(c[j], pa[j] + b[i]);
+  }
+}
+
 // a(:,*) = a(:,*) .+ b
 void _dgcmv(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa;
   const real_t *pb;
+  if (_D2_USE_AVX2) {_dgcmv_avx2(m, n, a, b); return;}
   for (i=0,pa=a; i<n; ++i)
     for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
       *pa += *pb;
@@ -84,6 +114,7 @@ void _dgcmv2(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa;
   const real_t *pb;
+  if (_D2_USE_AVX2) {_dgcmv2_avx2(m, n, a, b); return;}
   for (i=0,pa=a; i<n; ++i)
     for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
       *pa = -*pa + *pb;
@@ -94,6 +125,7 @@ void _dgrmv(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa =a;
   const real_t *pb =b;
+  if (_D2_USE_AVX2) {_dgrmv_avx2(m, n, a, b); return;}
   for (i=0; i<n; ++i,++pb)
     for (j=0; j<m; ++j, ++pa)
       *pa += *pb;
@@ -104,6 +136,7 @@ void _dgcms(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa = a;
   const real_t *pb;
+  if (_D2_USE_AVX2) {_dgcms_avx2(m, n, a, b); return;}
   for (i=0; i<n; ++i)
     for (j=0, pb=b; j<m; ++j, ++pa, ++pb)
       *pa *= *pb;
@@ -114,6 +147,7 @@ void _dgrms(size_t m, size_t n, real_t *a, const real_t *b) {
   size_t i,j;
   real_t *pa = a;
   const real_t *pb = b;
+  if (_D2_USE_AVX2) {_dgrms_avx2(m, n, a, b); return;}
   for (i=0; i<n; ++i,++pb)
     for (j=0; j<m; ++j, ++pa)
       *pa *= *pb;
@@ -125,6 +159,7 @@ void _dicms(size_t m, size_t n, real_t *a, const real_t *b) {
   real_t *pa;
   const real_t *pb;
   for (j=0; j<m; ++j) assert(b[j] > 0);
+  if (_D2_USE_AVX2) {_dicms_avx2(m, n, a, b); return;}
   for (i=0,pa=a; i<n; ++i)
     for (j=0,pb=b; j<m; ++j, ++pa, ++pb)
       *pa /= *pb;
@@ -136,6 +171,7 @@ void _dirms(size_t m, size_t n, real_t *a, const real_t *b) {
   real_t *pa;
   const real_t *pb;
   for (i=0; i<n; ++i) assert(b[i] > 0);
+  if (_D2_USE_AVX2) {_dirms_avx2(m, n, a, b); return;}
   for (i=0,pa=a,pb=b; i<n; ++i,++pb) {
     for (j=0; j<m; ++j, ++pa)
       *pa /= *pb;
@@ -147,6 +183,7 @@ void _dcsum(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa;
   real_t *pb;
+  if (_D2_USE_AVX2) {_dcsum_avx2(m, n, a, b); return;}
   for (i=0,pa=a,pb=b; i<n; ++i, ++pb) {
     *pb = 0;
     for (j=0; j<m; ++j, ++pa)
@@ -171,6 +208,7 @@ void _drsum(size_t m, size_t n, const real_t *a, real_t *b) {
   size_t i,j;
   const real_t *pa;
   real_t *pb;
+  if (_D2_USE_AVX2) {_drsum_avx2(m, n, a, b); return;}
   for (j=0,pb=b; j<m; ++j, ++pb) 
     *pb = 0;
   for (i=0,pa=a; i<n; ++i)
@@ -265,16 +303,117 @@ void _dvmul(size_t n, const real_t *a, const real_t *b, real_t *c) {
     *c = (*a) * (*b);
 }
 
+// b(*) = sum(a(:,*).^2)
+void _dcsqnorm(size_t m, size_t n, const real_t *a, real_t *b) {
+  size_t i,j;
+  const real_t *pa;
+  real_t *pb;
+  for (i=0,pa=a,pb=b; i<n; ++i, ++pb) {
+    *pb = 0;
+    for (j=0; j<m; ++j, ++pa)
+      *pb += (*pa) * (*pa);
+  }
+}
+
+/* direct kernel for small shapes: 4 x 2 blocks of C are accumulated in 
+ * registers while running over the dimension d */
+void _dpdist2_direct(const size_t d, const size_t n, const size_t m,
+		     const real_t * A, const real_t * B, real_t *C) {
+  size_t i, j, k;
+  for (j=0; j+1<m; j+=2) {
+    const real_t *b0 = B + j*d, *b1 = b0 + d;
+    for (i=0; i+3<n; i+=4) {
+      const real_t *a0 = A + i*d, *a1 = a0 + d, *a2 = a1 + d, *a3 = a2 + d;
+      real_t c00=0, c10=0, c20=0, c30=0, c01=0, c11=0, c21=0, c31=0, t;
+      for (k=0; k<d; ++k) {
+	t = a0[k] - b0[k]; c00 += t*t;
+	t = a1[k] - b0[k]; c10 += t*t;
+	t = a2[k] - b0[k]; c20 += t*t;
+	t = a3[k] - b0[k]; c30 += t*t;
+	t = a0[k] - b1[k]; c01 += t*t;
+	t = a1[k] - b1[k]; c11 += t*t;
+	t = a2[k] - b1[k]; c21 += t*t;
+	t = a3[k] - b1[k]; c31 += t*t;
+      }
+      C[j*n+i] = c00; C[j*n+i+1] = c10; C[j*n+i+2] = c20; C[j*n+i+3] = c30;
+      C[j*n+n+i] = c01; C[j*n+n+i+1] = c11; C[j*n+n+i+2] = c21; C[j*n+n+i+3] = c31;
+    }
+    for (; i<n; ++i) {
+      const real_t *a0 = A + i*d;
+      real_t c00=0, c01=0, t;
+      for (k=0; k<d; ++k) {
+	t = a0[k] - b0[k]; c00 += t*t;
+	t = a0[k] - b1[k]; c01 += t*t;
+      }
+      C[j*n+i] = c00; C[j*n+n+i] = c01;
+    }
+  }
+  for (; j<m; ++j) {
+    const real_t *b0 = B + j*d;
+    for (i=0; i<n; ++i) {
+      const real_t *a0 = A + i*d;
+      real_t c00=0, t;
+      for (k=0; k<d; ++k) {
+	t = a0[k] - b0[k]; c00 += t*t;
+      }
+      C[j*n+i] = c00;
+    }
+  }
+}
+
+/* dimension-major A: every column of C is accumulated over the rows of At,
+ * which are contiguous and aligned */
+void _dpdist2_dmajor(const size_t d, const size_t n, const size_t m,
+		     const real_t * At, const size_t lda, const real_t * B, real_t *C) {
+  size_t i, j, k;
+  if (_D2_USE_AVX2) {_dpdist2_dmajor_avx2(d, n, m, At, lda, B, C); return;}
+  for (j=0; j<m; ++j, B+=d, C+=n) {
+    for (i=0; i<n; ++i) C[i] = 0;
+    for (k=0; k<d; ++k) {
+      const real_t *a = At + k*lda, b = B[k];
+      for (i=0; i<n; ++i) C[i] += (a[i] - b) * (a[i] - b);
+    }
+  }
+}
+
 void _dpdist2(const size_t d, const size_t n, const size_t m, 
 	      const real_t * A, const real_t * B, real_t *C) {
-  size_t i, j, ki, kj, k;
+  if (!_D2_PDIST2_USE_GEMM(d, n, m))
+    _dpdist2_direct(d, n, m, A, B, C);
+  else
+    _dpdist2_norm(d, n, m, A, B, NULL, NULL, C);
+}
+
+void _dpdist2_norm(const size_t d, const size_t n, const size_t m,
+		   const real_t * A, const real_t * B, 
+		   const real_t *An, const real_t *Bn, real_t *C) {
+  size_t i, j;
+  real_t *pC;
+  real_t *An_tmp = NULL, *Bn_tmp = NULL;
   assert(d>0 && n>0 && m>0);
 
-  for (i=0; i<m*n; ++i) C[i] = 0;
-  for (i=0; i<m; ++i)
-    for (j=0; j<n; ++j)
-      for (k=0, kj=j*d, ki=i*d; k<d; ++k, ++kj, ++ki) 
-	C[i*n + j] += (A[kj] -  B[ki]) * (A[kj] -  B[ki]);
+  // norms that are not given are computed in temporary buffers, and the
+  // direct kernel is used if they cannot be allocated
+  if (!An) An = An_tmp = _D2_MALLOC_SCALAR(n);
+  if (!Bn) Bn = Bn_tmp = _D2_MALLOC_SCALAR(m);
+  if (!An || !Bn) {
+    _D2_FREE(An_tmp); _D2_FREE(Bn_tmp);
+    _dpdist2_direct(d, n, m, A, B, C);
+    return;
+  }
+  if (An_tmp) _dcsqnorm(d, n, A, An_tmp);
+  if (Bn_tmp) _dcsqnorm(d, m, B, Bn_tmp);
+
+  // C = ||a||^2 + ||b||^2 - 2 A' * B
+  cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, n, m, d, -2., A, d, B, d, 0., C, n);
+  for (j=0, pC=C; j<m; ++j)
+    for (i=0; i<n; ++i, ++pC) {
+      *pC += An[i] + Bn[j];
+      if (*pC < 0) *pC = 0; // rounding errors
+    }
+
+  if (An_tmp) _D2_FREE(An_tmp);
+  if (Bn_tmp) _D2_FREE(Bn_tmp);
 }
 
 void _dpdist2_sym(const size_t d, const size_t n, const size_t m, const real_t *A, const index_t *Bi, real_t *C, const real_t *vocab) {
@@ -321,5 +460,14 @@ void _dpdist_symbolic(const size_t d, const size_t n, const size_t m,
 // inplace a -> exp(a)
 void _dexp(size_t n, real_t *a) {
   size_t i;
+  if (_D2_USE_AVX2) {_dexp_avx2(n, a); return;}
   for (i=0; i<n; ++i, ++a) *a = exp(*a);
 }
+
+// a(i) = -log(u) with u = ((h >> 12) + .5) * 2^-52 in (0,1), h = _d2_counter_hash(key, ctr+i)
+void _dexprnd(size_t n, unsigned long long key, unsigned long long ctr, real_t *a) {
+  size_t i;
+  if (_D2_USE_AVX2) {_dexprnd_avx2(n, key, ctr, a); return;}
+  for (i=0; i<n; ++i)
+    a[i] = (real_t) -log(((_d2_counter_hash(key, ctr + i) >> 12) + .5) * 2.220446049250313E-16);
+}
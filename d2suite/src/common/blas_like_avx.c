@@ -0,0 +1,707 @@
+#include "blas_like.h"
+#include "blas_like_avx.h"
+#include <float.h>
+#include <math.h>
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+/* -1: not checked yet, 0: scalar kernels, 1: AVX2 kernels */
+static int simd_level = -1;
+
+#ifdef _D2_HAVE_AVX2
+
+#include <immintrin.h>
+
+static int _d2_cpu_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+int _d2_simd_avx2() {
+  if (simd_level < 0) simd_level = _d2_cpu_avx2();
+  return simd_level;
+}
+
+int _d2_simd_enable(int enable) {
+  simd_level = enable && _d2_cpu_avx2();
+  return simd_level;
+}
+
+#define AVX2 __attribute__((target("avx2,fma")))
+#define DW 4
+#define SW 8
+
+AVX2 static inline double _dhmax_avx2(__m256d v) {
+  __m128d x = _mm_max_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_max_sd(x, _mm_unpackhi_pd(x, x)));
+}
+AVX2 static inline double _dhmin_avx2(__m256d v) {
+  __m128d x = _mm_min_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_min_sd(x, _mm_unpackhi_pd(x, x)));
+}
+AVX2 static inline double _dhsum_avx2(__m256d v) {
+  __m128d x = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(x, _mm_unpackhi_pd(x, x)));
+}
+
+AVX2 static inline float _shmax_avx2(__m256 v) {
+  __m128 x = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+  return _mm_cvtss_f32(_mm_max_ss(x, _mm_shuffle_ps(x, x, 1)));
+}
+AVX2 static inline float _shmin_avx2(__m256 v) {
+  __m128 x = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  x = _mm_min_ps(x, _mm_movehl_ps(x, x));
+  return _mm_cvtss_f32(_mm_min_ss(x, _mm_shuffle_ps(x, x, 1)));
+}
+AVX2 static inline float _shsum_avx2(__m256 v) {
+  __m128 x = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+  return _mm_cvtss_f32(_mm_add_ss(x, _mm_shuffle_ps(x, x, 1)));
+}
+
+/* exp(x) = 2^k * exp(r) with k = round(x / ln2) and |r| <= ln2 / 2, where 
+ * exp(r) is evaluated by its Taylor polynomial (degree 13 for double and 7 
+ * for float) and 2^k is assembled in the exponent bits. Results that 
+ * underflow are flushed to zero. */
+AVX2 static inline __m256d _dexp4_avx2(__m256d x) {
+  const __m256d lo = _mm256_set1_pd(-708.39641853226408);
+  const __m256d hi = _mm256_set1_pd(709.08956571282405); // 1023 * ln2
+  __m256d underflow = _mm256_cmp_pd(x, lo, _CMP_LT_OQ);
+  __m256d overflow = _mm256_cmp_pd(x, _mm256_set1_pd(709.78271289338397), _CMP_GT_OQ);
+  __m256d xc = _mm256_min_pd(_mm256_max_pd(x, lo), hi);
+  __m256d k = _mm256_round_pd(_mm256_mul_pd(xc, _mm256_set1_pd(1.4426950408889634)),
+			      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(6.93145751953125E-1), xc);
+  r = _mm256_fnmadd_pd(k, _mm256_set1_pd(1.42860682030941723212E-6), r);
+
+  __m256d p = _mm256_set1_pd(1.6059043836821613e-10); // 1/13!
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(2.08767569878681e-09));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(2.505210838544172e-08));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(2.755731922398589e-07));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(2.755731922398589e-06));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(2.48015873015873e-05));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.0001984126984126984));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.001388888888888889));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.008333333333333333));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.041666666666666664));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.16666666666666666));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(0.5));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.));
+  p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.));
+
+  __m256i e = _mm256_cvtepi32_epi64(_mm256_cvtpd_epi32(k));
+  e = _mm256_slli_epi64(_mm256_add_epi64(e, _mm256_set1_epi64x(1023)), 52);
+  p = _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+  p = _mm256_andnot_pd(underflow, p);
+  return _mm256_blendv_pd(p, _mm256_set1_pd(HUGE_VAL), overflow);
+}
+
+AVX2 static inline __m256 _sexp8_avx2(__m256 x) {
+  const __m256 lo = _mm256_set1_ps(-87.3365448f);
+  const __m256 hi = _mm256_set1_ps(88.0296919f); // 127 * ln2
+  __m256 underflow = _mm256_cmp_ps(x, lo, _CMP_LT_OQ);
+  __m256 overflow = _mm256_cmp_ps(x, _mm256_set1_ps(88.7228391f), _CMP_GT_OQ);
+  __m256 xc = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+  __m256 k = _mm256_round_ps(_mm256_mul_ps(xc, _mm256_set1_ps(1.44269504f)),
+			     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(0.693359375f), xc);
+  r = _mm256_fnmadd_ps(k, _mm256_set1_ps(-2.12194440e-4f), r);
+
+  __m256 p = _mm256_set1_ps(1.98412698e-4f); // 1/7!
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.38888889e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.33333333e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.16666667e-2f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.66666667e-1f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(0.5f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.f));
+
+  __m256i e = _mm256_cvtps_epi32(k);
+  e = _mm256_slli_epi32(_mm256_add_epi32(e, _mm256_set1_epi32(127)), 23);
+  p = _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+  p = _mm256_andnot_ps(underflow, p);
+  return _mm256_blendv_ps(p, _mm256_set1_ps(HUGE_VALF), overflow);
+}
+
+/* log(x) for positive normal x = 2^k * f with f in [sqrt(1/2), sqrt(2)),
+ * where log(f) = 2 atanh(s), s = (f-1)/(f+1), |s| < 0.172, is evaluated by 
+ * its series up to s^21 */
+AVX2 static inline __m256d _dlog4_avx2(__m256d x) {
+  const __m256i bits = _mm256_castpd_si256(x);
+  __m256i k = _mm256_srli_epi64(bits, 52);
+  __m256d f = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(0x000FFFFFFFFFFFFFLL)),
+						   _mm256_set1_epi64x(0x3FF0000000000000LL)));
+  const __m256d big = _mm256_cmp_pd(f, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+  f = _mm256_blendv_pd(f, _mm256_mul_pd(f, _mm256_set1_pd(.5)), big);
+  k = _mm256_sub_epi64(k, _mm256_castpd_si256(big)); // + 1 where f was halved
+  // the biased exponent as a double, through the bits of 2^52 + k
+  __m256d e = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(k, _mm256_set1_epi64x(0x4330000000000000LL))),
+			    _mm256_set1_pd(4503599627370496. + 1023.));
+
+  const __m256d s = _mm256_div_pd(_mm256_sub_pd(f, _mm256_set1_pd(1.)), _mm256_add_pd(f, _mm256_set1_pd(1.)));
+  const __m256d s2 = _mm256_mul_pd(s, s);
+  __m256d p = _mm256_set1_pd(1./21);
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./19));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./17));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./15));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./13));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./11));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./9));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./7));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./5));
+  p = _mm256_fmadd_pd(p, s2, _mm256_set1_pd(1./3));
+  p = _mm256_mul_pd(_mm256_mul_pd(p, s2), _mm256_add_pd(s, s)); // log(f) - 2s
+
+  // k ln2 + 2s + p, with ln2 split into a high part exact in k * ln2_hi
+  p = _mm256_fmadd_pd(e, _mm256_set1_pd(1.90821492927058770002E-10), p);
+  p = _mm256_add_pd(p, _mm256_add_pd(s, s));
+  return _mm256_fmadd_pd(e, _mm256_set1_pd(6.93147180369123816490E-1), p);
+}
+
+/* 64-bit products of the lanes, which AVX2 lacks, from 32-bit ones */
+AVX2 static inline __m256i _mul64_avx2(__m256i a, __m256i b) {
+  const __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+					 _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+}
+
+/* standard exponential variates of the hashes x of DW consecutive counters
+ * (see _d2_counter_hash); the uniform in (0,1) is 1 + (h >> 12) 2^-52 from
+ * the bits, minus 1 - 2^-53, which is exact */
+AVX2 static inline __m256d _dexprnd4_avx2(__m256i x) {
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 30));
+  x = _mul64_avx2(x, _mm256_set1_epi64x((long long) 0xBF58476D1CE4E5B9ULL));
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 27));
+  x = _mul64_avx2(x, _mm256_set1_epi64x((long long) 0x94D049BB133111EBULL));
+  x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 31));
+  x = _mm256_or_si256(_mm256_srli_epi64(x, 12), _mm256_set1_epi64x(0x3FF0000000000000LL));
+  const __m256d u = _mm256_sub_pd(_mm256_castsi256_pd(x), _mm256_set1_pd(1. - 1.1102230246251565E-16));
+  return _mm256_sub_pd(_mm256_setzero_pd(), _dlog4_avx2(u));
+}
+
+/* key + (ctr+1+k) * 0x9E3779B97F4A7C15 for the lanes k, and the step of DW counters */
+#define _D2_COUNTER_LANES(key, ctr) \
+  _mm256_setr_epi64x((long long) ((key) + ((ctr) + 1) * 0x9E3779B97F4A7C15ULL), \
+		     (long long) ((key) + ((ctr) + 2) * 0x9E3779B97F4A7C15ULL), \
+		     (long long) ((key) + ((ctr) + 3) * 0x9E3779B97F4A7C15ULL), \
+		     (long long) ((key) + ((ctr) + 4) * 0x9E3779B97F4A7C15ULL))
+#define _D2_COUNTER_STEP _mm256_set1_epi64x((long long) (DW * 0x9E3779B97F4A7C15ULL))
+
+// inplace a -> exp(a)
+AVX2 void _dexp_avx2(size_t n, double *a) {
+  size_t i;
+  for (i=0; i+DW<=n; i+=DW)
+    _mm256_storeu_pd(a+i, _dexp4_avx2(_mm256_loadu_pd(a+i)));
+  if (i<n) {
+    double buf[DW] = {0};
+    size_t k;
+    for (k=0; i+k<n; ++k) buf[k] = a[i+k];
+    _mm256_storeu_pd(buf, _dexp4_avx2(_mm256_loadu_pd(buf)));
+    for (k=0; i+k<n; ++k) a[i+k] = buf[k];
+  }
+}
+
+// inplace a -> exp(a)
+AVX2 void _sexp_avx2(size_t n, float *a) {
+  size_t i;
+  for (i=0; i+SW<=n; i+=SW)
+    _mm256_storeu_ps(a+i, _sexp8_avx2(_mm256_loadu_ps(a+i)));
+  if (i<n) {
+    float buf[SW] = {0};
+    size_t k;
+    for (k=0; i+k<n; ++k) buf[k] = a[i+k];
+    _mm256_storeu_ps(buf, _sexp8_avx2(_mm256_loadu_ps(buf)));
+    for (k=0; i+k<n; ++k) a[i+k] = buf[k];
+  }
+}
+
+// a(i) = -log(u(key, ctr+i))
+AVX2 void _dexprnd_avx2(size_t n, unsigned long long key, unsigned long long ctr, double *a) {
+  size_t i;
+  __m256i x = _D2_COUNTER_LANES(key, ctr);
+  for (i=0; i+DW<=n; i+=DW, x = _mm256_add_epi64(x, _D2_COUNTER_STEP))
+    _mm256_storeu_pd(a+i, _dexprnd4_avx2(x));
+  if (i<n) _mm256_maskstore_pd(a+i, _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long) (n-i)),
+						       _mm256_setr_epi64x(0, 1, 2, 3)),
+			       _dexprnd4_avx2(x));
+}
+
+// a(i) = -log(u(key, ctr+i)), drawn in double and rounded
+AVX2 void _sexprnd_avx2(size_t n, unsigned long long key, unsigned long long ctr, float *a) {
+  size_t i;
+  __m256i x = _D2_COUNTER_LANES(key, ctr);
+  for (i=0; i+DW<=n; i+=DW, x = _mm256_add_epi64(x, _D2_COUNTER_STEP))
+    _mm_storeu_ps(a+i, _mm256_cvtpd_ps(_dexprnd4_avx2(x)));
+  if (i<n) _mm_maskstore_ps(a+i, _mm_cmpgt_epi32(_mm_set1_epi32((int) (n-i)), _mm_setr_epi32(0, 1, 2, 3)),
+			    _mm256_cvtpd_ps(_dexprnd4_avx2(x)));
+}
+
+// b = cmax(a)
+AVX2 void _dcmax_avx2(size_t m, size_t n, const double *a, double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256d v = _mm256_set1_pd(-DBL_MAX);
+    double r;
+    for (i=0; i+DW<=m; i+=DW) v = _mm256_max_pd(v, _mm256_loadu_pd(a+i));
+    r = _dhmax_avx2(v);
+    for (; i<m; ++i) r = MAX(r, a[i]);
+    b[j] = r;
+  }
+}
+
+// b = cmin(a)
+AVX2 void _dcmin_avx2(size_t m, size_t n, const double *a, double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256d v = _mm256_set1_pd(DBL_MAX);
+    double r;
+    for (i=0; i+DW<=m; i+=DW) v = _mm256_min_pd(v, _mm256_loadu_pd(a+i));
+    r = _dhmin_avx2(v);
+    for (; i<m; ++i) r = MIN(r, a[i]);
+    b[j] = r;
+  }
+}
+
+// b = rmax(a)
+AVX2 void _drmax_avx2(size_t m, size_t n, const double *a, double *b) {
+  size_t i,j;
+  for (i=0; i<m; ++i) b[i] = -DBL_MAX;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(b+i, _mm256_max_pd(_mm256_loadu_pd(b+i), _mm256_loadu_pd(a+i)));
+    for (; i<m; ++i) b[i] = MAX(b[i], a[i]);
+  }
+}
+
+// b = rmin(a)
+AVX2 void _drmin_avx2(size_t m, size_t n, const double *a, double *b) {
+  size_t i,j;
+  for (i=0; i<m; ++i) b[i] = DBL_MAX;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(b+i, _mm256_min_pd(_mm256_loadu_pd(b+i), _mm256_loadu_pd(a+i)));
+    for (; i<m; ++i) b[i] = MIN(b[i], a[i]);
+  }
+}
+
+// c = cmax(-a(:,*) .+ b)
+AVX2 void _dgcmv2_cmax_avx2(size_t m, size_t n, const double *a, const double *b, double *c) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256d v = _mm256_set1_pd(-DBL_MAX);
+    double r;
+    for (i=0; i+DW<=m; i+=DW)
+      v = _mm256_max_pd(v, _mm256_sub_pd(_mm256_loadu_pd(b+i), _mm256_loadu_pd(a+i)));
+    r = _dhmax_avx2(v);
+    for (; i<m; ++i) r = MAX(r, b[i] - a[i]);
+    c[j] = r;
+  }
+}
+
+// c = rmin(a(*,:) .+ b)
+AVX2 void _dgrmv_rmin_avx2(size_t m, size_t n, const double *a, const double *b, double *c) {
+  size_t i,j;
+  for (i=0; i<m; ++i) c[i] = DBL_MAX;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256d v = _mm256_set1_pd(b[j]);
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(c+i, _mm256_min_pd(_mm256_loadu_pd(c+i), _mm256_add_pd(_mm256_loadu_pd(a+i), v)));
+    for (; i<m; ++i) c[i] = MIN(c[i], a[i] + b[j]);
+  }
+}
+
+// a(:,*) = a(:,*) .+ b
+AVX2 void _dgcmv_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_add_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i)));
+    for (; i<m; ++i) a[i] += b[i];
+  }
+}
+
+// a(:,*) = -a(:,*) .+ b
+AVX2 void _dgcmv2_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_sub_pd(_mm256_loadu_pd(b+i), _mm256_loadu_pd(a+i)));
+    for (; i<m; ++i) a[i] = b[i] - a[i];
+  }
+}
+
+// a(*,:) = a(*,:) .+ b
+AVX2 void _dgrmv_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256d v = _mm256_set1_pd(b[j]);
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_add_pd(_mm256_loadu_pd(a+i), v));
+    for (; i<m; ++i) a[i] += b[j];
+  }
+}
+
+// a = diag(b) * a
+AVX2 void _dgcms_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_mul_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i)));
+    for (; i<m; ++i) a[i] *= b[i];
+  }
+}
+
+// a = a * diag(b)
+AVX2 void _dgrms_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256d v = _mm256_set1_pd(b[j]);
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_mul_pd(_mm256_loadu_pd(a+i), v));
+    for (; i<m; ++i) a[i] *= b[j];
+  }
+}
+
+// a = diag(1./b) * a
+AVX2 void _dicms_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_div_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i)));
+    for (; i<m; ++i) a[i] /= b[i];
+  }
+}
+
+// a = a * diag(1./b)
+AVX2 void _dirms_avx2(size_t m, size_t n, double *a, const double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256d v = _mm256_set1_pd(b[j]);
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(a+i, _mm256_div_pd(_mm256_loadu_pd(a+i), v));
+    for (; i<m; ++i) a[i] /= b[j];
+  }
+}
+
+// b(*) = sum(a(:,*))
+AVX2 void _dcsum_avx2(size_t m, size_t n, const double *a, double *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256d v = _mm256_setzero_pd();
+    double r;
+    for (i=0; i+DW<=m; i+=DW) v = _mm256_add_pd(v, _mm256_loadu_pd(a+i));
+    r = _dhsum_avx2(v);
+    for (; i<m; ++i) r += a[i];
+    b[j] = r;
+  }
+}
+
+// b(*) = sum(a(*,:))
+AVX2 void _drsum_avx2(size_t m, size_t n, const double *a, double *b) {
+  size_t i,j;
+  for (i=0; i<m; ++i) b[i] = 0;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+DW<=m; i+=DW)
+      _mm256_storeu_pd(b+i, _mm256_add_pd(_mm256_loadu_pd(b+i), _mm256_loadu_pd(a+i)));
+    for (; i<m; ++i) b[i] += a[i];
+  }
+}
+
+// b = cmax(a)
+AVX2 void _scmax_avx2(size_t m, size_t n, const float *a, float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256 v = _mm256_set1_ps(-FLT_MAX);
+    float r;
+    for (i=0; i+SW<=m; i+=SW) v = _mm256_max_ps(v, _mm256_loadu_ps(a+i));
+    r = _shmax_avx2(v);
+    for (; i<m; ++i) r = MAX(r, a[i]);
+    b[j] = r;
+  }
+}
+
+// b = cmin(a)
+AVX2 void _scmin_avx2(size_t m, size_t n, const float *a, float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256 v = _mm256_set1_ps(FLT_MAX);
+    float r;
+    for (i=0; i+SW<=m; i+=SW) v = _mm256_min_ps(v, _mm256_loadu_ps(a+i));
+    r = _shmin_avx2(v);
+    for (; i<m; ++i) r = MIN(r, a[i]);
+    b[j] = r;
+  }
+}
+
+// b = rmax(a)
+AVX2 void _srmax_avx2(size_t m, size_t n, const float *a, float *b) {
+  size_t i,j;
+  for (i=0; i<m; ++i) b[i] = -FLT_MAX;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(b+i, _mm256_max_ps(_mm256_loadu_ps(b+i), _mm256_loadu_ps(a+i)));
+    for (; i<m; ++i) b[i] = MAX(b[i], a[i]);
+  }
+}
+
+// b = rmin(a)
+AVX2 void _srmin_avx2(size_t m, size_t n, const float *a, float *b) {
+  size_t i,j;
+  for (i=0; i<m; ++i) b[i] = FLT_MAX;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(b+i, _mm256_min_ps(_mm256_loadu_ps(b+i), _mm256_loadu_ps(a+i)));
+    for (; i<m; ++i) b[i] = MIN(b[i], a[i]);
+  }
+}
+
+// c = cmax(-a(:,*) .+ b)
+AVX2 void _sgcmv2_cmax_avx2(size_t m, size_t n, const float *a, const float *b, float *c) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256 v = _mm256_set1_ps(-FLT_MAX);
+    float r;
+    for (i=0; i+SW<=m; i+=SW)
+      v = _mm256_max_ps(v, _mm256_sub_ps(_mm256_loadu_ps(b+i), _mm256_loadu_ps(a+i)));
+    r = _shmax_avx2(v);
+    for (; i<m; ++i) r = MAX(r, b[i] - a[i]);
+    c[j] = r;
+  }
+}
+
+// c = rmin(a(*,:) .+ b)
+AVX2 void _sgrmv_rmin_avx2(size_t m, size_t n, const float *a, const float *b, float *c) {
+  size_t i,j;
+  for (i=0; i<m; ++i) c[i] = FLT_MAX;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256 v = _mm256_set1_ps(b[j]);
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(c+i, _mm256_min_ps(_mm256_loadu_ps(c+i), _mm256_add_ps(_mm256_loadu_ps(a+i), v)));
+    for (; i<m; ++i) c[i] = MIN(c[i], a[i] + b[j]);
+  }
+}
+
+// a(:,*) = a(:,*) .+ b
+AVX2 void _sgcmv_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_add_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    for (; i<m; ++i) a[i] += b[i];
+  }
+}
+
+// a(:,*) = -a(:,*) .+ b
+AVX2 void _sgcmv2_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_sub_ps(_mm256_loadu_ps(b+i), _mm256_loadu_ps(a+i)));
+    for (; i<m; ++i) a[i] = b[i] - a[i];
+  }
+}
+
+// a(*,:) = a(*,:) .+ b
+AVX2 void _sgrmv_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256 v = _mm256_set1_ps(b[j]);
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_add_ps(_mm256_loadu_ps(a+i), v));
+    for (; i<m; ++i) a[i] += b[j];
+  }
+}
+
+// a = diag(b) * a
+AVX2 void _sgcms_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    for (; i<m; ++i) a[i] *= b[i];
+  }
+}
+
+// a = a * diag(b)
+AVX2 void _sgrms_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256 v = _mm256_set1_ps(b[j]);
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_mul_ps(_mm256_loadu_ps(a+i), v));
+    for (; i<m; ++i) a[i] *= b[j];
+  }
+}
+
+// a = diag(1./b) * a
+AVX2 void _sicms_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_div_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    for (; i<m; ++i) a[i] /= b[i];
+  }
+}
+
+// a = a * diag(1./b)
+AVX2 void _sirms_avx2(size_t m, size_t n, float *a, const float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    const __m256 v = _mm256_set1_ps(b[j]);
+    for (i=0; i+SW<=m; i+=SW)
+      _mm256_storeu_ps(a+i, _mm256_div_ps(_mm256_loadu_ps(a+i), v));
+    for (; i<m; ++i) a[i] /= b[j];
+  }
+}
+
+// b(*) = sum(a(:,*))
+// sums of floats are accumulated in double, DW lanes per half of SW floats
+AVX2 void _scsum_avx2(size_t m, size_t n, const float *a, float *b) {
+  size_t i,j;
+  for (j=0; j<n; ++j, a+=m) {
+    __m256d v0 = _mm256_setzero_pd(), v1 = _mm256_setzero_pd();
+    double r;
+    for (i=0; i+SW<=m; i+=SW) {
+      __m256 x = _mm256_loadu_ps(a+i);
+      v0 = _mm256_add_pd(v0, _mm256_cvtps_pd(_mm256_castps256_ps128(x)));
+      v1 = _mm256_add_pd(v1, _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)));
+    }
+    r = _dhsum_avx2(_mm256_add_pd(v0, v1));
+    for (; i<m; ++i) r += a[i];
+    b[j] = (float) r;
+  }
+}
+
+// b(*) = sum(a(*,:)), over strips of 2*SW rows whose sums stay in registers
+AVX2 void _srsum_avx2(size_t m, size_t n, const float *a, float *b) {
+  size_t i,j;
+  for (i=0; i+2*SW<=m; i+=2*SW) {
+    __m256d v0 = _mm256_setzero_pd(), v1 = _mm256_setzero_pd();
+    __m256d v2 = _mm256_setzero_pd(), v3 = _mm256_setzero_pd();
+    const float *pa = a+i;
+    for (j=0; j<n; ++j, pa+=m) {
+      __m256 x0 = _mm256_loadu_ps(pa), x1 = _mm256_loadu_ps(pa+SW);
+      v0 = _mm256_add_pd(v0, _mm256_cvtps_pd(_mm256_castps256_ps128(x0)));
+      v1 = _mm256_add_pd(v1, _mm256_cvtps_pd(_mm256_extractf128_ps(x0, 1)));
+      v2 = _mm256_add_pd(v2, _mm256_cvtps_pd(_mm256_castps256_ps128(x1)));
+      v3 = _mm256_add_pd(v3, _mm256_cvtps_pd(_mm256_extractf128_ps(x1, 1)));
+    }
+    _mm_storeu_ps(b+i, _mm256_cvtpd_ps(v0));
+    _mm_storeu_ps(b+i+DW, _mm256_cvtpd_ps(v1));
+    _mm_storeu_ps(b+i+2*DW, _mm256_cvtpd_ps(v2));
+    _mm_storeu_ps(b+i+3*DW, _mm256_cvtpd_ps(v3));
+  }
+  for (; i+SW<=m; i+=SW) {
+    __m256d v0 = _mm256_setzero_pd(), v1 = _mm256_setzero_pd();
+    const float *pa = a+i;
+    for (j=0; j<n; ++j, pa+=m) {
+      __m256 x = _mm256_loadu_ps(pa);
+      v0 = _mm256_add_pd(v0, _mm256_cvtps_pd(_mm256_castps256_ps128(x)));
+      v1 = _mm256_add_pd(v1, _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)));
+    }
+    _mm_storeu_ps(b+i, _mm256_cvtpd_ps(v0));
+    _mm_storeu_ps(b+i+DW, _mm256_cvtpd_ps(v1));
+  }
+  for (; i<m; ++i) {
+    double r = 0;
+    const float *pa = a+i;
+    for (j=0; j<n; ++j, pa+=m) r += *pa;
+    b[i] = (float) r;
+  }
+}
+
+/* the first r lanes of a vector, as a mask for maskstore */
+AVX2 static inline __m256i _dmask_avx2(size_t r) {
+  return _mm256_cmpgt_epi64(_mm256_set1_epi64x((long long) r), _mm256_setr_epi64x(0, 1, 2, 3));
+}
+AVX2 static inline __m256i _smask_avx2(size_t r) {
+  return _mm256_cmpgt_epi32(_mm256_set1_epi32((int) r), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+/* C(:,j) over strips of 4 vectors of rows, with aligned loads of At; the
+ * padding of At makes a whole vector readable at the last rows, which are
+ * stored through a mask */
+AVX2 void _dpdist2_dmajor_avx2(const size_t d, const size_t n, const size_t m,
+			       const double *At, const size_t lda, const double *B, double *C) {
+  size_t i,j,k;
+  for (j=0; j<m; ++j, B+=d, C+=n) {
+    for (i=0; i+4*DW<=n; i+=4*DW) {
+      __m256d v0 = _mm256_setzero_pd(), v1 = _mm256_setzero_pd();
+      __m256d v2 = _mm256_setzero_pd(), v3 = _mm256_setzero_pd();
+      const double *a = At + i;
+      for (k=0; k<d; ++k, a+=lda) {
+	const __m256d b = _mm256_set1_pd(B[k]);
+	__m256d t0 = _mm256_sub_pd(_mm256_load_pd(a), b);
+	__m256d t1 = _mm256_sub_pd(_mm256_load_pd(a+DW), b);
+	__m256d t2 = _mm256_sub_pd(_mm256_load_pd(a+2*DW), b);
+	__m256d t3 = _mm256_sub_pd(_mm256_load_pd(a+3*DW), b);
+	v0 = _mm256_fmadd_pd(t0, t0, v0);
+	v1 = _mm256_fmadd_pd(t1, t1, v1);
+	v2 = _mm256_fmadd_pd(t2, t2, v2);
+	v3 = _mm256_fmadd_pd(t3, t3, v3);
+      }
+      _mm256_storeu_pd(C+i, v0);
+      _mm256_storeu_pd(C+i+DW, v1);
+      _mm256_storeu_pd(C+i+2*DW, v2);
+      _mm256_storeu_pd(C+i+3*DW, v3);
+    }
+    for (; i<n; i+=DW) {
+      __m256d v = _mm256_setzero_pd();
+      const double *a = At + i;
+      for (k=0; k<d; ++k, a+=lda) {
+	__m256d t = _mm256_sub_pd(_mm256_load_pd(a), _mm256_set1_pd(B[k]));
+	v = _mm256_fmadd_pd(t, t, v);
+      }
+      if (i+DW <= n) _mm256_storeu_pd(C+i, v);
+      else _mm256_maskstore_pd(C+i, _dmask_avx2(n-i), v);
+    }
+  }
+}
+
+AVX2 void _spdist2_dmajor_avx2(const size_t d, const size_t n, const size_t m,
+			       const float *At, const size_t lda, const float *B, float *C) {
+  size_t i,j,k;
+  for (j=0; j<m; ++j, B+=d, C+=n) {
+    for (i=0; i+4*SW<=n; i+=4*SW) {
+      __m256 v0 = _mm256_setzero_ps(), v1 = _mm256_setzero_ps();
+      __m256 v2 = _mm256_setzero_ps(), v3 = _mm256_setzero_ps();
+      const float *a = At + i;
+      for (k=0; k<d; ++k, a+=lda) {
+	const __m256 b = _mm256_set1_ps(B[k]);
+	__m256 t0 = _mm256_sub_ps(_mm256_load_ps(a), b);
+	__m256 t1 = _mm256_sub_ps(_mm256_load_ps(a+SW), b);
+	__m256 t2 = _mm256_sub_ps(_mm256_load_ps(a+2*SW), b);
+	__m256 t3 = _mm256_sub_ps(_mm256_load_ps(a+3*SW), b);
+	v0 = _mm256_fmadd_ps(t0, t0, v0);
+	v1 = _mm256_fmadd_ps(t1, t1, v1);
+	v2 = _mm256_fmadd_ps(t2, t2, v2);
+	v3 = _mm256_fmadd_ps(t3, t3, v3);
+      }
+      _mm256_storeu_ps(C+i, v0);
+      _mm256_storeu_ps(C+i+SW, v1);
+      _mm256_storeu_ps(C+i+2*SW, v2);
+      _mm256_storeu_ps(C+i+3*SW, v3);
+    }
+    for (; i<n; i+=SW) {
+      __m256 v = _mm256_setzero_ps();
+      const float *a = At + i;
+      for (k=0; k<d; ++k, a+=lda) {
+	__m256 t = _mm256_sub_ps(_mm256_load_ps(a), _mm256_set1_ps(B[k]));
+	v = _mm256_fmadd_ps(t, t, v);
+      }
+      if (i+SW <= n) _mm256_storeu_ps(C+i, v);
+      else _mm256_maskstore_ps(C+i, _smask_avx2(n-i), v);
+    }
+  }
+}
+
+#else
+
+int _d2_simd_enable(int enable) {
+  simd_level = 0;
+  return 0;
+}
+
+#endif /* _D2_HAVE_AVX2 */
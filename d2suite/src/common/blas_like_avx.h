@@ -0,0 +1,63 @@
+#ifndef _BLAS_LIKE_AVX_H_
+#define _BLAS_LIKE_AVX_H_
+
+/* AVX2 versions of the blas_like kernels, used by blas_like32.c and
+ * blas_like64.c if the cpu supports AVX2 and FMA (checked at runtime).
+ * The signatures are the same as those of the scalar versions. */
+
+#include <stdlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define _D2_HAVE_AVX2
+#endif
+
+#ifdef _D2_HAVE_AVX2
+
+int _d2_simd_avx2();
+#define _D2_USE_AVX2 _d2_simd_avx2()
+
+void _dcmax_avx2(size_t m, size_t n, const double *a, double *b);
+void _dcmin_avx2(size_t m, size_t n, const double *a, double *b);
+void _drmax_avx2(size_t m, size_t n, const double *a, double *b);
+void _drmin_avx2(size_t m, size_t n, const double *a, double *b);
+void _dgcmv2_cmax_avx2(size_t m, size_t n, const double *a, const double *b, double *c);
+void _dgrmv_rmin_avx2(size_t m, size_t n, const double *a, const double *b, double *c);
+void _dgcmv_avx2(size_t m, size_t n, double *a, const double *b);
+void _dgcmv2_avx2(size_t m, size_t n, double *a, const double *b);
+void _dgrmv_avx2(size_t m, size_t n, double *a, const double *b);
+void _dgcms_avx2(size_t m, size_t n, double *a, const double *b);
+void _dgrms_avx2(size_t m, size_t n, double *a, const double *b);
+void _dicms_avx2(size_t m, size_t n, double *a, const double *b);
+void _dirms_avx2(size_t m, size_t n, double *a, const double *b);
+void _dcsum_avx2(size_t m, size_t n, const double *a, double *b);
+void _drsum_avx2(size_t m, size_t n, const double *a, double *b);
+void _dexp_avx2(size_t n, double *a);
+void _dexprnd_avx2(size_t n, unsigned long long key, unsigned long long ctr, double *a);
+void _dpdist2_dmajor_avx2(const size_t d, const size_t n, const size_t m, const double *At, const size_t lda, const double *B, double *C);
+
+void _scmax_avx2(size_t m, size_t n, const float *a, float *b);
+void _scmin_avx2(size_t m, size_t n, const float *a, float *b);
+void _srmax_avx2(size_t m, size_t n, const float *a, float *b);
+void _srmin_avx2(size_t m, size_t n, const float *a, float *b);
+void _sgcmv2_cmax_avx2(size_t m, size_t n, const float *a, const float *b, float *c);
+void _sgrmv_rmin_avx2(size_t m, size_t n, const float *a, const float *b, float *c);
+void _sgcmv_avx2(size_t m, size_t n, float *a, const float *b);
+void _sgcmv2_avx2(size_t m, size_t n, float *a, const float *b);
+void _sgrmv_avx2(size_t m, size_t n, float *a, const float *b);
+void _sgcms_avx2(size_t m, size_t n, float *a, const float *b);
+void _sgrms_avx2(size_t m, size_t n, float *a, const float *b);
+void _sicms_avx2(size_t m, size_t n, float *a, const float *b);
+void _sirms_avx2(size_t m, size_t n, float *a, const float *b);
+void _scsum_avx2(size_t m, size_t n, const float *a, float *b);
+void _srsum_avx2(size_t m, size_t n, const float *a, float *b);
+void _sexp_avx2(size_t n, float *a);
+void _sexprnd_avx2(size_t n, unsigned long long key, unsigned long long ctr, float *a);
+void _spdist2_dmajor_avx2(const size_t d, const size_t n, const size_t m, const float *At, const size_t lda, const float *B, float *C);
+
+#else
+
+#define _D2_USE_AVX2 0
+
+#endif
+
+#endif /* _BLAS_LIKE_AVX_H_ */
@@ -24,13 +24,17 @@ namespace d2 {
 #define _D2_SCALAR          double
 #define _D2_FUNC(x)         _d ## x
 #define _D2_CBLAS_FUNC(x)   cblas_d ## x
+#define _D2_CBLAS_DOT       cblas_ddot
   //#define _D2_LAPACKE_FUNC(x) d ## x
 #elif defined  _D2_SINGLE
 #define _D2_SCALAR          float
 #define _D2_FUNC(x)         _s ## x
 #define _D2_CBLAS_FUNC(x)   cblas_s ## x
+#define _D2_CBLAS_DOT       cblas_dsdot
   //#define _D2_LAPACKE_FUNC(x) s ## x
 #endif
+  /* _D2_CBLAS_DOT is the dot product of real_t vectors accumulated in
+   * double, for objectives and losses summed over many terms */
 
   /*! \brief the unsigned integer type that will
    * be used to store index 
@@ -16,6 +16,7 @@
 /**********************************************************************/
 
 #include "common.hpp"
+#include "solver.h"
 
 /*! \namespace d2 */
 namespace d2 {
@@ -49,6 +50,12 @@ namespace d2 {
     /// @tparam FuncType is a classification/regression class 
     template <typename FuncType> 
     struct Function;
+
+    struct SINKHORN_PARAM;
+
+    struct KNN_PARAM;
+
+    struct KNN_STATS;
   }
 
 
@@ -86,6 +93,13 @@ namespace d2 {
   template <typename... Ts> // a sequence of Elem types
   class BlockMultiPhase;
 
+  /*!
+   * \brief a stream of blocks read from a file chunk by chunk, for data
+   * that do not fit in memory
+   */
+  template <typename ElemType>
+  class BlockStream;
+
 #ifdef RABIT_RABIT_H_
   /*!
    * \brief a block of elements with 
@@ -129,28 +143,64 @@ namespace d2 {
    * \param cache_dual the dual solution of solved optimal transport, length of e1.len + e2.len
    * \param cost_computed bool variable implying whether the cost matrix 
                           are precomputed and supplied.
+   * \param ctx the solver context; if NULL, the context of the calling thread is used
+   * \param warm_start whether cache_dual holds on input the dual solution of
+                       a similar problem (e.g. from the previous iteration), 
+                       from which the solver starts
    */
   template <typename ElemType1, typename ElemType2>
   inline real_t EMD (const ElemType1 &e1, const ElemType2 &e2,
 		     const Meta<ElemType2> &meta,
 		     __IN_OUT__ real_t* cache_mat = NULL,
 		     __OUT__ real_t* cache_primal = NULL, 
-		     __OUT__ real_t* cache_dual = NULL,
-		     __IN__ const bool cost_computed= false);
+		     __IN_OUT__ real_t* cache_dual = NULL,
+		     __IN__ const bool cost_computed= false,
+		     d2_solver_context_t *ctx = NULL,
+		     __IN__ const bool warm_start = false);
 
   /*!
    * \brief compute EMD between a (single-phased) discrete distribution and 
    * a block of (single-phased) discrete distributions
    * \param e the querying element
    * \param b the queried block of elements   
+   * \param warm_start whether cache_dual holds on input the dual solutions 
+                       of similar problems, as in EMD() of two elements
    */
   template <typename ElemType1, typename ElemType2>
   void EMD (const ElemType1 &e, const Block<ElemType2> &b,
 	    __OUT__ real_t* emds,
 	    __IN_OUT__ real_t* cache_mat = NULL,
 	    __OUT__ real_t* cache_primal = NULL, 
-	    __OUT__ real_t* cache_dual = NULL,
-	    __IN__ const bool cost_computed = false);
+	    __IN_OUT__ real_t* cache_dual = NULL,
+	    __IN__ const bool cost_computed = false,
+	    d2_solver_context_t *ctx = NULL,
+	    __IN__ const bool warm_start = false);
+
+  /*!
+   * \brief compute the entropic (Sinkhorn) approximation of EMD between
+   * two discrete distributions
+   * \param param the parameters of Sinkhorn iterations
+   * \param cache_mat the pre-allocated memory for the cost matrix
+   * \param cache_primal the transport plan of the regularized problem
+   */
+  template <typename ElemType1, typename ElemType2>
+  real_t EMD (const ElemType1 &e1, const ElemType2 &e2,
+	      const Meta<ElemType2> &meta,
+	      const def::SINKHORN_PARAM &param,
+	      __IN_OUT__ real_t* cache_mat = NULL,
+	      __OUT__ real_t* cache_primal = NULL);
+
+  /*!
+   * \brief compute the entropic (Sinkhorn) approximation of EMD between a 
+   * discrete distribution and a block of discrete distributions, where all
+   * pairs in a batch are scaled together.
+   * \param cache_primal the transport plans, in the same layout as EMD()
+   */
+  template <typename ElemType1, typename ElemType2>
+  void EMD (const ElemType1 &e, const Block<ElemType2> &b,
+	    __OUT__ real_t* emds,
+	    const def::SINKHORN_PARAM &param,
+	    __OUT__ real_t* cache_primal = NULL);
 
   /*!
    * \brief compute EMD between a (multi-phased) discrete distribution and 
@@ -159,7 +209,8 @@ namespace d2 {
   template <template<typename...> class D1, template<typename... > class D2, 
 	    typename... Ts1, typename... Ts2>
   void EMD(const D1<Ts1...> &e, const D2<Ts2...> &b,
-	   __OUT__ real_t* emds);
+	   __OUT__ real_t* emds,
+	   d2_solver_context_t *ctx = NULL);
   
 
   /*!
@@ -204,7 +255,8 @@ namespace d2 {
   void KNearestNeighbors_Linear(size_t k,
 				const ElemType1 &e, const Block<ElemType2> &b,
 				__OUT__ real_t* emds_approx,
-				__OUT__ index_t* rank);
+				__OUT__ index_t* rank,
+				d2_solver_context_t *ctx = NULL);
 
   /*!
    * \brief simple linear approach without any prefetching or pruning.
@@ -215,7 +267,8 @@ namespace d2 {
 				const D1<Ts1...> &e,
 				const D2<Ts2...> &b,
 				__OUT__ real_t* emds_approx,
-				__OUT__ index_t* rank);
+				__OUT__ index_t* rank,
+				d2_solver_context_t *ctx = NULL);
 
 
   /*!
@@ -226,7 +279,8 @@ namespace d2 {
 				const ElemType1 &e, const Block<ElemType2> &b,
 				__OUT__ real_t* emds_approx,
 				__OUT__ index_t* rank,
-				size_t n = 0);
+				size_t n = 0,
+				d2_solver_context_t *ctx = NULL);
 
   /*!
    * \brief prefetching and pruning with lowerbounds (return the actual number of EMD computed).
@@ -238,7 +292,64 @@ namespace d2 {
 				const D2<Ts2...> &b,
 				__OUT__ real_t* emds_approx,
 				__OUT__ index_t* rank,
-				size_t n);
+				size_t n,
+				d2_solver_context_t *ctx = NULL);
+
+  /*!
+   * \brief prefetching and pruning with a cascade of lowerbounds: version 0,
+   * projections on random directions (def::Euclidean and def::WordVec only)
+   * and version 1 (return the actual number of EMD computed).
+   * \param param the stages of the cascade
+   * \param stats the number of candidates pruned at each stage (optional)
+   */
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Cascade(size_t k,
+				   const ElemType1 &e, const Block<ElemType2> &b,
+				   __OUT__ real_t* emds_approx,
+				   __OUT__ index_t* rank,
+				   const def::KNN_PARAM &param,
+				   __OUT__ def::KNN_STATS *stats = NULL,
+				   size_t n = 0,
+				   d2_solver_context_t *ctx = NULL);
+
+  /*!
+   * \brief the k nearest neighbors of every element in a block of queries.
+   * Lower bounds (version 0) of all pairs are computed at once from the 
+   * centroids, and queries are then pruned in parallel.
+   * \param dists the distances to the neighbors, k per query, nearest first
+   * \param ids the indices of the neighbors in b, k per query (-1 if b has
+   * fewer than k elements)
+   * \param n the maximum number of candidates visited per query (0 for all)
+   * \return the number of EMD computed
+   */
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Batch(size_t k,
+				 const Block<ElemType1> &queries, const Block<ElemType2> &b,
+				 __OUT__ real_t* dists,
+				 __OUT__ index_t* ids,
+				 size_t n = 0,
+				 d2_solver_context_t *ctx = NULL);
+
+#ifdef RABIT_RABIT_H_
+  /*!
+   * \brief the k nearest neighbors of a query, which is the same on all
+   * workers, in a database partitioned across workers (b is the local
+   * part, e.g. a DistributedBlock).
+   * \param dists the distances to the neighbors, nearest first
+   * \param ids the global indices of the neighbors, where the parts are
+   * numbered in the order of ranks (-1 if there are fewer than k elements);
+   * after DistributedBlock::rebalance, its get_ids() maps them back
+   * \param n the maximum number of candidates visited per worker (0 for all)
+   * \return the number of EMD computed by all workers
+   */
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Distributed(size_t k,
+				       const ElemType1 &e, const Block<ElemType2> &b,
+				       __OUT__ real_t* dists,
+				       __OUT__ index_t* ids,
+				       size_t n = 0,
+				       d2_solver_context_t *ctx = NULL);
+#endif
 
   /*! \brief initialize the d2 background utilities (including rabit and mosek). */
   inline void Init(int argc, char*argv[]);
@@ -255,6 +366,15 @@ namespace d2 {
 #endif
 
 #include "d2_server.hpp"
+
+#ifdef RABIT_RABIT_H_
+#include "d2_server_rabit.hpp"
+#endif
+
+#include "d2_index.hpp"
+#include "d2_cascade.hpp"
+#include "d2_sinkhorn.hpp"
 #include "d2_sa.hpp"
+#include "d2_stream.hpp"
 
 #endif /* _D2_H_ */
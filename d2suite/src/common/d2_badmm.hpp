@@ -7,48 +7,365 @@
 #include "cblas.h"
 #include "blas_like.h"
 #include <random>
+#include <vector>
 namespace d2 {
 #define eps (1E-16)
 
   namespace internal {
+    /*!
+     * The state of BADMM over a block, one a.len x b[i].len matrix per
+     * element, back to back. C is the cost and Ctmp its exponential
+     * exp(-C) for the iterations; either may be left out, and is then
+     * NULL. Pi2 and Lambda are the plan and the multipliers, which persist
+     * across calls, and w_sync has a.len entries per element. The first
+     * plan Pi1 is never stored; see _BADMM_fused.
+     */
     struct BADMMCache {
       real_t *C;
       real_t *Ctmp;
-      real_t *Pi1;
       real_t *Pi2;
       real_t *Lambda;
-      real_t *Ltmp;
-      real_t *buffer;
-      real_t *Pi_buffer;
       real_t *w_sync;
     };
 
+    /*!
+     * \brief allocate the cache of a against the block b
+     * \param with_C whether to allocate C, which EMD_BADMM reads; callers
+     * that compute the cost tile by tile do without it
+     * \param with_Ctmp whether to allocate Ctmp, which _BADMM_sweep reads;
+     * _BADMM_sweep_tiled recomputes it and does without it
+     */
     template <typename ElemType1, typename ElemType2>
     void allocate_badmm_cache(const ElemType2 &a, const Block<ElemType1> &b,
-			      BADMMCache &cache) {
+			      BADMMCache &cache, bool with_C = true, bool with_Ctmp = true) {
       const size_t n = b.get_col() * a.len;
-      cache.C      = new real_t[n];
-      cache.Ctmp   = new real_t[n];
-      cache.Pi1    = new real_t[n];
+      cache.C      = with_C ? new real_t[n] : NULL;
+      cache.Ctmp   = with_Ctmp ? new real_t[n] : NULL;
       cache.Pi2    = new real_t[n];
       cache.Lambda = new real_t[n];
-      cache.Ltmp   = new real_t[n];
-      cache.buffer = new real_t[n];
-      cache.Pi_buffer = new real_t[n];
       cache.w_sync = new real_t[a.len * b.get_size()];
     }
 
     void deallocate_badmm_cache(BADMMCache &cache) {
       delete [] cache.C;
       delete [] cache.Ctmp;
-      delete [] cache.Pi1;
       delete [] cache.Pi2;
       delete [] cache.Lambda;
-      delete [] cache.Ltmp;
-      delete [] cache.buffer;
-      delete [] cache.Pi_buffer;
       delete [] cache.w_sync;
     }
+
+    /*! \brief expC = exp(-C * scale) of n entries, which may be in place */
+    inline void _badmm_exp_cost(const size_t n, const real_t *C, real_t *expC,
+				const real_t scale = 1.) {
+      for (size_t i=0; i<n; ++i) expC[i] = -(C[i] * scale);
+      _D2_FUNC(exp)(n, expC);
+    }
+
+    /*!
+     * \brief niter BADMM iterations of the pair (a,b), fused into two passes
+     * over the matrices per iteration
+     *
+     * An iteration computes
+     *   Pi1 = diag(a.w ./ r) (Pi2 .* exp(-Lambda) + eps), r = rsum(Pi2 .* exp(-Lambda) + eps)
+     *   Pi2 = (Pi1 .* exp(Lambda) .* exp(-C) + eps) diag(b.w ./ q), q = csum(...)
+     *   Lambda += Pi1 - Pi2
+     * The first pass takes exp(-Lambda) into a scratch matrix of the pair,
+     * which stays in cache, and the row sums r; the second pass goes column
+     * by column, so the column sums q and the entries of Pi1 are kept in
+     * vectors of a.len and Pi1 is never stored.
+     * \param expC exp(-C) of the pair
+     * \param w_sync the normalized row sums r
+     */
+    template <typename ElemType1, typename ElemType2>
+    void _BADMM_fused(const ElemType1 &a, const ElemType2 &b,
+		      const real_t *expC, real_t *Pi2, real_t *Lambda, real_t *w_sync,
+		      const size_t niter,
+		      real_t *prim_res, real_t *dual_res) {
+      const size_t m = a.len, n = b.len, mat_size = m * n;
+      _Scratch scratch;
+      real_t *E  = scratch.alloc<real_t>(mat_size);
+      real_t *s1 = scratch.alloc<real_t>(m);
+      real_t *p1 = scratch.alloc<real_t>(m);
+      real_t *p2 = scratch.alloc<real_t>(m);
+      real_t prim = 0, dual = 0, Pi2_norm = 0;
+
+      for (size_t iter=0; iter < niter; ++iter) {
+	const bool last = (iter+1 == niter);
+	// first pass: E = exp(-Lambda) and the row sums of Pi1 before scaling
+	for (size_t i=0; i<mat_size; ++i) E[i] = -Lambda[i];
+	_D2_FUNC(exp)(mat_size, E);
+	for (size_t k=0; k<m; ++k) s1[k] = n * eps;
+	for (size_t j=0, l=0; j<n; ++j)
+	  for (size_t k=0; k<m; ++k, ++l) s1[k] += Pi2[l] * E[l];
+	real_t w_sync_sum = 0;
+	for (size_t k=0; k<m; ++k) w_sync_sum += s1[k];
+	for (size_t k=0; k<m; ++k) {
+	  w_sync[k] = s1[k] / w_sync_sum;
+	  s1[k] = a.w[k] / s1[k];
+	}
+
+	// second pass, column by column
+	for (size_t j=0, l=0; j<n; ++j, l+=m) {
+	  real_t q = 0;
+	  for (size_t k=0; k<m; ++k) {
+	    p1[k] = s1[k] * (Pi2[l+k] * E[l+k] + eps);
+	    p2[k] = p1[k] * expC[l+k] / E[l+k] + eps;
+	    q += p2[k];
+	  }
+	  const real_t t = b.w[j] / q;
+	  for (size_t k=0; k<m; ++k) {
+	    const real_t pi2 = p2[k] * t;
+	    if (last) {
+	      dual += std::fabs(Pi2[l+k] - pi2);
+	      prim += std::fabs(p1[k] - pi2);
+	      Pi2_norm += std::fabs(pi2);
+	    }
+	    Pi2[l+k] = pi2;
+	    Lambda[l+k] += p1[k] - pi2;
+	  }
+	}
+      }
+
+      if (prim_res) *prim_res = prim / Pi2_norm;
+      if (dual_res) *dual_res = dual / Pi2_norm;
+    }
+  }
+
+  namespace internal {
+    /* the bytes of scratch of a batch of uniform length elements (two
+     * tensors of the batch), below which batches are not split further */
+    static const size_t _badmm_batch_bytes = 1 << 16;
+
+    /*! \brief whether all elements of b have the same length */
+    template <typename ElemType>
+    bool _is_uniform_len(const Block<ElemType> &b) {
+      for (size_t i=1; i<b.get_size(); ++i)
+	if (b[i].len != b[0].len) return false;
+      return b.get_size() > 0;
+    }
+
+    /*!
+     * \brief niter BADMM iterations of a against num elements of the same
+     * length n, whose matrices are back to back as a num x n x a.len tensor
+     *
+     * The same iteration as _BADMM_fused, taken one step at a time over
+     * the whole batch: the exponentials and the updates are single passes
+     * over the tensor, with the row sums of every element taken along, and
+     * the column sums and scalings are folded into them. This makes the
+     * passes long and regular however small the elements are, at the cost
+     * of two tensors of scratch.
+     * \param wb the weights of the elements, back to back
+     * \param prim_res the primal residual of each element
+     * \param dual_res the dual residual of each element
+     */
+    template <typename ElemType1>
+    void _BADMM_batch(const ElemType1 &a, const size_t n, const size_t num, const real_t *wb,
+		      const real_t *expC, real_t *Pi2, real_t *Lambda, real_t *w_sync,
+		      const size_t niter,
+		      real_t *prim_res, real_t *dual_res) {
+      const size_t m = a.len, cols = num * n, size = m * cols;
+      _Scratch scratch;
+      real_t *E  = scratch.alloc<real_t>(size);
+      real_t *P1 = scratch.alloc<real_t>(size);
+      real_t *s  = scratch.alloc<real_t>(m * num);
+      real_t *t  = scratch.alloc<real_t>(cols);
+
+      for (size_t iter=0; iter < niter; ++iter) {
+	for (size_t i=0; i<size; ++i) E[i] = -Lambda[i];
+	_D2_FUNC(exp)(size, E);
+	// Pi1 before the scaling of its rows, and the row sums of each element
+	for (size_t i=0; i<m * num; ++i) s[i] = 0;
+	for (size_t e=0, l=0; e<num; ++e)
+	  for (size_t j=0; j<n; ++j)
+	    for (size_t k=0; k<m; ++k, ++l) {
+	      P1[l] = Pi2[l] * E[l] + eps;
+	      s[e * m + k] += P1[l];
+	    }
+	for (size_t e=0; e<num; ++e) {
+	  real_t *r = s + e * m, *w = w_sync + e * m, w_sync_sum = 0;
+	  for (size_t k=0; k<m; ++k) w_sync_sum += r[k];
+	  for (size_t k=0; k<m; ++k) {
+	    w[k] = r[k] / w_sync_sum;
+	    r[k] = a.w[k] / r[k];
+	  }
+	}
+	// Pi1, and Pi2 before the scaling of its columns into E, with the column sums
+	for (size_t e=0, l=0, c=0; e<num; ++e)
+	  for (size_t j=0; j<n; ++j, ++c) {
+	    real_t q = 0;
+	    for (size_t k=0; k<m; ++k, ++l) {
+	      P1[l] *= s[e * m + k];
+	      E[l] = P1[l] * expC[l] / E[l] + eps;
+	      q += E[l];
+	    }
+	    t[c] = wb[c] / q;
+	  }
+	// Pi2, the residuals and the multipliers
+	const bool last = (iter+1 == niter);
+	for (size_t e=0, l=0, c=0; e<num; ++e) {
+	  real_t prim = 0, dual = 0, Pi2_norm = 0;
+	  for (size_t j=0; j<n; ++j, ++c)
+	    for (size_t k=0; k<m; ++k, ++l) {
+	      const real_t pi2 = E[l] * t[c];
+	      if (last) {
+		dual += std::fabs(Pi2[l] - pi2);
+		prim += std::fabs(P1[l] - pi2);
+		Pi2_norm += std::fabs(pi2);
+	      }
+	      Lambda[l] += P1[l] - pi2;
+	      Pi2[l] = pi2;
+	    }
+	  if (last) {
+	    prim_res[e] = prim / Pi2_norm;
+	    dual_res[e] = dual / Pi2_norm;
+	  }
+	}
+      }
+    }
+
+    /*!
+     * \brief niter BADMM iterations of a against every element of b
+     *
+     * The elements are independent given a.w, so they are distributed over
+     * the threads of the pool, each at its offset into the cache. If all
+     * elements have the same length, as with def::Histogram, they go in
+     * batches through _BADMM_batch instead. The residuals are kept per
+     * element and added up in order, so the result does not depend on the
+     * number of threads.
+     * \param cache the cache of the block, with exp(-C) in Ctmp
+     * \param prim_res the sum of the primal residuals of the elements
+     * \param dual_res the sum of the dual residuals of the elements
+     */
+    template <typename ElemType1, typename ElemType2>
+    void _BADMM_sweep(const ElemType1 &a, const Block<ElemType2> &b,
+		      const BADMMCache &cache,
+		      const size_t niter,
+		      real_t *prim_res, real_t *dual_res) {
+      const size_t size = b.get_size();
+      std::vector<real_t> p_res(size), d_res(size);
+      if (_is_uniform_len(b)) {
+	// batches that fit the scratch budget, and at least a few per thread
+	const size_t n = b[0].len, threads = _global_pool()->size();
+	const size_t batch = std::max((size_t) 1,
+				      std::min(_badmm_batch_bytes / (2 * sizeof(real_t) * a.len * n),
+					       (size + 4 * threads - 1) / (4 * threads)));
+	parallel_for((size + batch - 1) / batch, [&](size_t t, size_t w) {
+	    const size_t i0 = t * batch, num = std::min(batch, size - i0);
+	    const size_t offset = (b[i0].w - b.get_weight_ptr()) * a.len;
+	    _BADMM_batch(a, n, num, b[i0].w, cache.Ctmp + offset, cache.Pi2 + offset,
+			 cache.Lambda + offset, cache.w_sync + i0 * a.len, niter,
+			 &p_res[i0], &d_res[i0]);
+	  });
+      } else {
+	parallel_for(size, [&](size_t i, size_t w) {
+	    const size_t offset = (b[i].w - b.get_weight_ptr()) * a.len;
+	    _BADMM_fused(a, b[i], cache.Ctmp + offset, cache.Pi2 + offset, cache.Lambda + offset,
+			 cache.w_sync + i * a.len, niter, &p_res[i], &d_res[i]);
+	  });
+      }
+      *prim_res = 0; *dual_res = 0;
+      for (size_t i=0; i<size; ++i) {*prim_res += p_res[i]; *dual_res += d_res[i];}
+    }
+
+    /*!
+     * \brief the tiles of b, as runs of consecutive elements whose cost
+     * matrices against a fit in half of _badmm_batch_bytes, or single
+     * elements if they do not; returns the first element of every tile
+     * and b.get_size() at the end
+     */
+    template <typename ElemType1, typename ElemType2>
+    std::vector<size_t> _badmm_tiles(const ElemType1 &a, const Block<ElemType2> &b) {
+      const size_t max_col = std::max((size_t) 1, _badmm_batch_bytes / (2 * sizeof(real_t) * a.len));
+      std::vector<size_t> tiles(1, 0);
+      for (size_t i=0, col=0; i<b.get_size(); ++i) {
+	if (col > 0 && col + b[i].len > max_col) {tiles.push_back(i); col = 0;}
+	col += b[i].len;
+      }
+      if (b.get_size() > 0) tiles.push_back(b.get_size());
+      return tiles;
+    }
+
+    /*! \brief the first column of element i of b, or b.get_col() past the end */
+    template <typename ElemType>
+    inline size_t _badmm_col(const Block<ElemType> &b, const size_t i) {
+      return i < b.get_size() ? b[i].w - b.get_weight_ptr() : b.get_col();
+    }
+
+    /*!
+     * \brief the sums of |C| and of C .* Pi2 over the block, with the cost
+     * C computed tile by tile
+     * \param cost cost(col, n, C) writes the a.len x n cost of the columns
+     * [col, col+n) of b into C
+     * \param C if not NULL, where the cost of the block is stored;
+     * otherwise the tiles are dropped once they are summed
+     */
+    template <typename ElemType1, typename ElemType2, typename CostFunc>
+    void _BADMM_cost_sums(const ElemType1 &a, const Block<ElemType2> &b,
+			  const BADMMCache &cache, const CostFunc &cost,
+			  real_t *asum, real_t *dot, real_t *C = NULL) {
+      const std::vector<size_t> tiles = _badmm_tiles(a, b);
+      const size_t num = tiles.size() - 1;
+      std::vector<real_t> asums(num), dots(num);
+      parallel_for(num, [&](size_t t, size_t w) {
+	  const size_t col = _badmm_col(b, tiles[t]), n = _badmm_col(b, tiles[t+1]) - col;
+	  _Scratch scratch;
+	  real_t *tile = C ? C + col * a.len : scratch.alloc<real_t>(a.len * n);
+	  cost(col, n, tile);
+	  const real_t *Pi2 = cache.Pi2 + col * a.len;
+	  asums[t] = 0; dots[t] = 0;
+	  for (size_t l=0; l<a.len * n; ++l) {asums[t] += std::fabs(tile[l]); dots[t] += tile[l] * Pi2[l];}
+	});
+      *asum = 0; *dot = 0;
+      for (size_t t=0; t<num; ++t) {*asum += asums[t]; *dot += dots[t];}
+    }
+
+    /*!
+     * \brief niter BADMM iterations of a against every element of b, with
+     * the cost recomputed tile by tile instead of read from the cache
+     *
+     * Every tile of _badmm_tiles gets its cost from cost(), scaled and
+     * exponentiated in a buffer of the thread which is released once the
+     * tile is done, so the cache needs neither C nor Ctmp. The tiles go
+     * through _BADMM_batch if all elements have the same length, and
+     * through _BADMM_fused otherwise. The residuals do not depend on the number
+     * of threads, as in _BADMM_sweep.
+     * \param cost cost(col, n, C) writes the a.len x n cost of the columns
+     * [col, col+n) of b into C
+     * \param scale the factor of the cost in the iterations
+     */
+    template <typename ElemType1, typename ElemType2, typename CostFunc>
+    void _BADMM_sweep_tiled(const ElemType1 &a, const Block<ElemType2> &b,
+			    const BADMMCache &cache, const CostFunc &cost, const real_t scale,
+			    const size_t niter,
+			    real_t *prim_res, real_t *dual_res) {
+      const size_t size = b.get_size();
+      const std::vector<size_t> tiles = _badmm_tiles(a, b);
+      const bool uniform = _is_uniform_len(b);
+      std::vector<real_t> p_res(size), d_res(size);
+      parallel_for(tiles.size() - 1, [&](size_t t, size_t w) {
+	  const size_t i0 = tiles[t], i1 = tiles[t+1];
+	  const size_t col = _badmm_col(b, i0), n = _badmm_col(b, i1) - col;
+	  _Scratch scratch;
+	  real_t *expC = scratch.alloc<real_t>(a.len * n);
+	  cost(col, n, expC);
+	  _badmm_exp_cost(a.len * n, expC, expC, scale);
+	  if (uniform) {
+	    const size_t offset = col * a.len;
+	    _BADMM_batch(a, b[i0].len, i1 - i0, b[i0].w, expC, cache.Pi2 + offset,
+			 cache.Lambda + offset, cache.w_sync + i0 * a.len, niter,
+			 &p_res[i0], &d_res[i0]);
+	  } else {
+	    for (size_t i=i0; i<i1; ++i) {
+	      const size_t offset = _badmm_col(b, i) * a.len;
+	      _BADMM_fused(a, b[i], expC + (offset - col * a.len), cache.Pi2 + offset,
+			   cache.Lambda + offset, cache.w_sync + i * a.len, niter,
+			   &p_res[i], &d_res[i]);
+	    }
+	  }
+	});
+      *prim_res = 0; *dual_res = 0;
+      for (size_t i=0; i<size; ++i) {*prim_res += p_res[i]; *dual_res += d_res[i];}
+    }
   }
 
   /*! 
@@ -65,67 +382,9 @@ namespace d2 {
 		const internal::BADMMCache &cache,
 		const size_t niter,
 		real_t *prim_res, real_t *dual_res) {
-    const size_t mat_size = a.len * b.len;
-    for (size_t i=0; i<mat_size; ++i)
-      cache.Ctmp[i] = exp(cache.C[i]);
-    for (size_t iter=0; iter < niter; ++iter) {
-      if (dual_res && (iter+1 == niter)) {
-	for (size_t i=0; i<mat_size;++i) {
-	  cache.Pi_buffer[i] = cache.Pi2[i];
-	}
-      }
-
-      for (size_t i=0; i<mat_size; ++i)
-	cache.Ltmp[i] = exp(cache.Lambda[i]);
-      for (size_t i=0; i<mat_size; ++i) {
-	cache.Pi1[i] = cache.Pi2[i] / (cache.Ltmp[i]) + eps;
-      }
-      /*********************************************************/
-      real_t w_sync_sum;
-      _D2_FUNC(rsum)(a.len, b.len, cache.Pi1, cache.w_sync);
-      _D2_FUNC(cnorm)(a.len, 1, cache.w_sync, &w_sync_sum);
-      /*********************************************************/
-
-      _D2_FUNC(rnorm)(a.len, b.len, cache.Pi1, cache.buffer);
-      _D2_FUNC(gcms)(a.len, b.len, cache.Pi1, a.w);
-
-      for (size_t i=0; i<mat_size; ++i) {	
-	cache.Pi2[i] = cache.Pi1[i] * cache.Ltmp[i] / cache.Ctmp[i] + eps;
-      }
-      
-      _D2_FUNC(cnorm)(a.len, b.len, cache.Pi2, cache.buffer);
-      _D2_FUNC(grms)(a.len, b.len, cache.Pi2, b.w);
-
-      if (dual_res && (iter+1 == niter)) {
-	*dual_res = 0;
-	for (size_t i=0; i<mat_size; ++i) {
-	  real_t err=cache.Pi_buffer[i] - cache.Pi2[i];
-	  *dual_res += fabs(err);
-	}
-      }
-      
-      for (size_t i=0; i<mat_size; ++i)
-	cache.Lambda[i] += cache.Pi1[i] - cache.Pi2[i];
-    }
-
-    real_t Pi2_norm = 0.;
-    if (prim_res || dual_res) {
-      for (size_t i=0; i<mat_size; ++i)
-	Pi2_norm += fabs(cache.Pi2[i]);
-    }
-    if (prim_res) {
-      *prim_res = 0;
-      for (size_t i=0; i<mat_size; ++i) {
-	real_t err=(cache.Pi1[i] - cache.Pi2[i]);
-	*prim_res += fabs(err);
-      }
-      *prim_res = (*prim_res) / (Pi2_norm);
-    }
-    if (dual_res) {
-      *dual_res = (*dual_res) / (Pi2_norm);
-    }
-      
-
+    internal::_badmm_exp_cost(a.len * b.len, cache.C, cache.Ctmp);
+    internal::_BADMM_fused(a, b, cache.Ctmp, cache.Pi2, cache.Lambda, cache.w_sync,
+			   niter, prim_res, dual_res);
     return 0;
   }
 
@@ -0,0 +1,245 @@
+#ifndef _D2_CASCADE_H_
+#define _D2_CASCADE_H_
+
+/*!
+ * \file d2_cascade.hpp
+ * \brief The k nearest neighbors search with a cascade of lower bounds.
+ *
+ * Candidates are visited in the order of the centroid bound (version 0,
+ * the word centroid distance of def::WordVec), and each one then has to
+ * pass the projection bound, which only projects supports onto a few
+ * random directions, and the relaxed marginal bound (version 1, the
+ * relaxed WMD of def::WordVec), which needs the full cost matrix, before
+ * EMD is solved.
+ *
+ * The projection bound: if the directions t_1, ..., t_r are orthonormal,
+ * any transport plan of the two elements is also a plan of their supports
+ * projected onto each t_k, so
+ *     EMD >= sum_k EMD_k                 (squared Euclidean cost)
+ *     EMD >= sqrt(sum_k EMD_k^2)         (Euclidean cost, by Minkowski)
+ * where EMD_k is the 1D transport cost along t_k, which is solved exactly
+ * by sorting. Directions are drawn in groups of at most dim orthonormal
+ * ones, and the largest bound of all groups is used.
+ */
+
+#include "common.hpp"
+#include "d2.hpp"
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+
+namespace d2 {
+  namespace def {
+    /*! \brief the stages of the lower bound cascade */
+    struct KNN_PARAM {
+      size_t num_projections = 4; ///< the number of random directions of the projection bound (0 to skip)
+      bool use_v1 = true; ///< whether to apply the relaxed marginal bound (version 1) before EMD
+      unsigned seed = 0; ///< the seed of random directions
+    };
+
+    /*! \brief how many candidates were decided at each stage */
+    struct KNN_STATS {
+      size_t pruned_v0 = 0; ///< candidates never visited, since their version 0 bound is too large
+      size_t pruned_projection = 0;
+      size_t pruned_v1 = 0;
+      size_t emd = 0; ///< candidates for which EMD is solved
+    };
+  }
+
+  namespace internal {
+    /* the supports viewed as points of R^dim, and the exponent of the
+     * distance of two points in the cost of EMD */
+    template <typename ElemType>
+    struct _ProjectionTraits {static const bool supported = false;};
+
+    template <size_t dim>
+    struct _ProjectionTraits<Elem<def::Euclidean, dim> > {
+      static const bool supported = true;
+      static const bool squared = true;
+      static const real_t* point(const Elem<def::Euclidean, dim> &e,
+				 const Meta<Elem<def::Euclidean, dim> > &meta, const size_t j) {
+	return e.supp + j*dim;
+      }
+    };
+
+    template <size_t dim>
+    struct _ProjectionTraits<Elem<def::WordVec, dim> > {
+      static const bool supported = true;
+      static const bool squared = false;
+      static const real_t* point(const Elem<def::WordVec, dim> &e,
+				 const Meta<Elem<def::WordVec, dim> > &meta, const size_t j) {
+	return meta.embedding + e.supp[j]*dim;
+      }
+    };
+
+    /*! \brief the 1D transport cost between two sorted lists of (position, weight) */
+    inline real_t _EMD_1d(const std::pair<real_t, real_t> *a, const size_t na,
+			  const std::pair<real_t, real_t> *b, const size_t nb,
+			  const bool squared) {
+      size_t i = 0, j = 0;
+      real_t ra = a[0].second, rb = b[0].second, val = 0;
+      while (i < na && j < nb) {
+	const real_t d = std::fabs(a[i].first - b[j].first), c = squared ? d * d : d;
+	if (ra < rb) {
+	  val += ra * c; rb -= ra;
+	  if (++i < na) ra = a[i].second;
+	} else {
+	  val += rb * c; ra -= rb;
+	  if (++j < nb) rb = b[j].second;
+	}
+      }
+      return val;
+    }
+
+    /*!
+     * \brief the projection bound of one query against elements of the
+     * same type, with the sorted projections of the query precomputed
+     */
+    template <typename ElemType1, typename ElemType2,
+	      bool = std::is_same<ElemType1, ElemType2>::value && _ProjectionTraits<ElemType2>::supported>
+    class _Projector {
+    public:
+      _Projector(const ElemType1 &e, const Meta<ElemType2> &meta, const def::KNN_PARAM &param) {}
+      bool enabled() const {return false;}
+      real_t bound(const ElemType2 &e2) {return 0;}
+    };
+
+    template <typename ElemType1, typename ElemType2>
+    class _Projector<ElemType1, ElemType2, true> {
+      typedef _ProjectionTraits<ElemType2> Traits;
+      static const size_t dim = ElemType2::D;
+    public:
+      _Projector(const ElemType1 &e, const Meta<ElemType2> &meta, const def::KNN_PARAM &param):
+	meta(meta), num(param.num_projections), dirs(dim * param.num_projections),
+	proj_q(e.len * param.num_projections) {
+	// groups of orthonormal directions by Gram-Schmidt
+	std::mt19937 rnd_gen(param.seed);
+	std::normal_distribution<real_t> normal(0., 1.);
+	for (size_t k=0; k<num; ++k) {
+	  real_t *t = &dirs[k*dim], norm;
+	  do {
+	    for (size_t d=0; d<dim; ++d) t[d] = normal(rnd_gen);
+	    for (size_t l=k - k % dim; l<k; ++l) {
+	      const real_t *s = &dirs[l*dim];
+	      real_t dot = 0;
+	      for (size_t d=0; d<dim; ++d) dot += t[d] * s[d];
+	      for (size_t d=0; d<dim; ++d) t[d] -= dot * s[d];
+	    }
+	    norm = 0;
+	    for (size_t d=0; d<dim; ++d) norm += t[d] * t[d];
+	    norm = sqrt(norm);
+	  } while (norm < 1E-6);
+	  for (size_t d=0; d<dim; ++d) t[d] /= norm;
+	}
+	len_q = e.len;
+	if (num > 0) _project(e, &proj_q[0]);
+      }
+
+      bool enabled() const {return num > 0;}
+
+      real_t bound(const ElemType2 &e2) {
+	proj.resize(e2.len * num);
+	_project(e2, &proj[0]);
+	real_t val = 0, group = 0;
+	for (size_t k=0; k<num; ++k) {
+	  const real_t c = _EMD_1d(&proj_q[k * len_q], len_q, &proj[k * e2.len], e2.len, Traits::squared);
+	  group += Traits::squared ? c : c * c;
+	  if (k % dim == dim - 1 || k == num - 1) {
+	    val = std::max(val, Traits::squared ? group : (real_t) sqrt(group));
+	    group = 0;
+	  }
+	}
+	return val;
+      }
+
+    private:
+      /* the sorted projections of e, len entries per direction */
+      template <typename ElemType>
+      void _project(const ElemType &e, std::pair<real_t, real_t> *p) const {
+	for (size_t k=0; k<num; ++k) {
+	  const real_t *t = &dirs[k*dim];
+	  std::pair<real_t, real_t> *pk = p + k * e.len;
+	  for (size_t j=0; j<e.len; ++j) {
+	    const real_t *x = Traits::point(e, meta, j);
+	    real_t dot = 0;
+	    for (size_t d=0; d<dim; ++d) dot += t[d] * x[d];
+	    pk[j] = std::make_pair(dot, e.w[j]);
+	  }
+	  std::sort(pk, pk + e.len);
+	}
+      }
+
+      const Meta<ElemType2> &meta;
+      size_t num, len_q;
+      std::vector<real_t> dirs;
+      std::vector<std::pair<real_t, real_t> > proj_q, proj;
+    };
+  }
+
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Cascade(size_t k,
+				   const ElemType1 &e, const Block<ElemType2> &b,
+				   __OUT__ real_t* emds_approx,
+				   __OUT__ index_t* rank,
+				   const def::KNN_PARAM &param,
+				   __OUT__ def::KNN_STATS *stats,
+				   size_t n,
+				   d2_solver_context_t *ctx) {
+    auto compare = [&](size_t i1, size_t i2) {return emds_approx[i1] < emds_approx[i2];};
+    const size_t size = b.get_size();
+    if (n == 0 || n > size) n = size;
+    k = std::min(k, n);
+    def::KNN_STATS s;
+    if (k == 0) {if (stats) *stats = s; return 0;}
+
+    internal::_Scratch scratch;
+    real_t *cache_mat = scratch.alloc<real_t>(e.len * b.get_max_len());
+    internal::_Projector<ElemType1, ElemType2> projector(e, b.meta, param);
+
+    for (size_t i=0; i<size; ++i) {
+      emds_approx[i] = LowerThanEMD_v0(e, b[i], b.meta);
+    }
+    for (size_t i=0; i<size; ++i) rank[i] = i;
+    std::sort(rank, rank + size, compare);
+
+    // compute exact distance for the first k
+    for (size_t i=0; i<k; ++i) {
+      emds_approx[rank[i]] = EMD(e, b[rank[i]], b.meta, cache_mat, NULL, NULL, false, ctx);
+    }
+    s.emd = k;
+
+    std::priority_queue<size_t,
+			std::vector<size_t>,
+			decltype( compare ) > knn(rank, rank + k, compare);
+
+    size_t idx, i;
+    for (i=k; i<n; ++i) {
+      idx = rank[i];
+      if (emds_approx[idx] >= emds_approx[knn.top()]) break;
+      if (projector.enabled()) {
+	emds_approx[idx] = std::max(emds_approx[idx], projector.bound(b[idx]));
+	if (emds_approx[idx] >= emds_approx[knn.top()]) {s.pruned_projection ++; continue;}
+      }
+      if (param.use_v1) {
+	emds_approx[idx] = std::max(emds_approx[idx], LowerThanEMD_v1(e, b[idx], b.meta, cache_mat));
+	if (emds_approx[idx] >= emds_approx[knn.top()]) {s.pruned_v1 ++; continue;}
+      }
+      s.emd ++;
+      emds_approx[idx] = EMD(e, b[idx], b.meta, cache_mat, NULL, NULL, param.use_v1, ctx);
+      if (emds_approx[idx] < emds_approx[knn.top()]) {
+	knn.pop(); knn.push(idx);
+      }
+    }
+    s.pruned_v0 = n - i;
+    // rank[i..] are bounded below by the k-th distance
+    std::sort(rank, rank + i, compare);
+
+    if (stats) *stats = s;
+    return s.emd;
+  }
+
+}
+
+#endif /* _D2_CASCADE_H_ */
@@ -85,7 +85,8 @@ namespace d2 {
      */
     Block(const size_t thesize, 
 	  const size_t thelen): 
-      size(0), len(thelen), max_len(0), col(0), isShared(false) {
+      size(0), len(thelen), max_len(0), col(0), isShared(false), p_norm(NULL), 
+      aligned(false), p_aligned_w(NULL), p_aligned_supp(NULL), p_map(NULL), map_size(0) {
       // allocate block memory
       p_w = (real_t*) malloc(sizeof(real_t) * thesize * thelen);
       p_label = (real_t*) malloc(sizeof(real_t) * thesize * thelen);      
@@ -101,6 +102,12 @@ namespace d2 {
      */
     Block(const Block<ElemType> &that, index_t start, size_t thesize, bool isview = true) {
       //      assert(that.get_size() >= start + thesize);
+      p_norm = NULL;
+      aligned = that.aligned;
+      p_aligned_w = NULL;
+      p_aligned_supp = NULL;
+      p_map = NULL;
+      map_size = 0;
       size = 0;
       col = 0;
       max_col = -1;
@@ -140,6 +147,10 @@ namespace d2 {
 	if (p_label != NULL) free(p_label); 
 	if (p_supp != NULL) free(p_supp);
       }
+      if (p_norm != NULL) free(p_norm);
+      if (p_aligned_w != NULL) free(p_aligned_w);
+      if (p_aligned_supp != NULL) free(p_aligned_supp);
+      if (p_map != NULL) unmap();
     }
     
     /*! \brief get specific element in the block */
@@ -159,6 +170,22 @@ namespace d2 {
     inline real_t* get_label_ptr() const {return p_label;}
     inline SuppType* &get_support_ptr() {return p_supp;}
     inline SuppType* get_support_ptr() const {return p_supp;}
+    /*! \brief get the cached squared norms of supports (def::Euclidean only, otherwise NULL) */
+    inline const real_t* get_norm_ptr() const {return p_norm;}
+    /*! \brief get the aligned weights of element i (get_aligned_ld(i) of 
+     * them, zero padded), or NULL if the block keeps no aligned copy */
+    inline const real_t* get_aligned_weight_ptr(const size_t i) const {
+      return p_aligned_w ? p_aligned_w + aligned_offset[i] : NULL;
+    }
+    /*! \brief get the aligned supports of element i, stored dimension-major
+     * (D x get_aligned_ld(i)), or NULL if the block keeps no aligned copy */
+    inline const real_t* get_aligned_support_ptr(const size_t i) const {
+      return p_aligned_supp ? p_aligned_supp + ElemType::D * aligned_offset[i] : NULL;
+    }
+    /*! \brief get the padded length of element i in the aligned copy */
+    inline size_t get_aligned_ld(const size_t i) const {
+      return aligned_offset[i+1] - aligned_offset[i];
+    }
     inline MetaType &get_meta() {return meta;}
     inline MetaType get_meta() const {return meta;}
     inline void initialize(const size_t thesize, const size_t thelen) {
@@ -172,14 +199,45 @@ namespace d2 {
     }
 
     int append(std::istream &is);    
+    /*! \brief make room for exactly thesize elements of the given lengths,
+     * whose data are then filled in place before realign_vec() is called */
+    void resize(const size_t thesize, const size_t *lens);
     void realign_vec();
+    /*! \brief recompute the cached squared norms of supports, and the 
+     * aligned copy if it is kept, which is needed after supports are 
+     * modified in place */
+    void update_norm();
+    /*! \brief whether to keep an aligned copy of the block (def::Euclidean
+     * only), in which every element starts at a _D2_ALIGN boundary and is 
+     * padded to a whole number of vectors, and supports are stored 
+     * dimension-major, so that cost matrices against it are computed by 
+     * _pdist2_dmajor. The packed layout is kept as it is; the copy takes
+     * as much memory again and is refreshed by update_norm().
+     */
+    void set_aligned(const bool enable);
+    inline bool is_aligned() const {return aligned;}
     void read_main(const std::string &filename, const size_t size);
     void read(const std::string &filename, const size_t size);
     void read(const std::string &filename, const size_t size, const std::string &filename_meta);
     void read(const std::string &filename, const size_t size, const MetaType &meta);    
     void read_label(const std::string &filename, const size_t start = 0);
+    /*! \brief map a .d2b file written by write_binary() into memory and 
+     * use it as the block data without copying (the block becomes shared 
+     * and cannot be appended to). read() and read_main() call this if the 
+     * file is in the binary format.
+     * \param size the maximum number of elements used
+     * \param with_meta whether the meta data in the file replaces this->meta
+     * \return 0 on success
+     */
+    int read_binary(const std::string &filename, const size_t size, const bool with_meta = true);
       
     void write(const std::string &filename) const;
+    /*! \brief write the block (and its meta data) in the .d2b binary format */
+    void write_binary(const std::string &filename) const;
+    /*! \brief split data into num_copies parts (.part0, .part1, ...) of 
+     * balanced total length of elements, and record the part and the index 
+     * in that part of every element in .partmap
+     */
     void split_write(const std::string &filename, const size_t num_copies) const;
     /*! \brief split data into train and test and write them into two files
      * \param train_ratio the ratio of training elements in data
@@ -207,6 +265,7 @@ namespace d2 {
       rabit::Broadcast(&size_of_vec_, sizeof(size_t), rank);
       if (rabit::GetRank() != rank) vec_.resize(size_of_vec_);
       rabit::Broadcast(&vec_[0], sizeof(ElemType) * size_of_vec_, rank);
+      if (rabit::GetRank() != rank) update_norm();
     }
 #endif
 
@@ -228,6 +287,17 @@ namespace d2 {
     /* actual binary data */
     real_t *p_w, *p_label;
     SuppType* p_supp;    
+    real_t *p_norm;
+
+    /* the aligned copy, where element i starts at aligned_offset[i] */
+    bool aligned;
+    real_t *p_aligned_w, *p_aligned_supp;
+    std::vector<size_t> aligned_offset;
+
+    /* the file mapping behind the data, if read by read_binary() */
+    void *p_map;
+    size_t map_size;
+    void unmap();
   };
 
   template <typename... Ts>
@@ -297,11 +367,29 @@ namespace d2 {
     void read_main(const std::string &filename, const size_t size);
     void read(const std::string &filename, const size_t size);
 
+    /*! \brief migrate elements between workers, so that the total length
+     * of elements on each worker is proportional to its measured speed
+     * (collective: all workers must call it). Elements leave from the end
+     * of a block and are appended to the end of another one, and take
+     * their ids along. This changes the order of ranks the .partmap of
+     * split_write and the ids of KNearestNeighbors_Distributed refer to;
+     * get_ids() maps the elements back.
+     * \param time the time of the last iteration on this worker
+     */
+    void rebalance(const double time);
+
     size_t & get_global_size() {return global_size;}
     size_t get_global_size() const {return global_size;}
+    /*! \brief the global index of every local element, which is its index
+     * in the order of ranks when the block was read (as in .partmap) */
+    const std::vector<size_t> & get_ids() const {return ids;}
     
   protected:
     size_t global_size;
+    std::vector<size_t> ids;
+
+    /* number the local elements in the order of ranks (collective) */
+    void init_ids();
     
   };
 
@@ -0,0 +1,316 @@
+#ifndef _D2_INDEX_H_
+#define _D2_INDEX_H_
+
+/*!
+ * \file d2_index.hpp
+ * \brief A persistent index for the k nearest neighbors search in a Block.
+ *
+ * The index stores the statistics behind the lower bounds of every element
+ * in separate contiguous arrays (dim x size centroids, their squared norms,
+ * the spreads of supports around the centroids, and the squared norms of
+ * all supports), so that the version 0 bounds of a block of queries are a
+ * single gemm, and the supports of the block are only read once a
+ * candidate passes it. An index is built once and can be saved with the
+ * block and loaded later (see save() and load()).
+ */
+
+#include "d2_data.hpp"
+#include "d2_server.hpp"
+#include "timer.h"
+#include <stdint.h>
+#include <fstream>
+#include <algorithm>
+
+namespace d2 {
+  namespace internal {
+
+    struct _IndexHeader {
+      char magic[4];      ///< "D2I\0"
+      uint32_t version;
+      uint32_t real_size; ///< sizeof(real_t)
+      uint32_t reserved;
+      uint64_t dim, size, col;
+    };
+
+    static const char _index_magic[4] = {'D', '2', 'I', '\0'};
+    static const uint32_t _index_version = 1;
+
+    /*! \brief the root of the mean squared distance from supports to the
+     * centroid, from which |s1 - s2|^2 is added to the version 0 bound
+     * (only for squared Euclidean costs, otherwise 0) */
+    template <size_t dim>
+    void _spreads(const Block<Elem<def::Euclidean, dim> > &b,
+		  const Meta<Elem<def::Euclidean, dim> > &meta,
+		  const real_t *c, __OUT__ real_t *s) {
+      parallel_for(b.get_size(), [&](size_t i, size_t w) {
+	  const real_t *ci = c + i*dim;
+	  real_t val = 0;
+	  for (index_t j=0; j<b[i].len; ++j) {
+	    const real_t *x = b[i].supp + j*dim;
+	    real_t d2 = 0;
+	    for (size_t d=0; d<dim; ++d) d2 += (x[d] - ci[d]) * (x[d] - ci[d]);
+	    val += b[i].w[j] * d2;
+	  }
+	  s[i] = sqrt(val);
+	});
+    }
+
+    template <size_t dim>
+    void _spreads(const Block<Elem<def::WordVec, dim> > &b,
+		  const Meta<Elem<def::WordVec, dim> > &meta,
+		  const real_t *c, __OUT__ real_t *s) {
+      std::fill(s, s + b.get_size(), 0);
+    }
+
+    /*! \brief the version 0 bound from the squared distance d between
+     * centroids and the spreads s1 and s2 */
+    template <size_t dim>
+    inline real_t _LowerThanEMD_v0_index(const Elem<def::Euclidean, dim> &e, const real_t d,
+					 const real_t s1, const real_t s2) {
+      return d + (s1 - s2) * (s1 - s2);
+    }
+
+    template <size_t dim>
+    inline real_t _LowerThanEMD_v0_index(const Elem<def::WordVec, dim> &e, const real_t d,
+					 const real_t s1, const real_t s2) {
+      return sqrt(d);
+    }
+
+    /*! \brief the squared norms of all supports (def::Euclidean only) */
+    template <typename ElemType>
+    void _supp_norms(const Block<ElemType> &b, std::vector<real_t> &norm) {
+      norm.clear();
+    }
+
+    template <size_t dim>
+    void _supp_norms(const Block<Elem<def::Euclidean, dim> > &b, std::vector<real_t> &norm) {
+      norm.resize(b.get_col());
+      if (b.get_col() > 0) _D2_FUNC(csqnorm)(dim, b.get_col(), b.get_support_ptr(), &norm[0]);
+    }
+
+    /*! \brief the cost matrix between e and b[i] with the norms of the index,
+     * or with the supports of e stored dimension-major in et */
+    template <typename ElemType1, typename ElemType2>
+    inline void _pdist2_index(const ElemType1 &e, const Block<ElemType2> &b, const size_t i,
+			      const std::vector<real_t> &norm, real_t *mat,
+			      const real_t *et, const size_t ld) {
+      _pdist2(e.supp, e.len, b[i].supp, b[i].len, b.meta, mat);
+    }
+
+    template <size_t dim>
+    inline void _pdist2_index(const Elem<def::Euclidean, dim> &e,
+			      const Block<Elem<def::Euclidean, dim> > &b, const size_t i,
+			      const std::vector<real_t> &norm, real_t *mat,
+			      const real_t *et, const size_t ld) {
+      if (et && _D2_PDIST2_USE_DMAJOR(dim, e.len, b[i].len))
+	_D2_FUNC(pdist2_dmajor)(dim, e.len, b[i].len, et, ld, b[i].supp, mat);
+      else if (!_D2_PDIST2_USE_GEMM(dim, e.len, b[i].len))
+	_D2_FUNC(pdist2_direct)(dim, e.len, b[i].len, e.supp, b[i].supp, mat);
+      else {
+	_Scratch scratch;
+	_D2_FUNC(pdist2_norm)(dim, e.len, b[i].len, e.supp, b[i].supp, _sqnorm(dim, e.len, e.supp, scratch),
+			      &norm[b[i].w - b.get_weight_ptr()], mat);
+      }
+    }
+  }
+
+  /*!
+   * \brief the persistent index of a block for KNearestNeighbors queries.
+   * Only def::Euclidean and def::WordVec, whose version 0 bounds are
+   * defined by centroids, are supported. The block must outlive the index
+   * and must not change after the index is built or loaded.
+   */
+  template <typename ElemType>
+  class Index {
+  public:
+    Index(const Block<ElemType> &b): b(b), size(0), col(0) {}
+
+    /*! \brief compute the statistics of all elements in the block */
+    void build();
+
+    /*! \brief write the statistics to a binary file */
+    int save(const std::string &filename) const;
+
+    /*! \brief read the statistics from a binary file written by save(),
+     * which must match the block (return 0 if successful) */
+    int load(const std::string &filename);
+
+    /*!
+     * \brief the k nearest neighbors of every element in a block of
+     * queries, as KNearestNeighbors_Batch() but with the bounds of the
+     * index, which are tighter for def::Euclidean.
+     * \return the number of EMD computed
+     */
+    template <typename ElemType1>
+    size_t KNearestNeighbors(size_t k,
+			     const Block<ElemType1> &queries,
+			     __OUT__ real_t* dists,
+			     __OUT__ index_t* ids,
+			     size_t n = 0,
+			     d2_solver_context_t *ctx = NULL) const;
+
+    inline size_t get_size() const {return size;}
+    inline const real_t* get_centroid_ptr() const {return &centroid[0];}
+    inline const real_t* get_spread_ptr() const {return &spread[0];}
+
+  private:
+    const Block<ElemType> &b;
+    size_t size, col;
+    std::vector<real_t> centroid, centroid_norm, spread, supp_norm;
+  };
+
+  template <typename ElemType>
+  void Index<ElemType>::build() {
+    const size_t dim = ElemType::D;
+    double startTime = getRealTime();
+    size = b.get_size();
+    col = b.get_col();
+    centroid.resize(dim * std::max(size, (size_t) 1));
+    centroid_norm.resize(std::max(size, (size_t) 1));
+    spread.resize(std::max(size, (size_t) 1));
+    if (size > 0) {
+      internal::_centroids(b, b.meta, &centroid[0]);
+      _D2_FUNC(csqnorm)(dim, size, &centroid[0], &centroid_norm[0]);
+      internal::_spreads(b, b.meta, &centroid[0], &spread[0]);
+    }
+    internal::_supp_norms(b, supp_norm);
+    std::cerr << getLogHeader() << " logging: build index in "
+	      << (getRealTime() - startTime) << " seconds." << std::endl;
+  }
+
+  template <typename ElemType>
+  int Index<ElemType>::save(const std::string &filename) const {
+    using namespace std;
+    using namespace internal;
+    _IndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, _index_magic, 4);
+    h.version = _index_version;
+    h.real_size = sizeof(real_t);
+    h.dim = ElemType::D;
+    h.size = size;
+    h.col = col;
+
+    ofstream fs;
+    fs.open(filename, ofstream::out | ofstream::binary);
+    if (!fs.is_open()) {
+      cerr << getLogHeader() << " error: cannot open " << filename << "." << endl;
+      return 1;
+    }
+    fs.write((const char*) &h, sizeof(h));
+    fs.write((const char*) &centroid[0], sizeof(real_t) * ElemType::D * size);
+    fs.write((const char*) &centroid_norm[0], sizeof(real_t) * size);
+    fs.write((const char*) &spread[0], sizeof(real_t) * size);
+    const uint64_t norm_count = supp_norm.size();
+    fs.write((const char*) &norm_count, sizeof(uint64_t));
+    if (norm_count > 0) fs.write((const char*) &supp_norm[0], sizeof(real_t) * norm_count);
+    fs.close();
+    return 0;
+  }
+
+  template <typename ElemType>
+  int Index<ElemType>::load(const std::string &filename) {
+    using namespace std;
+    using namespace internal;
+    const size_t dim = ElemType::D;
+    ifstream fs(filename, ifstream::in | ifstream::binary);
+    if (!fs.is_open()) {
+      cerr << getLogHeader() << " error: cannot open " << filename << "." << endl;
+      return 1;
+    }
+    _IndexHeader h;
+    if (!fs.read((char*) &h, sizeof(h)) ||
+	!equal(h.magic, h.magic + 4, _index_magic) || h.version != _index_version ||
+	h.real_size != sizeof(real_t) || h.dim != dim ||
+	h.size != b.get_size() || h.col != b.get_col()) {
+      cerr << getLogHeader() << " error: " << filename
+	   << " does not match the block or is corrupted." << endl;
+      return 1;
+    }
+    size = h.size;
+    col = h.col;
+    centroid.resize(dim * std::max(size, (size_t) 1));
+    centroid_norm.resize(std::max(size, (size_t) 1));
+    spread.resize(std::max(size, (size_t) 1));
+    uint64_t norm_count = 0;
+    fs.read((char*) &centroid[0], sizeof(real_t) * dim * size);
+    fs.read((char*) &centroid_norm[0], sizeof(real_t) * size);
+    fs.read((char*) &spread[0], sizeof(real_t) * size);
+    fs.read((char*) &norm_count, sizeof(uint64_t));
+    if (fs && norm_count != 0 && norm_count != col) {
+      cerr << getLogHeader() << " error: " << filename << " is corrupted." << endl;
+      size = col = 0;
+      return 1;
+    }
+    if (fs) {
+      supp_norm.resize(norm_count);
+      if (norm_count > 0) fs.read((char*) &supp_norm[0], sizeof(real_t) * norm_count);
+    }
+    if (!fs) {
+      cerr << getLogHeader() << " error: " << filename << " is truncated." << endl;
+      size = col = 0;
+      return 1;
+    }
+    return 0;
+  }
+
+  template <typename ElemType>
+  template <typename ElemType1>
+  size_t Index<ElemType>::KNearestNeighbors(size_t k,
+					    const Block<ElemType1> &queries,
+					    __OUT__ real_t* dists,
+					    __OUT__ index_t* ids,
+					    size_t n,
+					    d2_solver_context_t *ctx) const {
+    const size_t dim = ElemType::D;
+    const size_t nq = queries.get_size(), nb = size;
+    assert(nb == b.get_size());
+    if (n == 0 || n > nb) n = nb;
+    if (nq == 0) return 0;
+
+    // the same statistics of queries
+    std::vector<real_t> cq(dim * nq), cqn(nq), sq(nq);
+    internal::_centroids(queries, b.meta, &cq[0]);
+    _D2_FUNC(csqnorm)(dim, nq, &cq[0], &cqn[0]);
+    internal::_spreads(queries, b.meta, &cq[0], &sq[0]);
+
+    const size_t chunk = std::max((size_t) 1, std::min(nq, ((size_t) 1 << 22) / std::max(nb, (size_t) 1)));
+    std::vector<real_t> lower0(nb * chunk);
+
+    const size_t num_workers = server::GetNumThreads();
+    const size_t mat_size = queries.get_max_len() * b.get_max_len();
+    std::vector<std::vector<index_t> > cand(num_workers);
+    std::vector<size_t> count(num_workers, 0);
+
+    for (size_t q0=0; q0<nq; q0 += chunk) {
+      const size_t q1 = std::min(nq, q0 + chunk);
+      if (nb > 0)
+	_D2_FUNC(pdist2_norm)(dim, nb, q1 - q0, &centroid[0], &cq[dim * q0],
+			      &centroid_norm[0], &cqn[q0], &lower0[0]);
+      internal::parallel_for(q1 - q0, [&](size_t t, size_t w) {
+	  const size_t q = q0 + t;
+	  internal::_Scratch scratch;
+	  real_t *lb = &lower0[nb * t];
+	  for (size_t i=0; i<nb; ++i)
+	    lb[i] = internal::_LowerThanEMD_v0_index(queries[q], lb[i], sq[q], spread[i]);
+	  size_t ld = queries.is_aligned() ? queries.get_aligned_ld(q) : 0;
+	  const real_t *et = queries.get_aligned_support_ptr(q);
+	  if (!et) et = internal::_dim_major(queries[q], scratch, ld);
+	  auto cost = [&](index_t idx, real_t *mat) {
+	    internal::_pdist2_index(queries[q], b, idx, supp_norm, mat, et, ld);
+	  };
+	  count[w] += internal::_KNearestNeighbors_Batch_impl(k, queries[q], b, lb, n, cost,
+							      scratch.alloc<real_t>(mat_size), cand[w],
+							      w == 0 ? ctx : NULL,
+							      dists + q * k, ids + q * k);
+	});
+    }
+
+    size_t total = 0;
+    for (size_t w=0; w<num_workers; ++w) total += count[w];
+    return total;
+  }
+
+}
+
+#endif /* _D2_INDEX_H_ */
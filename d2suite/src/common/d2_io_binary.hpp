@@ -0,0 +1,288 @@
+#ifndef _D2_IO_BINARY_H_
+#define _D2_IO_BINARY_H_
+
+/*!
+ * \file d2_io_binary.hpp
+ * \brief The .d2b binary format of Block, which is memory-mapped on read.
+ *
+ * A .d2b file is a header followed by sections that mirror the storage of
+ * Block, each aligned to 64 bytes:
+ *     lengths of elements (uint64_t x size)
+ *     weights (real_t x col)
+ *     labels (real_t x col)
+ *     supports (SuppType x step_stride(col, dim))
+ *     meta data (the embedding of def::WordVec, or the distance matrix of
+ *                def::Histogram, def::SparseHistogram and def::NGram)
+ * The file is mapped privately (copy-on-write), so in-place updates of the
+ * block never reach the file. Files are only portable between builds with
+ * the same real_t and byte order.
+ */
+
+#include "d2_data.hpp"
+#include "timer.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <algorithm>
+
+namespace d2 {
+  namespace internal {
+
+    struct _BinaryHeader {
+      char magic[4];      ///< "D2B\0"
+      uint32_t version;
+      uint32_t type;      ///< _BinaryType<D2Type>::code
+      uint32_t real_size; ///< sizeof(real_t)
+      uint32_t supp_size; ///< sizeof(SuppType)
+      uint32_t reserved;
+      uint64_t dim, size, col, max_len;
+      uint64_t meta_size; ///< the size field of the meta data
+      uint64_t off_len, off_w, off_label, off_supp, off_meta, file_size;
+    };
+
+    static const char _binary_magic[4] = {'D', '2', 'B', '\0'};
+    static const uint32_t _binary_version = 1;
+    static const uint64_t _binary_align = 64;
+
+    inline uint64_t _binary_aligned(uint64_t offset) {
+      return (offset + _binary_align - 1) / _binary_align * _binary_align;
+    }
+
+    /* the type tag of supports; 0 means not supported by the format */
+    template <typename D2Type> struct _BinaryType {static const uint32_t code = 0;};
+    template <> struct _BinaryType<def::Euclidean> {static const uint32_t code = 1;};
+    template <> struct _BinaryType<def::WordVec> {static const uint32_t code = 2;};
+    template <> struct _BinaryType<def::NGram> {static const uint32_t code = 3;};
+    template <> struct _BinaryType<def::Histogram> {static const uint32_t code = 4;};
+    template <> struct _BinaryType<def::SparseHistogram> {static const uint32_t code = 5;};
+
+    /* how the meta data is stored: its size field and an array of
+     * count(size) real_t, which is shared with the mapping on read */
+    template <typename D2Type, size_t D>
+    struct _BinaryMeta {
+      static size_t get_size(const _Meta<D2Type, D> &meta) {return 0;}
+      static size_t count(const size_t size) {return 0;}
+      static const real_t* get_data(const _Meta<D2Type, D> &meta) {return NULL;}
+      static void map(_Meta<D2Type, D> &meta, const size_t size, real_t *data) {}
+    };
+
+    template <size_t D>
+    struct _BinaryMeta<def::WordVec, D> {
+      static size_t get_size(const _Meta<def::WordVec, D> &meta) {return meta.size;}
+      static size_t count(const size_t size) {return size * D;}
+      static const real_t* get_data(const _Meta<def::WordVec, D> &meta) {return meta.embedding;}
+      static void map(_Meta<def::WordVec, D> &meta, const size_t size, real_t *data) {
+	meta.to_shared();
+	meta.size = size;
+	meta.embedding = data;
+      }
+    };
+
+    template <size_t D>
+    struct _BinaryMeta<def::Histogram, D> {
+      static size_t get_size(const _Meta<def::Histogram, D> &meta) {return meta.size;}
+      static size_t count(const size_t size) {return size * size;}
+      static const real_t* get_data(const _Meta<def::Histogram, D> &meta) {return meta.dist_mat;}
+      static void map(_Meta<def::Histogram, D> &meta, const size_t size, real_t *data) {
+	meta.to_shared();
+	meta.size = size;
+	meta.dist_mat = data;
+      }
+    };
+
+    template <size_t D>
+    struct _BinaryMeta<def::SparseHistogram, D> : public _BinaryMeta<def::Histogram, D> {};
+
+    template <size_t D>
+    struct _BinaryMeta<def::NGram, D> : public _BinaryMeta<def::Histogram, D> {};
+
+    /*!
+     * \brief whether the header h, at the start of data of file_size bytes,
+     * describes a file of ElemType whose sections lie within it, and whose
+     * element lengths add up to h.col
+     */
+    template <typename ElemType>
+    bool _binary_valid(const _BinaryHeader &h, const char *data, const size_t file_size) {
+      typedef typename ElemType::T::type SuppType;
+      const uint64_t supp_count = ElemType::T::step_stride(h.col, ElemType::D);
+      const uint64_t meta_count = _BinaryMeta<typename ElemType::T, ElemType::D>::count(h.meta_size);
+      if (!std::equal(h.magic, h.magic + 4, _binary_magic) || h.version != _binary_version ||
+	  h.type != _BinaryType<typename ElemType::T>::code || h.dim != ElemType::D ||
+	  h.real_size != sizeof(real_t) || h.supp_size != sizeof(SuppType) ||
+	  h.file_size != file_size || h.size > file_size || h.col > file_size ||
+	  h.off_len < sizeof(_BinaryHeader) ||
+	  h.off_w < h.off_len + sizeof(uint64_t) * h.size ||
+	  h.off_label < h.off_w + sizeof(real_t) * h.col ||
+	  h.off_supp < h.off_label + sizeof(real_t) * h.col ||
+	  h.off_meta < h.off_supp + sizeof(SuppType) * supp_count ||
+	  file_size < h.off_meta + sizeof(real_t) * meta_count)
+	return false;
+      // each length is at most h.col, so the sum cannot wrap around
+      const uint64_t *lens = (const uint64_t*) (data + h.off_len);
+      uint64_t col = 0;
+      for (size_t i=0; i<h.size; ++i) {
+	if (lens[i] > h.col) return false;
+	col += lens[i];
+      }
+      return col == h.col;
+    }
+
+    /*! \brief check whether a file starts with the .d2b magic */
+    inline bool _is_binary(const std::string &filename) {
+      char magic[4];
+      std::ifstream fs(filename, std::ifstream::in | std::ifstream::binary);
+      if (!fs.is_open() || !fs.read(magic, 4)) return false;
+      return std::equal(magic, magic + 4, _binary_magic);
+    }
+
+    inline void _write_padding(std::ostream &os, uint64_t &pos, const uint64_t offset) {
+      static const char zeros[_binary_align] = {0};
+      os.write(zeros, offset - pos);
+      pos = offset;
+    }
+  }
+
+  template <typename ElemType>
+  void Block<ElemType>::write_binary(const std::string &filename) const {
+    using namespace std;
+    using namespace internal;
+    typedef _BinaryMeta<typename ElemType::T, ElemType::D> BinaryMeta;
+    if (_BinaryType<typename ElemType::T>::code == 0) {
+      cerr << getLogHeader() << " error: the element type is not supported by .d2b." << endl;
+      return;
+    }
+    double startTime = getRealTime();
+
+    _BinaryHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, _binary_magic, 4);
+    h.version = _binary_version;
+    h.type = _BinaryType<typename ElemType::T>::code;
+    h.real_size = sizeof(real_t);
+    h.supp_size = sizeof(SuppType);
+    h.dim = ElemType::D;
+    h.size = size;
+    h.col = col;
+    h.max_len = max_len;
+    h.meta_size = BinaryMeta::get_size(meta);
+    const uint64_t supp_count = ElemType::T::step_stride(col, ElemType::D);
+    const uint64_t meta_count = BinaryMeta::count(h.meta_size);
+    h.off_len   = _binary_aligned(sizeof(h));
+    h.off_w     = _binary_aligned(h.off_len + sizeof(uint64_t) * size);
+    h.off_label = _binary_aligned(h.off_w + sizeof(real_t) * col);
+    h.off_supp  = _binary_aligned(h.off_label + sizeof(real_t) * col);
+    h.off_meta  = _binary_aligned(h.off_supp + sizeof(SuppType) * supp_count);
+    h.file_size = h.off_meta + sizeof(real_t) * meta_count;
+
+    ofstream fs;
+    fs.open(filename, ofstream::out | ofstream::binary);
+    assert(fs.is_open());
+    uint64_t pos = sizeof(h);
+    fs.write((const char*) &h, sizeof(h));
+    _write_padding(fs, pos, h.off_len);
+    for (size_t i=0; i<size; ++i) {
+      const uint64_t len = vec_[i].len;
+      fs.write((const char*) &len, sizeof(uint64_t));
+    }
+    pos += sizeof(uint64_t) * size;
+    _write_padding(fs, pos, h.off_w);
+    fs.write((const char*) p_w, sizeof(real_t) * col);
+    pos += sizeof(real_t) * col;
+    _write_padding(fs, pos, h.off_label);
+    fs.write((const char*) p_label, sizeof(real_t) * col);
+    pos += sizeof(real_t) * col;
+    _write_padding(fs, pos, h.off_supp);
+    fs.write((const char*) p_supp, sizeof(SuppType) * supp_count);
+    pos += sizeof(SuppType) * supp_count;
+    _write_padding(fs, pos, h.off_meta);
+    if (meta_count > 0) fs.write((const char*) BinaryMeta::get_data(meta), sizeof(real_t) * meta_count);
+    fs.close();
+
+    cerr << getLogHeader() << " logging: write binary data in "
+	 << (getRealTime() - startTime) << " seconds." << endl;
+  }
+
+  template <typename ElemType>
+  int Block<ElemType>::read_binary(const std::string &filename, const size_t size, const bool with_meta) {
+    using namespace std;
+    using namespace internal;
+    double startTime = getRealTime();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      cerr << getLogHeader() << " error: cannot open " << filename << "." << endl;
+      return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(_BinaryHeader)) {
+      cerr << getLogHeader() << " error: " << filename << " is not a .d2b file." << endl;
+      close(fd);
+      return 1;
+    }
+    const size_t file_size = st.st_size;
+    void *p = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+      cerr << getLogHeader() << " error: cannot map " << filename << "." << endl;
+      return 1;
+    }
+
+    const _BinaryHeader &h = *(const _BinaryHeader*) p;
+    if (!_binary_valid<ElemType>(h, (const char*) p, file_size)) {
+      cerr << getLogHeader() << " error: " << filename
+	   << " does not match the element type or is corrupted." << endl;
+      munmap(p, file_size);
+      return 1;
+    }
+
+    // drop the current storage and use the mapping instead
+    if (!isShared) {
+      if (p_w != NULL) free(p_w);
+      if (p_label != NULL) free(p_label);
+      if (p_supp != NULL) free(p_supp);
+    }
+    if (p_map != NULL) unmap();
+    p_map = p;
+    map_size = file_size;
+    isShared = true;
+
+    char *base = (char*) p;
+    const uint64_t *lens = (const uint64_t*) (base + h.off_len);
+    this->size = std::min((size_t) h.size, size);
+    vec_.resize(this->size);
+    col = 0;
+    max_len = 0;
+    for (size_t i=0; i<this->size; ++i) {
+      vec_[i].len = lens[i];
+      col += lens[i];
+      if (max_len < lens[i]) max_len = lens[i];
+    }
+    max_col = col;
+    p_w = (real_t*) (base + h.off_w);
+    p_label = (real_t*) (base + h.off_label);
+    p_supp = (SuppType*) (base + h.off_supp);
+    if (with_meta)
+      _BinaryMeta<typename ElemType::T, ElemType::D>::map(meta, h.meta_size, (real_t*) (base + h.off_meta));
+    if (this->size < h.size)
+      cerr << getLogHeader() << " warning: use only " << this->size << " of "
+	   << h.size << " instances." << endl;
+    if (this->size > 0) realign_vec();
+
+    cerr << getLogHeader() << " logging: map data in "
+	 << (getRealTime() - startTime) << " seconds." << endl;
+    return 0;
+  }
+
+  template <typename ElemType>
+  void Block<ElemType>::unmap() {
+    munmap(p_map, map_size);
+    p_map = NULL;
+    map_size = 0;
+  }
+
+}
+
+#endif /* _D2_IO_BINARY_H_ */
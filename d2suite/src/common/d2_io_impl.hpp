@@ -3,11 +3,18 @@
 
 
 #include "d2_data.hpp"
+#include "d2_io_binary.hpp"
+#include "d2_io_text.hpp"
+#include "d2_parallel.hpp"
 #include "timer.h"
+#include "blas_like.h"
 #include <string>
 #include <assert.h>
 #include <algorithm>
 #include <random>
+#include <type_traits>
+#include <queue>
+#include <new>
 
 namespace d2 {
 
@@ -149,6 +156,34 @@ namespace d2 {
     return is.eof();
   }
 
+  template <typename ElemType>
+  void Block<ElemType>::resize(const size_t thesize, const size_t *lens) {
+    size_t thecol = 0;
+    max_len = 0;
+    vec_.resize(thesize);
+    for (size_t i=0; i<thesize; ++i) {
+      vec_[i].len = lens[i];
+      thecol += lens[i];
+      if (max_len < lens[i]) max_len = lens[i];
+    }
+    const size_t alloc_col = thecol > 0 ? thecol : 1;
+    if (isShared) {
+      if (p_map != NULL) unmap();
+      p_w = (real_t*) malloc(sizeof(real_t) * alloc_col);
+      p_label = (real_t*) malloc(sizeof(real_t) * alloc_col);
+      p_supp = (SuppType*) malloc(sizeof(SuppType) * ElemType::T::step_stride(alloc_col, ElemType::D));
+      isShared = false;
+    } else if (thecol != max_col) {
+      p_w = (real_t*) realloc(p_w, sizeof(real_t) * alloc_col);
+      p_label = (real_t*) realloc(p_label, sizeof(real_t) * alloc_col);
+      p_supp = (SuppType*) realloc(p_supp, sizeof(SuppType) * ElemType::T::step_stride(alloc_col, ElemType::D));
+    }
+    assert(p_w && p_label);
+    size = thesize;
+    col = thecol;
+    max_col = thecol;
+  }
+
   template <typename ElemType>
   void Block<ElemType>::realign_vec() {
     assert(size > 0);
@@ -161,11 +196,81 @@ namespace d2 {
       vec_[i].label = vec_[i-1].label + vec_[i-1].len;
       vec_[i].supp = vec_[i-1].supp + ElemType::T::step_stride(vec_[i-1].len, ElemType::D);
     }
+    update_norm();
+  }
+
+  namespace internal {
+    /* only Euclidean supports have their norms cached */
+    template <typename ElemType>
+    inline void _update_norm(const Block<ElemType> &block, real_t *&p_norm) {}
+
+    template <size_t dim>
+    inline void _update_norm(const Block<Elem<def::Euclidean, dim> > &block, real_t *&p_norm) {
+      const size_t col = block.get_col();
+      p_norm = (real_t*) realloc(p_norm, sizeof(real_t) * (col > 0 ? col : 1));
+      _D2_FUNC(csqnorm)(dim, col, block.get_support_ptr(), p_norm);
+    }
+
+    /* only Euclidean supports have an aligned copy */
+    template <typename ElemType>
+    inline void _update_aligned(const Block<ElemType> &block, real_t *&p_w, real_t *&p_supp,
+				std::vector<size_t> &offset) {}
+
+    template <size_t dim>
+    inline void _update_aligned(const Block<Elem<def::Euclidean, dim> > &block, real_t *&p_w, real_t *&p_supp,
+				std::vector<size_t> &offset) {
+      const size_t size = block.get_size();
+      offset.resize(size + 1);
+      offset[0] = 0;
+      for (size_t i=0; i<size; ++i)
+	offset[i+1] = offset[i] + _D2_ALIGN_LEN(block[i].len, sizeof(real_t));
+      if (p_w != NULL) free(p_w);
+      if (p_supp != NULL) free(p_supp);
+      void *pw = NULL, *ps = NULL;
+      if (posix_memalign(&pw, _D2_ALIGN, sizeof(real_t) * std::max(offset[size], (size_t) 1)) != 0 ||
+	  posix_memalign(&ps, _D2_ALIGN, sizeof(real_t) * dim * std::max(offset[size], (size_t) 1)) != 0)
+	throw std::bad_alloc();
+      p_w = (real_t*) pw;
+      p_supp = (real_t*) ps;
+      for (size_t i=0; i<size; ++i) {
+	const size_t len = block[i].len, ld = offset[i+1] - offset[i];
+	real_t *w = p_w + offset[i], *supp = p_supp + dim * offset[i];
+	for (size_t j=0; j<ld; ++j) w[j] = j < len ? block[i].w[j] : 0;
+	for (size_t k=0; k<dim; ++k)
+	  for (size_t j=0; j<ld; ++j)
+	    supp[k*ld + j] = j < len ? block[i].supp[j*dim + k] : 0;
+      }
+    }
+  }
+
+  template <typename ElemType>
+  void Block<ElemType>::update_norm() {
+    internal::_update_norm(*this, p_norm);
+    if (aligned) internal::_update_aligned(*this, p_aligned_w, p_aligned_supp, aligned_offset);
+  }
+
+  template <typename ElemType>
+  void Block<ElemType>::set_aligned(const bool enable) {
+    aligned = enable;
+    if (aligned && size > 0) {
+      internal::_update_aligned(*this, p_aligned_w, p_aligned_supp, aligned_offset);
+    } else if (!aligned) {
+      if (p_aligned_w != NULL) free(p_aligned_w);
+      if (p_aligned_supp != NULL) free(p_aligned_supp);
+      p_aligned_w = p_aligned_supp = NULL;
+      aligned_offset.clear();
+    }
   }
 
 
   template <typename ElemType>
   void Block<ElemType>::read(const std::string &filename, const size_t size) {
+    if (internal::_is_binary(filename)) {
+      // meta data are part of the binary file
+      int ret = read_binary(filename, size);
+      assert(ret == 0);
+      return;
+    }
     meta.read(filename + ".meta0");
     read_main(filename, size);
   }
@@ -252,8 +357,143 @@ namespace d2 {
       os << t[i];
     }
 
+    /* pass 1 of reading text: skip one element (of all phases) and 
+     * collect its lengths; return false if the file ends before */
+    template <typename ElemType>
+    bool _scan_record(const char *&p, const char *end, const Block<ElemType> &t, std::vector<size_t> *lens) {
+      _skip_space(p, end);
+      if (p == end) return false;
+      const size_t dim = _parse_uint<size_t>(p, end);
+      _skip_space(p, end);
+      if (p == end) return false;
+      const size_t len = _parse_uint<size_t>(p, end);
+      assert(dim == ElemType::D || 0 == ElemType::D);
+      if (!_skip_tokens(p, end, len + _TextElem<typename ElemType::T, ElemType::D>::supp_tokens(len)))
+	return false;
+      lens->push_back(len);
+      return true;
+    }
+
+    inline bool _scan_record(const char *&p, const char *end, const _BlockMultiPhaseConstructor<> &t, std::vector<size_t> *lens) {
+      return true;
+    }
+
+    template <typename T1, typename... Ts>
+    bool _scan_record(const char *&p, const char *end, const _BlockMultiPhaseConstructor<T1, Ts...> &t, std::vector<size_t> *lens) {
+      return _scan_record(p, end, t.head, lens) && _scan_record(p, end, t.tail, lens + 1);
+    }
+
+    /* pass 2 of reading text: parse the i-th element into its place */
+    template <typename ElemType>
+    void _parse_record(const char *&p, const char *end, Block<ElemType> &t, const std::vector<size_t> *offsets, const size_t i) {
+      const size_t offset = (*offsets)[i];
+      _parse_uint<size_t>(p, end); // dim
+      const size_t len = _parse_uint<size_t>(p, end);
+      _parse_weights(p, end, len, t.get_weight_ptr() + offset);
+      _TextElem<typename ElemType::T, ElemType::D>::parse_supp
+	(p, end, len, t.get_support_ptr() + ElemType::T::step_stride(offset, ElemType::D));
+    }
+
+    inline void _parse_record(const char *&p, const char *end, _BlockMultiPhaseConstructor<> &t, const std::vector<size_t> *offsets, const size_t i) {}
+
+    template <typename T1, typename... Ts>
+    void _parse_record(const char *&p, const char *end, _BlockMultiPhaseConstructor<T1, Ts...> &t, const std::vector<size_t> *offsets, const size_t i) {
+      _parse_record(p, end, t.head, offsets, i);
+      _parse_record(p, end, t.tail, offsets + 1, i);
+    }
+
+    template <typename ElemType>
+    void _resize(Block<ElemType> &t, const std::vector<size_t> *lens) {
+      t.resize(lens->size(), lens->data());
+    }
+
+    inline void _resize(_BlockMultiPhaseConstructor<> &t, const std::vector<size_t> *lens) {}
+
+    template <typename T1, typename... Ts>
+    void _resize(_BlockMultiPhaseConstructor<T1, Ts...> &t, const std::vector<size_t> *lens) {
+      _resize(t.head, lens);
+      _resize(t.tail, lens + 1);
+    }
+
+    template <typename ElemType>
+    size_t _num_phases(const Block<ElemType> &t) {return 1;}
+
+    inline size_t _num_phases(const _BlockMultiPhaseConstructor<> &t) {return 0;}
+
+    template <typename T1, typename... Ts>
+    size_t _num_phases(const _BlockMultiPhaseConstructor<T1, Ts...> &t) {return 1 + _num_phases(t.tail);}
+
+    /* whether all phases can be read by the parallel text reader */
+    template <typename... Ts>
+    struct _text_supported_elems : std::true_type {};
+
+    template <typename T1, typename... Ts>
+    struct _text_supported_elems<T1, Ts...> :
+      std::integral_constant<bool, _TextElem<typename T1::T, T1::D>::supported &&
+			     _text_supported_elems<Ts...>::value> {};
+
+    template <typename BlockType>
+    struct _text_supported;
+
+    template <typename ElemType>
+    struct _text_supported<Block<ElemType> > : _text_supported_elems<ElemType> {};
+
+    template <typename... Ts>
+    struct _text_supported<BlockMultiPhase<Ts...> > : _text_supported_elems<Ts...> {};
+
   template<typename BlockType>
-  void _read_main(BlockType &block, const std::string &filename, const size_t size) {
+  void _read_main(BlockType &block, const std::string &filename, const size_t size, std::true_type) {
+    using namespace std;
+    double startTime = getRealTime();
+    int fd = open(filename.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    const size_t file_size = st.st_size;
+    void *data = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    assert(data != MAP_FAILED);
+    const char *p = (const char*) data, *end = p + file_size;
+
+    // pass 1: locate elements and count their lengths
+    const size_t num_phases = _num_phases(block);
+    vector<vector<size_t> > lens(num_phases);
+    vector<const char*> records;
+    for (size_t i=0; i<size; ++i) {
+      const char *q = p;
+      if (!_scan_record(p, end, block, &lens[0])) break;
+      records.push_back(q);
+    }
+    const size_t n = records.size();
+    if (n < size) 
+      cerr << getLogHeader() << " warning: read only " << n << " instances." << endl;
+
+    // pass 2: parse chunks of elements in parallel into exactly sized buffers
+    vector<vector<size_t> > offsets(num_phases);
+    for (size_t k=0; k<num_phases; ++k) {
+      lens[k].resize(n);
+      offsets[k].resize(n);
+      for (size_t i=0, c=0; i<n; c += lens[k][i], ++i) offsets[k][i] = c;
+    }
+    _resize(block, &lens[0]);
+    block.get_size() = n;
+    const size_t num_chunks = std::min(n, 16 * _global_pool()->size());
+    if (num_chunks > 0)
+      parallel_for(num_chunks, [&](size_t t, size_t w) {
+	  const size_t i0 = n * t / num_chunks, i1 = n * (t + 1) / num_chunks;
+	  const char *q = records[i0];
+	  for (size_t i=i0; i<i1; ++i) _parse_record(q, end, block, &offsets[0], i);
+	});
+    if (data != NULL) munmap(data, file_size);
+
+    if (n > 0) _realign_vec(block);
+    cerr << getLogHeader() << " logging: read data in " 
+	 << (getRealTime() - startTime) << " seconds." << endl;
+  }
+
+  /* read through operator>>, for types without a text parser */
+  template<typename BlockType>
+  void _read_main(BlockType &block, const std::string &filename, const size_t size, std::false_type) {
     using namespace std;
     ifstream fs;
     double startTime = getRealTime();
@@ -277,6 +517,11 @@ namespace d2 {
     << (getRealTime() - startTime) << " seconds." << endl;
   }
 
+  template<typename BlockType>
+  void _read_main(BlockType &block, const std::string &filename, const size_t size) {
+    _read_main(block, filename, size, std::integral_constant<bool, _text_supported<BlockType>::value>());
+  }
+
 
     template<typename BlockType>
     void _write(BlockType &block, const std::string &filename) {
@@ -299,6 +544,18 @@ namespace d2 {
       }
     }
 
+    /* the estimated work of an element in EMD and BADMM, which is the
+     * total length of its phases */
+    template <typename ElemType>
+    size_t _work(const Block<ElemType> &t, const size_t i) {return t[i].len;}
+
+    inline size_t _work(const _BlockMultiPhaseConstructor<> &t, const size_t i) {return 0;}
+
+    template <typename T1, typename... Ts>
+    size_t _work(const _BlockMultiPhaseConstructor<T1, Ts...> &t, const size_t i) {
+      return _work(t.head, i) + _work(t.tail, i);
+    }
+
     template<typename BlockType> 
     void _split_write(BlockType &block, const std::string &filename, const size_t num_copies) {
       using namespace std;
@@ -311,18 +568,46 @@ namespace d2 {
 	assert(num_copies > 1);
 	double startTime = getRealTime();
 	vector<ofstream> fs(num_copies);
-	size_t batch_size = (size-1) / num_copies + 1;
+
+	// longest processing time first: elements in decreasing order of
+	// work go to the part with the least work so far
+	vector<size_t> order(rand_ind), part(size), local(size), count(num_copies, 0);
+	stable_sort(order.begin(), order.end(), 
+		    [&](size_t i1, size_t i2) {return _work(block, i1) > _work(block, i2);});
+	typedef pair<size_t, size_t> Load;
+	priority_queue<Load, vector<Load>, greater<Load> > load;
+	for (size_t j=0; j<num_copies; ++j) load.push(Load(0, j));
+	for (size_t i=0; i<size; ++i) {
+	  Load l = load.top(); load.pop();
+	  part[order[i]] = l.second;
+	  l.first += _work(block, order[i]);
+	  load.push(l);
+	}
+	size_t min_work = load.top().first, max_work = 0;
+	while (!load.empty()) {max_work = load.top().first; load.pop();}
 
 	for (int j=0; j<num_copies; ++j) {
 	  fs[j].open(filename + ".part" + to_string(j), ofstream::out);
 	  assert(fs[j].is_open());
 	}
 	for (size_t i=0; i<size; ++i) {
-	  _append_to(fs[i/batch_size], block, rand_ind[i]);
+	  const size_t idx = rand_ind[i];
+	  _append_to(fs[part[idx]], block, idx);
+	  local[idx] = count[part[idx]]++;
 	}
 	for (int j=0; j<num_copies; ++j) fs[j].close();
+
+	// the partition map: the part and the index in that part of every
+	// element, in the original order
+	ofstream fs_map(filename + ".partmap", ofstream::out);
+	assert(fs_map.is_open());
+	fs_map << num_copies << endl;
+	for (size_t i=0; i<size; ++i) fs_map << part[i] << " " << local[i] << endl;
+	fs_map.close();
+
 	cerr << getLogHeader() << " logging: write data into part0.." << num_copies-1 << " in " 
-	     << (getRealTime() - startTime) << " seconds." << endl;
+	     << (getRealTime() - startTime) << " seconds (work per part " 
+	     << min_work << " to " << max_work << ")." << endl;
       
       } else {
 	cerr << getLogHeader() << " error: empty filename specified." << endl;
@@ -412,6 +697,11 @@ namespace d2 {
 
   template <typename ElemType>
   void Block<ElemType>::read_main(const std::string &filename, const size_t size) {
+    if (internal::_is_binary(filename)) {
+      int ret = read_binary(filename, size, false);
+      assert(ret == 0);
+      return;
+    }
     internal::_read_main(*this, filename, size);
   }
 
@@ -12,12 +12,137 @@ namespace d2 {
       (this)->read_main(filename + ".part" + std::to_string(GetRank()), size);
     global_size = this->size;
     Allreduce<op::Sum>(&global_size, 1);
+    init_ids();
+  }
+
+  template<typename ElemType>
+  void DistributedBlock<ElemType>::init_ids() {
+    using namespace rabit;
+    const size_t world = GetWorldSize(), rank = GetRank();
+    std::vector<size_t> sizes(world, 0);
+    sizes[rank] = this->size;
+    Allreduce<op::Sum>(&sizes[0], world);
+    size_t offset = 0;
+    for (size_t r=0; r<rank; ++r) offset += sizes[r];
+    ids.resize(this->size);
+    for (size_t i=0; i<this->size; ++i) ids[i] = offset + i;
   }
 
   template<typename ElemType>
   void DistributedBlock<ElemType>::read(const std::string &filename, const size_t size) {
     this->meta.read(filename + ".meta0");
-    this->read_main(filename, (size - 1) / rabit::GetWorldSize() + 1);
+    // parts are balanced by work (see split_write), not by the number of elements
+    this->read_main(filename, size);
+  }
+
+  template<typename ElemType>
+  void DistributedBlock<ElemType>::rebalance(const double time) {
+    using namespace std;
+    using namespace rabit;
+    typedef typename ElemType::T::type SuppType;
+    const size_t world = GetWorldSize(), rank = GetRank(), size = this->size;
+    double startTime = getRealTime();
+
+    // blocks filled otherwise than by read_main are numbered first
+    int unnumbered = ids.size() != size;
+    Allreduce<op::Max>(&unnumbered, 1);
+    if (unnumbered) init_ids();
+
+    // the work (total length) and speed of every worker
+    vector<double> work(world, 0), speed(world, 0), target(world), deficit(world);
+    work[rank] = this->col;
+    speed[rank] = this->col > 0 ? this->col / std::max(time, 1E-9) : 0;
+    Allreduce<op::Sum>(&work[0], world);
+    Allreduce<op::Sum>(&speed[0], world);
+    double total_work = 0, total_speed = 0, mean_speed = 0;
+    size_t num_measured = 0;
+    for (size_t r=0; r<world; ++r) {
+      total_work += work[r];
+      if (speed[r] > 0) {mean_speed += speed[r]; ++num_measured;}
+    }
+    if (num_measured == 0) return;
+    mean_speed /= num_measured;
+    for (size_t r=0; r<world; ++r) {
+      if (speed[r] == 0) speed[r] = mean_speed; // workers without data
+      total_speed += speed[r];
+    }
+    for (size_t r=0; r<world; ++r) {
+      target[r] = total_work * speed[r] / total_speed;
+      deficit[r] = std::max(target[r] - work[r], 0.);
+    }
+
+    // this worker sends elements from its end as long as the rest does not
+    // fall below its target
+    size_t keep = size;
+    double w = work[rank];
+    while (keep > 0 && w - this->vec_[keep-1].len >= target[rank]) w -= this->vec_[--keep].len;
+    const size_t keep_col = keep < size ? this->vec_[keep].w - this->p_w : this->col;
+
+    vector<size_t> lens(keep), new_ids(ids.begin(), ids.begin() + keep);
+    for (size_t i=0; i<keep; ++i) lens[i] = this->vec_[i].len;
+    vector<real_t> new_w(this->p_w, this->p_w + keep_col), new_label(this->p_label, this->p_label + keep_col);
+    vector<SuppType> new_supp(this->p_supp, this->p_supp + ElemType::T::step_stride(keep_col, ElemType::D));
+
+    // every sender broadcasts its elements, and receivers take them in the
+    // order of ranks until their deficits are filled
+    size_t num_moved = 0;
+    for (size_t r=0, dest=0; r<world; ++r) {
+      uint64_t n_send = (r == rank) ? size - keep : 0;
+      Broadcast(&n_send, sizeof(uint64_t), r);
+      if (n_send == 0) continue;
+      vector<uint64_t> send_lens(n_send), send_ids(n_send);
+      if (r == rank)
+	for (size_t i=0; i<n_send; ++i) {
+	  send_lens[i] = this->vec_[keep + i].len;
+	  send_ids[i] = ids[keep + i];
+	}
+      Broadcast(&send_lens[0], sizeof(uint64_t) * n_send, r);
+      Broadcast(&send_ids[0], sizeof(uint64_t) * n_send, r);
+      size_t send_col = 0;
+      for (size_t i=0; i<n_send; ++i) send_col += send_lens[i];
+      const size_t send_stride = ElemType::T::step_stride(send_col, ElemType::D);
+      vector<real_t> send_w(send_col), send_label(send_col);
+      vector<SuppType> send_supp(send_stride);
+      if (r == rank) {
+	memcpy(&send_w[0], this->p_w + keep_col, sizeof(real_t) * send_col);
+	memcpy(&send_label[0], this->p_label + keep_col, sizeof(real_t) * send_col);
+	if (send_stride > 0)
+	  memcpy(&send_supp[0], this->p_supp + ElemType::T::step_stride(keep_col, ElemType::D),
+		 sizeof(SuppType) * send_stride);
+      }
+      if (send_col > 0) {
+	Broadcast(&send_w[0], sizeof(real_t) * send_col, r);
+	Broadcast(&send_label[0], sizeof(real_t) * send_col, r);
+      }
+      if (send_stride > 0) Broadcast(&send_supp[0], sizeof(SuppType) * send_stride, r);
+
+      for (size_t i=0, offset=0; i<n_send; offset += send_lens[i], ++i) {
+	while (dest < world && deficit[dest] <= 0) ++dest;
+	// the element stays with its sender if no one needs more work
+	const size_t to = dest < world ? dest : r;
+	if (dest < world) deficit[dest] -= send_lens[i];
+	if (to != r) ++num_moved;
+	if (to != rank) continue;
+	lens.push_back(send_lens[i]);
+	new_ids.push_back(send_ids[i]);
+	new_w.insert(new_w.end(), send_w.begin() + offset, send_w.begin() + offset + send_lens[i]);
+	new_label.insert(new_label.end(), send_label.begin() + offset, send_label.begin() + offset + send_lens[i]);
+	const size_t s0 = ElemType::T::step_stride(offset, ElemType::D);
+	const size_t s1 = ElemType::T::step_stride(offset + send_lens[i], ElemType::D);
+	new_supp.insert(new_supp.end(), send_supp.begin() + s0, send_supp.begin() + s1);
+      }
+    }
+
+    this->resize(lens.size(), lens.data());
+    memcpy(this->p_w, new_w.data(), sizeof(real_t) * new_w.size());
+    memcpy(this->p_label, new_label.data(), sizeof(real_t) * new_label.size());
+    memcpy(this->p_supp, new_supp.data(), sizeof(SuppType) * new_supp.size());
+    if (this->size > 0) this->realign_vec();
+    ids.swap(new_ids);
+
+    if (rank == 0)
+      cerr << getLogHeader() << " logging: move " << num_moved << " instances in " 
+	   << (getRealTime() - startTime) << " seconds." << endl;
   }
 
 
@@ -33,7 +158,7 @@ namespace d2 {
   template<typename... Ts>
   void DistributedBlockMultiPhase<Ts...>::read(const std::string &filename, const size_t size) {
     this->read_meta(filename);
-    this->read_main(filename, (size - 1) / rabit::GetWorldSize() + 1);
+    this->read_main(filename, size);
   }
   
 
@@ -0,0 +1,199 @@
+#ifndef _D2_IO_TEXT_H_
+#define _D2_IO_TEXT_H_
+
+/*!
+ * \file d2_io_text.hpp
+ * \brief Fast parsing of the text format (.d2, .d2s, ...) from memory.
+ *
+ * These are the counterparts of operator>> of each def:: type that work on
+ * a character range instead of an istream. A record (one phase of one
+ * element) is
+ *     dim len w_1 ... w_len supports
+ * where the number of support tokens is given by _TextElem::supp_tokens().
+ * Reading a block takes two passes (see internal::_read_main): the first
+ * one only skips tokens to find the records and their lengths, and the
+ * second one parses the records in parallel into exactly sized buffers.
+ */
+
+#include "d2_data.hpp"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+namespace d2 {
+  namespace internal {
+
+    inline bool _is_space(const char c) {
+      return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    inline void _skip_space(const char *&p, const char *end) {
+      while (p < end && _is_space(*p)) ++p;
+    }
+
+    /*! \brief skip n tokens; return false if the range ends first */
+    inline bool _skip_tokens(const char *&p, const char *end, size_t n) {
+      for (size_t i=0; i<n; ++i) {
+	_skip_space(p, end);
+	if (p == end) return false;
+	while (p < end && !_is_space(*p)) ++p;
+      }
+      return true;
+    }
+
+    /* the range in which m * 10^e (or m / 10^-e) is correctly rounded */
+    template <typename T> struct _FastReal;
+    template <> struct _FastReal<double> {
+      static const uint64_t max_mantissa = 1ULL << 53;
+      static const int max_exp10 = 22;
+      static double pow10(int e) {
+	static const double p[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+				   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	return p[e];
+      }
+      static double strto(const char *s) {return strtod(s, NULL);}
+    };
+    template <> struct _FastReal<float> {
+      static const uint64_t max_mantissa = 1ULL << 24;
+      static const int max_exp10 = 10;
+      static float pow10(int e) {
+	static const float p[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+	return p[e];
+      }
+      static float strto(const char *s) {return strtof(s, NULL);}
+    };
+
+    /*!
+     * \brief parse the next token as a real number. Plain decimals with few
+     * enough digits are converted exactly with a single multiplication or
+     * division, which gives the same result as strtod(); anything else
+     * falls back to strtod()/strtof().
+     */
+    template <typename T>
+    inline T _parse_real(const char *&p, const char *end) {
+      _skip_space(p, end);
+      const char *s = p;
+      bool neg = false;
+      if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+      uint64_t m = 0;
+      int digits = 0, exp10 = 0;
+      bool any = false, fast = true;
+      for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+	if (digits < 19) {m = m * 10 + (*p - '0'); if (m) ++digits;}
+	else {fast = false; ++exp10;}
+      }
+      if (p < end && *p == '.') {
+	for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true) {
+	  if (digits < 19) {m = m * 10 + (*p - '0'); if (m) ++digits; --exp10;}
+	  else fast = false;
+	}
+      }
+      if (any && p < end && (*p == 'e' || *p == 'E')) {
+	const char *q = p + 1;
+	bool eneg = false;
+	if (q < end && (*q == '-' || *q == '+')) eneg = (*q++ == '-');
+	if (q < end && *q >= '0' && *q <= '9') {
+	  int e = 0;
+	  for (; q < end && *q >= '0' && *q <= '9'; ++q) if (e < 100000) e = e * 10 + (*q - '0');
+	  exp10 += eneg ? -e : e;
+	  p = q;
+	}
+      }
+      if (any && fast && (p == end || _is_space(*p)) && m <= _FastReal<T>::max_mantissa &&
+	  exp10 >= -_FastReal<T>::max_exp10 && exp10 <= _FastReal<T>::max_exp10) {
+	T v = (T) m;
+	v = exp10 < 0 ? v / _FastReal<T>::pow10(-exp10) : v * _FastReal<T>::pow10(exp10);
+	return neg ? -v : v;
+      }
+      // slow path on a null-terminated copy of the token
+      while (p < end && !_is_space(*p)) ++p;
+      char buf[64];
+      const size_t n = std::min((size_t) (p - s), sizeof(buf) - 1);
+      memcpy(buf, s, n);
+      buf[n] = '\0';
+      return _FastReal<T>::strto(buf);
+    }
+
+    /*! \brief parse the next token as an unsigned integer */
+    template <typename T>
+    inline T _parse_uint(const char *&p, const char *end) {
+      _skip_space(p, end);
+      T v = 0;
+      if (p < end && *p == '+') ++p;
+      for (; p < end && *p >= '0' && *p <= '9'; ++p) v = v * 10 + (*p - '0');
+      while (p < end && !_is_space(*p)) ++p;
+      return v;
+    }
+
+    /*! \brief parse weights and normalize them, as operator>> does */
+    inline void _parse_weights(const char *&p, const char *end, const size_t len, real_t *w) {
+      real_t sum = 0.;
+      for (size_t i=0; i<len; ++i) {w[i] = _parse_real<real_t>(p, end); sum += w[i];}
+      for (size_t i=0; i<len; ++i) w[i] /= sum;
+    }
+
+    /*! \brief the parser of supports, by types that support operator>> */
+    template <typename D2Type, size_t dim>
+    struct _TextElem {
+      static const bool supported = false;
+    };
+
+    template <size_t dim>
+    struct _TextElem<def::Euclidean, dim> {
+      static const bool supported = true;
+      static size_t supp_tokens(const size_t len) {return len * dim;}
+      static void parse_supp(const char *&p, const char *end, const size_t len, real_t *supp) {
+	for (size_t i=0; i<len * dim; ++i) supp[i] = _parse_real<real_t>(p, end);
+      }
+    };
+
+    template <size_t dim>
+    struct _TextElem<def::WordVec, dim> {
+      static const bool supported = true;
+      static size_t supp_tokens(const size_t len) {return len;}
+      static void parse_supp(const char *&p, const char *end, const size_t len, index_t *supp) {
+	for (size_t i=0; i<len; ++i) {
+	  supp[i] = _parse_uint<index_t>(p, end);
+	  if (supp[i] > 0) supp[i]--;
+	}
+      }
+    };
+
+    template <size_t dim>
+    struct _TextElem<def::NGram, dim> {
+      static const bool supported = true;
+      static size_t supp_tokens(const size_t len) {return len;}
+      /* each support is a word of at most dim characters, zero padded */
+      static void parse_supp(const char *&p, const char *end, const size_t len, char *supp) {
+	for (size_t i=0; i<len; ++i) {
+	  _skip_space(p, end);
+	  const char *s = p;
+	  while (p < end && !_is_space(*p)) ++p;
+	  const size_t n = std::min((size_t) (p - s), dim);
+	  memcpy(supp + i*dim, s, n);
+	  memset(supp + i*dim + n, 0, dim - n);
+	}
+      }
+    };
+
+    template <size_t dim>
+    struct _TextElem<def::Histogram, dim> {
+      static const bool supported = true;
+      static size_t supp_tokens(const size_t len) {return 0;}
+      static void parse_supp(const char *&p, const char *end, const size_t len, char *supp) {}
+    };
+
+    template <size_t dim>
+    struct _TextElem<def::SparseHistogram, dim> {
+      static const bool supported = true;
+      static size_t supp_tokens(const size_t len) {return len;}
+      static void parse_supp(const char *&p, const char *end, const size_t len, index_t *supp) {
+	for (size_t i=0; i<len; ++i) supp[i] = _parse_uint<index_t>(p, end) - 1;
+      }
+    };
+
+  }
+}
+
+#endif /* _D2_IO_TEXT_H_ */
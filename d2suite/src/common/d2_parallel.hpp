@@ -0,0 +1,174 @@
+#ifndef _D2_PARALLEL_H_
+#define _D2_PARALLEL_H_
+
+/*!
+ * \file d2_parallel.hpp
+ * \brief A small work-stealing thread pool for loops over blocks.
+ *
+ * The iteration range of a parallel_for() is split evenly into one
+ * contiguous range per worker. Each worker takes indices from the front of
+ * its own range; a worker whose range is exhausted steals the back half of
+ * the largest remaining range. This balances loops whose iterations differ
+ * in cost, e.g., EMDs against elements of different lengths.
+ *
+ * The calling thread always participates as worker 0, and nested calls from
+ * inside a worker run serially on that worker.
+ */
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <cassert>
+
+namespace d2 {
+  namespace internal {
+
+    class _WorkStealingPool {
+    public:
+      explicit _WorkStealingPool(const size_t num_workers) :
+	ranges(num_workers > 0 ? num_workers : 1), generation(0), num_active(0), stop(false) {
+	for (size_t w=1; w<ranges.size(); ++w)
+	  threads.push_back(std::thread(&_WorkStealingPool::_worker_loop, this, w));
+      }
+
+      ~_WorkStealingPool() {
+	{
+	  std::lock_guard<std::mutex> lock(pool_mtx);
+	  stop = true;
+	}
+	pool_cv.notify_all();
+	for (size_t i=0; i<threads.size(); ++i) threads[i].join();
+      }
+
+      /*! \brief the number of workers, including the calling thread */
+      size_t size() const {return ranges.size();}
+
+      /*! \brief call f(i, worker) for i = 0, ..., n-1, where worker is in [0, size())
+       * identifies the worker (and thus the per-worker scratch) running iteration i. */
+      template <typename FuncType>
+      void parallel_for(const size_t n, const FuncType &f) {
+	if (n == 0) return;
+	if (ranges.size() == 1 || n == 1 || _in_worker()) {
+	  for (size_t i=0; i<n; ++i) f(i, (size_t) 0);
+	  return;
+	}
+
+	std::lock_guard<std::mutex> call_lock(call_mtx); // one loop at a time
+	const size_t num_workers = ranges.size();
+	for (size_t w=0; w<num_workers; ++w) {
+	  ranges[w].begin = n * w / num_workers;
+	  ranges[w].end = n * (w+1) / num_workers;
+	}
+	job = [&f](size_t i, size_t w) {f(i, w);};
+	{
+	  std::lock_guard<std::mutex> lock(pool_mtx);
+	  num_active = num_workers - 1;
+	  ++generation;
+	}
+	pool_cv.notify_all();
+
+	_run(0);
+
+	std::unique_lock<std::mutex> lock(pool_mtx);
+	done_cv.wait(lock, [this]() {return num_active == 0;});
+	job = nullptr;
+      }
+
+    private:
+      struct _Range {
+	std::mutex mtx;
+	size_t begin, end;
+      };
+
+      static bool& _in_worker() {
+	static thread_local bool in_worker = false;
+	return in_worker;
+      }
+
+      /* take the next index from the own range, or steal the back half of
+       * the largest range of the other workers */
+      bool _next(const size_t w, size_t &i) {
+	{
+	  std::lock_guard<std::mutex> lock(ranges[w].mtx);
+	  if (ranges[w].begin < ranges[w].end) {i = ranges[w].begin++; return true;}
+	}
+	for (;;) {
+	  size_t victim = w, largest = 0;
+	  for (size_t v=0; v<ranges.size(); ++v) {
+	    if (v == w) continue;
+	    std::lock_guard<std::mutex> lock(ranges[v].mtx);
+	    const size_t left = ranges[v].end - ranges[v].begin;
+	    if (left > largest) {largest = left; victim = v;}
+	  }
+	  if (victim == w) return false;
+
+	  size_t begin, end;
+	  {
+	    std::lock_guard<std::mutex> lock(ranges[victim].mtx);
+	    const size_t left = ranges[victim].end - ranges[victim].begin;
+	    if (left == 0) continue; // finished meanwhile, look again
+	    end = ranges[victim].end;
+	    begin = end - (left + 1) / 2;
+	    ranges[victim].end = begin;
+	  }
+	  std::lock_guard<std::mutex> lock(ranges[w].mtx);
+	  ranges[w].begin = begin + 1;
+	  ranges[w].end = end;
+	  i = begin;
+	  return true;
+	}
+      }
+
+      void _run(const size_t w) {
+	_in_worker() = true;
+	size_t i;
+	while (_next(w, i)) job(i, w);
+	_in_worker() = false;
+      }
+
+      void _worker_loop(const size_t w) {
+	size_t seen = 0;
+	for (;;) {
+	  {
+	    std::unique_lock<std::mutex> lock(pool_mtx);
+	    pool_cv.wait(lock, [&]() {return stop || generation != seen;});
+	    if (stop) return;
+	    seen = generation;
+	  }
+	  _run(w);
+	  bool last;
+	  {
+	    std::lock_guard<std::mutex> lock(pool_mtx);
+	    last = (--num_active == 0);
+	  }
+	  if (last) done_cv.notify_one();
+	}
+      }
+
+      std::vector<_Range> ranges;
+      std::vector<std::thread> threads;
+      std::function<void(size_t, size_t)> job;
+      std::mutex call_mtx, pool_mtx;
+      std::condition_variable pool_cv, done_cv;
+      size_t generation, num_active;
+      bool stop;
+    };
+
+    /*! \brief the pool shared by all parallel routines of d2 */
+    inline std::unique_ptr<_WorkStealingPool>& _global_pool() {
+      static std::unique_ptr<_WorkStealingPool> pool(new _WorkStealingPool(1));
+      return pool;
+    }
+
+    /*! \brief run f(i, worker) for i = 0, ..., n-1 on the global pool */
+    template <typename FuncType>
+    inline void parallel_for(const size_t n, const FuncType &f) {
+      _global_pool()->parallel_for(n, f);
+    }
+  }
+}
+
+#endif /* _D2_PARALLEL_H_ */
@@ -7,6 +7,7 @@
 #include "cblas.h"
 #include "blas_like.h"
 #include <random>
+#include <vector>
 namespace d2 {
   
   /*!
@@ -23,13 +24,23 @@ namespace d2 {
       real_t *_dual2;
       real_t *_U;
       real_t *_L;
+      unsigned long long _seed;
+      /* the number of sweeps drawn so far, shared by copies of the cache so
+       * that every call draws from fresh streams */
+      unsigned long long *_sweep;
     };
 
+    /*! \brief the key of the random stream of a sweep (see _d2_counter_hash) */
+    inline unsigned long long _sa_key(const unsigned long long seed, const unsigned long long sweep) {
+      return _d2_mix64(seed + _d2_mix64(sweep + 1));
+    }
+
     template <typename ElemType1, typename ElemType2>
     void allocate_sa_cache(const Block<ElemType1> &a,
 			   const Block<ElemType2> &b,
 			   SACache &sac,
-			   const bool hasPrimal = false) {
+			   const bool hasPrimal = false,
+			   const unsigned long long seed = 0) {
       assert(a.get_size() == b.get_size());
       size_t mat_size = 0;
       for (size_t i=0; i<a.get_size(); ++i) mat_size += a[i].len * b[i].len;
@@ -46,6 +57,10 @@ namespace d2 {
       for (size_t i=0; i<b.get_col(); ++i) sac._dual2[i] = 0;    
       sac._U = (real_t*) malloc(sizeof(real_t) * a.get_col());
       sac._L = (real_t*) malloc(sizeof(real_t) * b.get_col());
+      // a seed of 0 draws a non-reproducible one
+      sac._seed = seed ? seed : ((unsigned long long) std::random_device()() << 32 | std::random_device()());
+      sac._sweep = (unsigned long long*) malloc(sizeof(unsigned long long));
+      *sac._sweep = 0;
     }
 
     void deallocate_sa_cache(SACache &sac) {
@@ -56,6 +71,7 @@ namespace d2 {
       free(sac._dual2);
       free(sac._U);
       free(sac._L);
+      free(sac._sweep);
     }  
 
 
@@ -101,6 +117,13 @@ namespace d2 {
 
   /*!
    * \brief the basic GibbsOT algorithmic unit for a batch of elements
+   *
+   * The pairs of a batch are independent, so they are distributed over the
+   * threads of the pool. The duals of a sweep are drawn in batches from
+   * counter-based streams keyed by the seed of the cache and the sweep, at
+   * the counter of their column, so the result is the same for any number
+   * of threads. Row minima and column maxima are taken by fused kernels,
+   * without a copy of the cost matrix.
    * \param a the first block of distributions
    * \param b the second block of distributions
    * \param T the temperature
@@ -116,53 +139,52 @@ namespace d2 {
     assert(sac._m && sac._mtmp);
     assert(sac._dual1 && sac._dual2);
     assert(sac._U && sac._L);
+    assert(sac._sweep);
     assert(T>0);
     assert(a.get_size() == b.get_size());
 
-    std::random_device rd;
-    std::exponential_distribution<real_t> rng (1./T);
-    std::mt19937 rnd_gen (rd());
-    //    auto gen = std::bind(rng, rnd_gen);
+    // offsets of the columns and of the cost matrix of each pair
+    const size_t size = b.get_size();
+    std::vector<size_t> col1(size), col2(size), mat(size);
+    for (size_t i=0, offset=0; i<size; ++i) {
+      col1[i] = a[i].w - a.get_weight_ptr();
+      col2[i] = b[i].w - b.get_weight_ptr();
+      mat[i] = offset;
+      offset += a[i].len * b[i].len;
+    }
 
     real_t upper_bound_old, upper_bound=0;
     int iterations=0;
     
     do {
-    for (int iter=0; iter < niter; ++iter) {
-      real_t *dual1 = sac._dual1;
-      real_t *dual2 = sac._dual2;
-      real_t *U = sac._U;
-      real_t *L = sac._L;
-      real_t *M = sac._m;
-      real_t *Mtmp = sac._mtmp;
-      real_t *w1 = a.get_weight_ptr();
-      real_t *w2 = b.get_weight_ptr();
-      for (size_t i=0; i < b.get_size(); ++i) {
-	// calculate U and sample dual1
+    const unsigned long long sweep = *sac._sweep;
+    *sac._sweep += niter;
+    internal::parallel_for(size, [&](size_t i, size_t w) {
 	const size_t m1=a[i].len;
 	const size_t m2=b[i].len;
-	const size_t mat_size=m1*m2;
-
-	memcpy(Mtmp, M, sizeof(real_t)*mat_size);
-	_D2_FUNC(grmv)(m1, m2, Mtmp, dual2);
-	_D2_FUNC(rmin)(m1, m2, Mtmp, U);
-	for (size_t j=0; j < m1; ++j, ++dual1, ++U, ++w1) {
-	  *dual1 = *U - rng(rnd_gen) / (*w1 + eps);
+	real_t *dual1 = sac._dual1 + col1[i];
+	real_t *dual2 = sac._dual2 + col2[i];
+	real_t *U = sac._U + col1[i];
+	real_t *L = sac._L + col2[i];
+	const real_t *M = sac._m + mat[i];
+	const real_t *w1 = a[i].w;
+	const real_t *w2 = b[i].w;
+	internal::_Scratch scratch;
+	real_t *E = scratch.alloc<real_t>(std::max(m1, m2));
+	for (size_t iter=0; iter < niter; ++iter) {
+	  // calculate U and sample dual1
+	  _D2_FUNC(grmv_rmin)(m1, m2, M, dual2, U);
+	  _D2_FUNC(exprnd)(m1, internal::_sa_key(sac._seed, 2*(sweep+iter)), col1[i], E);
+	  for (size_t j=0; j < m1; ++j) dual1[j] = U[j] - T * E[j] / (w1[j] + eps);
+	  // calculate L and sample dual2
+	  _D2_FUNC(gcmv2_cmax)(m1, m2, M, dual1, L);
+	  _D2_FUNC(exprnd)(m2, internal::_sa_key(sac._seed, 2*(sweep+iter)+1), col2[i], E);
+	  for (size_t j=0; j < m2; ++j) dual2[j] = L[j] + T * E[j] / (w2[j] + eps);
 	}
-	// calculate L and sample dual2
-	memcpy(Mtmp, M, sizeof(real_t)*mat_size);
-	_D2_FUNC(gcmv2)(m1, m2, Mtmp, dual1 - m1);
-	_D2_FUNC(cmax)(m1, m2, Mtmp, L);
-	for (size_t j=0; j < m2; ++j, ++dual2, ++L, ++w2) {
-	  *dual2 = *L + rng(rnd_gen) / (*w2 + eps);
-	}
-	M = M + mat_size;
-	Mtmp = Mtmp + mat_size;
-      }
-    }
+      });
     upper_bound_old = upper_bound;
-    upper_bound = _D2_CBLAS_FUNC(dot)(a.get_col(), a.get_weight_ptr(), 1, sac._U, 1)
-      - _D2_CBLAS_FUNC(dot)(b.get_col(), b.get_weight_ptr(), 1, sac._L, 1);
+    upper_bound = _D2_CBLAS_DOT(a.get_col(), a.get_weight_ptr(), 1, sac._U, 1)
+      - _D2_CBLAS_DOT(b.get_col(), b.get_weight_ptr(), 1, sac._L, 1);
     iterations += niter;
     } while (upper_bound - upper_bound_old > 0.001 * upper_bound);    
     
@@ -170,25 +192,27 @@ namespace d2 {
     real_t div = 0.;
     real_t phi=0.;
     if (sac._primal && hasProposal) {
-      real_t *primal=sac._primal;
-      real_t *w1 = a.get_weight_ptr();
-      real_t *w2 = b.get_weight_ptr();
-      real_t *M = sac._m;
-      real_t *Mtmp = sac._mtmp;
-      real_t *U = sac._U;
-      real_t *L = sac._L;
-      for (size_t i=0; i<b.get_size(); ++i) {
+      // per pair sums, added up in order afterwards
+      std::vector<real_t> costs(size, 0), phis(size, 0);
+      internal::parallel_for(size, [&](size_t i, size_t w) {
 	const size_t m1=a[i].len;
 	const size_t m2=b[i].len;
 	const size_t mat_size=m1*m2;
+	real_t *primal = sac._primal + mat[i];
+	const real_t *M = sac._m + mat[i];
+	real_t *Mtmp = sac._mtmp + mat[i];
+	const real_t *U = sac._U + col1[i];
+	const real_t *L = sac._L + col2[i];
+	const real_t *w1 = a[i].w;
+	const real_t *w2 = b[i].w;
 	for (size_t j=0; j<m2; ++j)
 	  for (size_t k=0; k<m1; ++k)
 	    primal[k+j*m1]= w2[j];
 	memcpy(Mtmp, M, sizeof(real_t)*mat_size);
 	_D2_FUNC(grmv)(m1, m2, Mtmp, L);
 	for (size_t j=0; j<m1; ++j) {
-	  phi+=internal::sort_and_estimate(Mtmp+j, m1, m2, primal+j, T, true) * w1[j];
-	  cost-=(Mtmp[j]-U[j])*w1[j];
+	  phis[i]+=internal::sort_and_estimate(Mtmp+j, m1, m2, primal+j, T, true) * w1[j];
+	  costs[i]-=(Mtmp[j]-U[j])*w1[j];
 	  //	  div+=(_D2_CBLAS_FUNC(dot)(m2, Mtmp+j, m1, primal+j, m1)-Mtmp[j])*w1[j];
 	}
 	for (size_t j=0; j<m2; ++j)
@@ -196,19 +220,12 @@ namespace d2 {
 	memcpy(Mtmp, M, sizeof(real_t)*mat_size);
 	_D2_FUNC(gcmv2)(m1, m2, Mtmp, U);
 	for (size_t j=0; j<m2; ++j) {
-	  phi+=internal::sort_and_estimate(Mtmp+j*m1, 1, m1, primal+j*m1, T, false)*w2[j];
-	  cost-=(Mtmp[j*m1]+L[j])*w2[j];
+	  phis[i]+=internal::sort_and_estimate(Mtmp+j*m1, 1, m1, primal+j*m1, T, false)*w2[j];
+	  costs[i]-=(Mtmp[j*m1]+L[j])*w2[j];
 	  //	  div+=(_D2_CBLAS_FUNC(dot)(m1, Mtmp+j*m1, 1, primal+j*m1, 1)-Mtmp[j*m1])*w2[j];
 	}
-
-	primal = primal + mat_size;
-	M = M + mat_size;
-	Mtmp = Mtmp + mat_size;
-	U = U + m1;
-	L = L + m2;
-	w1 = w1 + m1;
-	w2 = w2 + m2;	
-      }
+	});
+      for (size_t i=0; i<size; ++i) {cost += costs[i]; phi += phis[i];}
       //std::cout << " " << cost << " " << phi << " " << cost/phi << std::endl;      
     }
     A=cost; B=phi; D=div;
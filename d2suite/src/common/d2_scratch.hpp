@@ -0,0 +1,123 @@
+#ifndef _D2_SCRATCH_H_
+#define _D2_SCRATCH_H_
+
+/*!
+ * \file d2_scratch.hpp
+ * \brief A thread-local arena for the temporary buffers of a call.
+ *
+ * Buffers are bump-allocated from the arena of the calling thread and are
+ * released all at once when the _Scratch scope that took them ends, so
+ * scopes have to be nested, which they are within one thread. The arena
+ * grows by new chunks while it is in use; once it is empty again the chunks
+ * are merged into one, so that in the steady state no call allocates. The
+ * merged chunk is capped at _max_kept bytes, so that a thread does not hold
+ * on to the peak of one large call for the rest of its life.
+ */
+
+#include <cstddef>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <new>
+
+namespace d2 {
+  namespace internal {
+
+    class _ScratchArena {
+    public:
+      /*! \brief the position of the top of the arena */
+      struct Mark {size_t chunk, offset;};
+
+      ~_ScratchArena() {
+	for (size_t k=0; k<chunks.size(); ++k) free(chunks[k].data);
+      }
+
+      /*! \brief the arena of the calling thread */
+      static _ScratchArena& local() {
+	static thread_local _ScratchArena arena;
+	return arena;
+      }
+
+      Mark mark() const {Mark m = {top, offset}; return m;}
+
+      /*! \brief release everything allocated after m was taken */
+      void reset(const Mark &m) {
+	top = m.chunk; offset = m.offset;
+	if (top == 0 && offset == 0) {
+	  const size_t total = capacity(), kept = std::min(total, (size_t) _max_kept);
+	  if (chunks.size() > 1 || total > kept) {
+	    for (size_t k=0; k<chunks.size(); ++k) free(chunks[k].data);
+	    chunks.clear();
+	    _add_chunk(kept);
+	  }
+	}
+      }
+
+      /*! \brief bytes aligned to _alignment, valid until the enclosing reset */
+      void* alloc(size_t bytes) {
+	bytes = (bytes + _alignment - 1) / _alignment * _alignment;
+	while (top < chunks.size() && offset + bytes > chunks[top].size) {
+	  ++top; offset = 0;
+	}
+	if (top == chunks.size()) {
+	  _add_chunk(std::max(bytes, chunks.empty() ? _min_chunk : 2 * chunks.back().size));
+	  offset = 0;
+	}
+	void *p = chunks[top].data + offset;
+	offset += bytes;
+	return p;
+      }
+
+      /*! \brief the number of bytes reserved by the arena */
+      size_t capacity() const {
+	size_t total = 0;
+	for (size_t k=0; k<chunks.size(); ++k) total += chunks[k].size;
+	return total;
+      }
+
+    private:
+      static const size_t _alignment = 64;
+      static const size_t _min_chunk = 1 << 16;
+      static const size_t _max_kept = 1 << 26;
+
+      struct _Chunk {char *data; size_t size;};
+
+      void _add_chunk(const size_t size) {
+	void *p = NULL;
+	if (posix_memalign(&p, _alignment, size) != 0) throw std::bad_alloc();
+	_Chunk c = {(char*) p, size};
+	chunks.push_back(c);
+      }
+
+      std::vector<_Chunk> chunks;
+      size_t top = 0, offset = 0;
+    };
+
+    /*!
+     * \brief a scope of scratch buffers from the arena of the calling thread
+     *
+     * Example:
+     * \code{.cpp}
+     * internal::_Scratch scratch;
+     * real_t *X = scratch.alloc<real_t>(n * dim); // released with scratch
+     * \endcode
+     */
+    class _Scratch {
+    public:
+      _Scratch(): arena(_ScratchArena::local()), start(arena.mark()) {}
+      ~_Scratch() {arena.reset(start);}
+      _Scratch(const _Scratch&) = delete;
+      _Scratch& operator=(const _Scratch&) = delete;
+
+      template <typename T>
+      T* alloc(const size_t n) {return (T*) arena.alloc(sizeof(T) * n);}
+
+    private:
+      _ScratchArena &arena;
+      const _ScratchArena::Mark start;
+    };
+
+  }
+}
+
+#endif /* _D2_SCRATCH_H_ */
@@ -4,6 +4,8 @@
 #include "solver.h"
 #include "blas_like.h"
 #include "cblas.h"
+#include "d2_parallel.hpp"
+#include "d2_scratch.hpp"
 #include <algorithm>
 #include <queue>
 #include <cmath>
@@ -17,22 +19,51 @@ namespace d2 {
 #endif    
       d2_solver_setup();
     }
+    /*! \brief set the number of threads used by the parallel routines 
+     * (EMD and LowerThanEMD over blocks), including the calling thread.
+     * Each worker thread solves its LPs with its own solver context. */
+    inline void SetNumThreads(size_t num_threads) {
+      if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+      if (num_threads == 0) num_threads = 1;
+      std::unique_ptr<internal::_WorkStealingPool> &pool = internal::_global_pool();
+      if (pool->size() == num_threads) return;
+      pool.reset(); // join the old workers first
+      pool.reset(new internal::_WorkStealingPool(num_threads));
+    }
+    inline size_t GetNumThreads() {
+      return internal::_global_pool()->size();
+    }
     inline void Finalize() {
 #ifdef RABIT_RABIT_H_
       rabit::Finalize();
 #endif
+      SetNumThreads(1); // worker contexts are released when workers exit
       d2_solver_release();
     }
   }
 
 
   namespace internal {
+    /*! \brief the squared norms of the n supports in s, in a buffer from
+     * scratch, so that the gemm-based pdist2 kernel does not allocate */
+    inline const real_t* _sqnorm(const size_t dim, const size_t n, const real_t *s, _Scratch &scratch) {
+      real_t *norm = scratch.alloc<real_t>(n);
+      _D2_FUNC(csqnorm)(dim, n, s, norm);
+      return norm;
+    }
+
     template <size_t dim>
     inline void _pdist2 ( const def::Euclidean::type *s1, const size_t n1,
 			  const def::Euclidean::type *s2, const size_t n2,
 			  const Meta<Elem<def::Euclidean, dim> > &meta,
 			  real_t* mat) {
-      _D2_FUNC(pdist2)(dim, n1, n2, s1, s2, mat);
+      if (!_D2_PDIST2_USE_GEMM(dim, n1, n2)) {
+	_D2_FUNC(pdist2_direct)(dim, n1, n2, s1, s2, mat);
+	return;
+      }
+      _Scratch scratch;
+      _D2_FUNC(pdist2_norm)(dim, n1, n2, s1, s2, _sqnorm(dim, n1, s1, scratch),
+			    _sqnorm(dim, n2, s2, scratch), mat);
     }
 
     template <size_t dim>
@@ -123,7 +154,8 @@ namespace d2 {
 	  mat[k] = s2[j].eval_min(&meta.embedding[s1[i]*dim]);
       }
       */
-      real_t *X = new real_t [n1 * dim];
+      _Scratch scratch;
+      real_t *X = scratch.alloc<real_t>(n1 * dim);
       for (size_t i=0; i<n1; ++i) {
 	real_t *p=X + i*dim;
 	real_t *q=meta.embedding + s1[i]*dim;
@@ -132,8 +164,6 @@ namespace d2 {
 
       Meta<Elem<def::Euclidean, dim> > _meta;
       _pdist2(s2, n2, X, n1, _meta, mat);
-      delete [] X;
-      
     }
 
     template <typename FuncType, size_t dim>
@@ -148,7 +178,8 @@ namespace d2 {
 	  mat[k] = s2[j].eval(&meta.embedding[s1[i]*dim], label[i]);
       }
       */
-      real_t *X = new real_t [n1 * dim];
+      _Scratch scratch;
+      real_t *X = scratch.alloc<real_t>(n1 * dim);
       for (size_t i=0; i<n1; ++i) {
 	real_t *p=X + i*dim;
 	real_t *q=meta.embedding + s1[i]*dim;
@@ -157,7 +188,6 @@ namespace d2 {
 
       Meta<Elem<def::Euclidean, dim> > _meta;
       _pdist2_label(s2, n2, X, label, n1, _meta, mat);
-      delete [] X;
     }
 
     template <typename FuncType, size_t dim>
@@ -173,7 +203,8 @@ namespace d2 {
       }
       */
       
-      real_t *X = new real_t [n1 * dim];
+      _Scratch scratch;
+      real_t *X = scratch.alloc<real_t>(n1 * dim);
       for (size_t i=0; i<n1; ++i) {
 	real_t *p=X + i*dim;
 	real_t *q=meta.embedding + s1[i]*dim;
@@ -182,7 +213,6 @@ namespace d2 {
 
       Meta<Elem<def::Euclidean, dim> > _meta;
       _pdist2_label(s2, n2, X, label, n1, _meta, mat);
-      delete [] X;
     }
 
     template <typename FuncType, size_t dim>
@@ -196,7 +226,8 @@ namespace d2 {
 	  s2[j].eval_alllabel(&meta.embedding[s1[i]*dim], &mat[k], n1*n2);
       }
       */
-      real_t *X = new real_t [n1 * dim];
+      _Scratch scratch;
+      real_t *X = scratch.alloc<real_t>(n1 * dim);
       for (size_t i=0; i<n1; ++i) {
 	real_t *p=X + i*dim;
 	real_t *q=meta.embedding + s1[i]*dim;
@@ -205,16 +236,87 @@ namespace d2 {
 
       Meta<Elem<def::Euclidean, dim> > _meta;
       _pdist2_alllabel(s2, n2, X, n1, _meta, mat);
-      delete [] X;      
     }
     
     
+    /*! \brief compute the cost matrices between e and the elements [start, 
+     * start+count) of b side by side in mat, using the cached norms of b,
+     * or the supports of e stored dimension-major in et (see _dim_major) if
+     * they are given. It returns false if b has no cached norms, and mat is
+     * untouched. */
+    template <typename ElemType1, typename ElemType2>
+    inline bool _pdist2_cached(const ElemType1 &e, const Block<ElemType2> &b,
+			       const size_t start, const size_t count,
+			       real_t* mat,
+			       const real_t *et = NULL, const size_t ld = 0) {
+      return false;
+    }
+
+    template <size_t dim>
+    inline bool _pdist2_cached(const Elem<def::Euclidean, dim> &e, 
+			       const Block<Elem<def::Euclidean, dim> > &b,
+			       const size_t start, const size_t count,
+			       real_t* mat,
+			       const real_t *et = NULL, const size_t ld = 0) {
+      const real_t *norm = b.get_norm_ptr();
+      if (!norm || count == 0) return false;
+      size_t col = 0;
+      for (size_t i=start; i<start+count; ++i) col += b[i].len;
+      if (et && _D2_PDIST2_USE_DMAJOR(dim, e.len, col))
+	_D2_FUNC(pdist2_dmajor)(dim, e.len, col, et, ld, b[start].supp, mat);
+      else if (!_D2_PDIST2_USE_GEMM(dim, e.len, col))
+	_D2_FUNC(pdist2_direct)(dim, e.len, col, e.supp, b[start].supp, mat);
+      else {
+	_Scratch scratch;
+	_D2_FUNC(pdist2_norm)(dim, e.len, col, e.supp, b[start].supp, _sqnorm(dim, e.len, e.supp, scratch),
+			      norm + (b[start].w - b.get_weight_ptr()), mat);
+      }
+      return true;
+    }
+
+    /*! \brief the supports of e stored dimension-major and padded to ld in
+     * an aligned buffer from scratch, for _pdist2_cached; NULL for supports
+     * other than def::Euclidean */
+    template <typename ElemType>
+    inline const real_t* _dim_major(const ElemType &e, _Scratch &scratch, size_t &ld) {
+      ld = 0;
+      return NULL;
+    }
+
+    template <size_t dim>
+    inline const real_t* _dim_major(const Elem<def::Euclidean, dim> &e, _Scratch &scratch, size_t &ld) {
+      ld = _D2_ALIGN_LEN(e.len, sizeof(real_t));
+      real_t *et = scratch.alloc<real_t>(dim * ld);
+      for (size_t k=0; k<dim; ++k)
+	for (size_t j=0; j<ld; ++j)
+	  et[k*ld + j] = j < e.len ? e.supp[j*dim + k] : 0;
+      return et;
+    }
+
+    /*! \brief solve the LP with the given context, or with the context of 
+     * the calling thread if ctx is NULL, and warm start from the duals in
+     * lambda if warm_start is true */
+    inline real_t _match_by_distmat(const size_t n, const size_t m, const real_t *C,
+				    const real_t *wX, const real_t *wY,
+				    real_t *x, real_t *lambda,
+				    d2_solver_context_t *ctx,
+				    const bool warm_start = false) {
+      if (warm_start && lambda)
+	return d2_match_by_distmat_warm(ctx, n, m, C, wX, wY, x, lambda);
+      else if (ctx)
+	return d2_match_by_distmat_ctx(ctx, n, m, C, wX, wY, x, lambda);
+      else
+	return d2_match_by_distmat(n, m, C, wX, wY, x, lambda, 0);
+    }
+    
     template <typename FuncType, size_t dim>
     inline real_t _EMD(const Elem<def::Function<FuncType>, dim> &e1,
 		       const Elem<def::WordVec, dim> &e2,
 		       const Meta<Elem<def::WordVec, dim> > &meta,
 		       real_t* cache_mat, real_t* cache_primal, real_t* cache_dual,
-		       const bool cost_computed = false) {
+		       const bool cost_computed = false,
+		       d2_solver_context_t *ctx = NULL,
+		       const bool warm_start = false) {
       assert(cache_mat);// cache_mat has to be pre-allocated for speed performance
       real_t val;
       if (!cost_computed) {
@@ -223,10 +325,10 @@ namespace d2 {
 		      meta,
 		      cache_mat);
       }
-      val = d2_match_by_distmat(e1.len, e2.len, 
-				cache_mat, 
-				e1.w, e2.w,
-				cache_primal, cache_dual, 0);
+      val = _match_by_distmat(e1.len, e2.len, 
+			      cache_mat, 
+			      e1.w, e2.w,
+			      cache_primal, cache_dual, ctx, warm_start);
 
       return val;
     }
@@ -235,7 +337,9 @@ namespace d2 {
     inline real_t _EMD(const Elem<D2Type1, dim> &e1, const Elem<D2Type2, dim> &e2, 
 		       const Meta<Elem<D2Type2, dim> > &meta, 
 		       real_t* cache_mat, real_t* cache_primal, real_t* cache_dual,
-		       const bool cost_computed = false) {
+		       const bool cost_computed = false,
+		       d2_solver_context_t *ctx = NULL,
+		       const bool warm_start = false) {
       assert(cache_mat);// cache_mat has to be pre-allocated for speed performance
       real_t val;
       if (!cost_computed) {
@@ -244,10 +348,10 @@ namespace d2 {
 		meta,
 		cache_mat);
       }
-      val = d2_match_by_distmat(e1.len, e2.len, 
-				cache_mat, 
-				e1.w, e2.w,
-				cache_primal, cache_dual, 0);
+      val = _match_by_distmat(e1.len, e2.len, 
+			      cache_mat, 
+			      e1.w, e2.w,
+			      cache_primal, cache_dual, ctx, warm_start);
 
       return val;
     }    
@@ -278,6 +382,30 @@ namespace d2 {
       return val;
     }
 
+    /*! \brief the weighted centroids of all elements in a block (dim x size),
+     * from which _LowerThanEMD_v0 is computed */
+    template<size_t dim>
+    void _centroids(const Block<Elem<def::Euclidean, dim> > &b,
+		    const Meta<Elem<def::Euclidean, dim> > &meta,
+		    __OUT__ real_t *c) {
+      parallel_for(b.get_size(), [&](size_t i, size_t w) {
+	  if (b.is_aligned())
+	    _D2_CBLAS_FUNC(gemv)(CblasRowMajor, CblasNoTrans,
+				 dim, b.get_aligned_ld(i), 1., b.get_aligned_support_ptr(i), b.get_aligned_ld(i),
+				 b.get_aligned_weight_ptr(i), 1,
+				 0., c + i*dim, 1);
+	  else
+	    _D2_CBLAS_FUNC(gemv)(CblasColMajor, CblasNoTrans,
+				 dim, b[i].len, 1., b[i].supp, dim,
+				 b[i].w, 1,
+				 0., c + i*dim, 1);
+	});
+    }
+
+    /*! \brief _LowerThanEMD_v0 from the squared distance between centroids */
+    template<size_t dim>
+    inline real_t _LowerThanEMD_v0_sqdist(const Elem<def::Euclidean, dim> &e, const real_t d) {return d;}
+
     template<size_t dim>
     inline real_t _LowerThanEMD_v0(const Elem<def::WordVec, dim> &e1,
 				   const Elem<def::WordVec, dim> &e2,
@@ -301,17 +429,28 @@ namespace d2 {
       return sqrt(val); // ad-hoc modification
     }
 
-    template <typename D2Type1, typename D2Type2, size_t dim>
-    inline real_t _LowerThanEMD_v1(const Elem<D2Type1, dim> &e1, const Elem<D2Type2, dim> &e2,
-				   const Meta<Elem<D2Type2, dim> > &meta,
-				   real_t* cache_mat) {
-      real_t val;
-      assert(cache_mat);// cache_mat is column major
-      pdist2(e1.supp, e1.len,
-	     e2.supp, e2.len,
-	     meta,
-	     cache_mat);
-      real_t* head=cache_mat;
+    template<size_t dim>
+    void _centroids(const Block<Elem<def::WordVec, dim> > &b,
+		    const Meta<Elem<def::WordVec, dim> > &meta,
+		    __OUT__ real_t *c) {
+      parallel_for(b.get_size(), [&](size_t i, size_t w) {
+	  real_t *ci = c + i*dim;
+	  for (size_t d=0; d<dim; ++d) ci[d] = 0;
+	  for (index_t j=0; j<b[i].len; ++j) {
+	    const real_t *v = meta.embedding + b[i].supp[j]*dim;
+	    for (size_t d=0; d<dim; ++d) ci[d] += b[i].w[j] * v[d];
+	  }
+	});
+    }
+
+    template<size_t dim>
+    inline real_t _LowerThanEMD_v0_sqdist(const Elem<def::WordVec, dim> &e, const real_t d) {return sqrt(d);}
+
+    /*! \brief the lower bound of version 1 from a computed cost matrix */
+    template <typename ElemType1, typename ElemType2>
+    inline real_t _LowerThanEMD_v1_cost(const ElemType1 &e1, const ElemType2 &e2,
+					const real_t* cache_mat) {
+      const real_t* head=cache_mat;
       real_t min, val1=0, val2=0;
 
       for (size_t i=0; i<e2.len; ++i) {
@@ -332,6 +471,20 @@ namespace d2 {
 
       return std::max(val1, val2);
     }
+
+    template <typename D2Type1, typename D2Type2, size_t dim>
+    inline real_t _LowerThanEMD_v1(const Elem<D2Type1, dim> &e1, const Elem<D2Type2, dim> &e2,
+				   const Meta<Elem<D2Type2, dim> > &meta,
+				   real_t* cache_mat) {
+      assert(cache_mat);// cache_mat is column major
+      pdist2(e1.supp, e1.len,
+	     e2.supp, e2.len,
+	     meta,
+	     cache_mat);
+      return _LowerThanEMD_v1_cost(e1, e2, cache_mat);
+    }
+
+
 		
 
   }
@@ -351,8 +504,12 @@ namespace d2 {
 		     __IN_OUT__ real_t* cache_mat,
 		     __OUT__ real_t* cache_primal,
 		     __OUT__ real_t* cache_dual,
-		     __IN__ const bool cost_computed) {
-    return internal::_EMD(e1, e2, meta, cache_mat, cache_primal, cache_dual, cost_computed);
+		     __IN__ const bool cost_computed,
+		     d2_solver_context_t *ctx,
+		     __IN__ const bool warm_start) {
+    internal::_Scratch scratch;
+    if (!cache_mat) cache_mat = scratch.alloc<real_t>(e1.len * e2.len);
+    return internal::_EMD(e1, e2, meta, cache_mat, cache_primal, cache_dual, cost_computed, ctx, warm_start);
   }
 
 
@@ -362,72 +519,60 @@ namespace d2 {
 	    __IN_OUT__ real_t* cache_mat,
 	    __OUT__ real_t* cache_primal, 
 	    __OUT__ real_t* cache_dual,
-	    __IN__ const bool cost_computed) {
-    bool cache_mat_is_null = false;
-    if (cache_mat == NULL) {
-      assert(!cost_computed);
-      cache_mat_is_null = true;
-      cache_mat = (real_t*) malloc(sizeof(real_t) * e.len * b.get_max_len());	
-    }
-
-    real_t *primal_ptr = cache_primal;
-    real_t *dual_ptr = cache_dual;
-    real_t *cache_ptr = cache_mat;
-
-    for (size_t i=0; i<b.get_size(); ++i) {
-      if (emds) {
-	emds[i] = EMD(e, b[i], b.meta, cache_ptr, primal_ptr, dual_ptr, cost_computed);
-      }
-      else {
-	EMD(e, b[i], b.meta, cache_ptr, primal_ptr, dual_ptr, cost_computed);
-      }
-      if (cost_computed) cache_ptr += e.len * b[i].len;
-      if (cache_primal) primal_ptr += e.len * b[i].len;
-      if (cache_dual) dual_ptr += e.len + b[i].len;
-    }
-
-    if (cache_mat_is_null) {
-      free(cache_mat);
-    }
+	    __IN__ const bool cost_computed,
+	    d2_solver_context_t *ctx,
+	    __IN__ const bool warm_start) {
+    const size_t size = b.get_size();
+    const size_t num_workers = server::GetNumThreads();
+    // offsets of the precomputed cost matrices, primal and dual solutions
+    std::vector<size_t> mat_offset(size + 1), dual_offset(size + 1);
+    mat_offset[0] = dual_offset[0] = 0;
+    for (size_t i=0; i<size; ++i) {
+      mat_offset[i+1] = mat_offset[i] + e.len * b[i].len;
+      dual_offset[i+1] = dual_offset[i] + e.len + b[i].len;
+    }
+
+    // the cost matrix is taken from the arena of each worker if it is not
+    // precomputed, unless cache_mat can be used by the only worker
+    const bool use_scratch = !cost_computed && (cache_mat == NULL || num_workers > 1);
+    assert(cache_mat || use_scratch);
+    internal::_Scratch scratch_e;
+    size_t ld;
+    const real_t *et = cost_computed ? NULL : internal::_dim_major(e, scratch_e, ld);
+
+    internal::parallel_for(size, [&](size_t i, size_t w) {
+	internal::_Scratch scratch;
+	real_t *cache_ptr = cost_computed ? cache_mat + mat_offset[i] :
+	  (use_scratch ? scratch.alloc<real_t>(e.len * b[i].len) : cache_mat);
+	real_t *primal_ptr = cache_primal ? cache_primal + mat_offset[i] : NULL;
+	real_t *dual_ptr = cache_dual ? cache_dual + dual_offset[i] : NULL;
+	const bool computed = cost_computed || internal::_pdist2_cached(e, b, i, 1, cache_ptr, et, ld);
+	real_t val = EMD(e, b[i], b.meta, cache_ptr, primal_ptr, dual_ptr, computed, 
+			 w == 0 ? ctx : NULL, warm_start);
+	if (emds) emds[i] = val;
+      });
   }
 
   namespace internal {
-    template <typename T, typename... Ts>
-    inline 
-    void _EMD_impl(const _ElemMultiPhaseConstructor<T, Ts...> &e, 
-		   const _BlockMultiPhaseConstructor<T, Ts...> &b,
-		   __OUT__ real_t ** emds_arr,
-		   __IN__ real_t** cache_mat_arr) {
-      EMD(e.head, b.head, *emds_arr, *cache_mat_arr, NULL, NULL);      
-      const _ElemMultiPhaseConstructor<Ts...> &e0 = e.tail;
-      const _BlockMultiPhaseConstructor<Ts...> &b0 = b.tail;
-      _EMD_impl<Ts...>(e0, b0, emds_arr + 1, cache_mat_arr + 1);
-    }
-    template <>
-    inline 
-    void _EMD_impl(const _ElemMultiPhaseConstructor<> &e, 
-		   const _BlockMultiPhaseConstructor<> &b,
-		   __OUT__ real_t ** emds_arr,
-		   __IN__ real_t** cache_mat_arr) {
-    }
-
     template <typename T, typename... Ts>
     inline 
     real_t _EMD_impl(const _ElemMultiPhaseConstructor<T, Ts...> &e,
 		     const _BlockMultiPhaseConstructor<T, Ts...> &b,
 		     const size_t idx,
-		     __IN__ real_t * cache_mat) {
+		     __IN__ real_t * cache_mat,
+		     d2_solver_context_t *ctx) {
       const _ElemMultiPhaseConstructor<Ts...> &e0 = e.tail;
       const _BlockMultiPhaseConstructor<Ts...> &b0 = b.tail;
-      return EMD(e.head, b.head[idx], b.head.meta, cache_mat) + 
-	_EMD_impl<Ts...>(e0, b0, idx, cache_mat);
+      return EMD(e.head, b.head[idx], b.head.meta, cache_mat, NULL, NULL, false, ctx) + 
+	_EMD_impl<Ts...>(e0, b0, idx, cache_mat, ctx);
     }    
     template <>
     inline 
     real_t _EMD_impl(const _ElemMultiPhaseConstructor<> &e,
 		     const _BlockMultiPhaseConstructor<> &b,
 		     const size_t idx,
-		     __IN__ real_t * cache_mat) {
+		     __IN__ real_t * cache_mat,
+		     d2_solver_context_t *ctx) {
       return 0.f;
     }
 
@@ -475,33 +620,19 @@ namespace d2 {
   template <typename... Ts1, typename... Ts2>
   void EMD(const ElemMultiPhase<Ts1...> &e, 
 	   const BlockMultiPhase<Ts2...> &b,
-	   __OUT__ real_t* emds) {
+	   __OUT__ real_t* emds,
+	   d2_solver_context_t *ctx = NULL) {
     static const size_t k = internal::tuple_size<Ts1...>::value;
     static const size_t k2 = internal::tuple_size<Ts2...>::value;
     assert (k == k2);
-    // allocate
-    real_t ** cache_mat_arr = (real_t **) malloc(sizeof(real_t *) * k );
-    for (size_t i=0; i<k; ++i) cache_mat_arr[i] = NULL;
-
-    real_t ** emds_arr = (real_t **) malloc(sizeof(real_t *) * k);
-    for (size_t i=0; i<k; ++i) emds_arr[i] = (real_t *) malloc(sizeof(real_t) * b.get_size());
-
-    internal::_EMD_impl(e, b, emds_arr, cache_mat_arr);    
-
-    // sum to one
-    for (size_t j=0; j<b.get_size(); ++j) {
-      emds[j] = 0;
-    }
-    for (size_t i=0; i<k; ++i)
-      for (size_t j=0; j<b.get_size(); ++j) {
-	emds[j] += emds_arr[i][j];
-      }
-
-    // free
-    free(cache_mat_arr);
-
-    for (size_t i=0; i<k; ++i) free(emds_arr[i]);
-    free(emds_arr);
+    // all phases of an element are summed by the same worker
+    const size_t scratch_size = e.get_max_len() * b.get_max_len();
+
+    internal::parallel_for(b.get_size(), [&](size_t j, size_t w) {
+	internal::_Scratch scratch;
+	emds[j] = internal::_EMD_impl(e, b, j, scratch.alloc<real_t>(scratch_size), 
+				      w == 0 ? ctx : NULL);
+      });
   }
 
   template <typename ElemType1, typename ElemType2>
@@ -513,9 +644,9 @@ namespace d2 {
   template <typename ElemType1, typename ElemType2>
   void LowerThanEMD_v0(const ElemType1 &e, const Block<ElemType2> &b,
 		       __OUT__ real_t* emds) {
-    for (size_t i=0; i<b.get_size(); ++i) {
-      emds[i] = LowerThanEMD_v0(e, b[i], b.meta);
-    }
+    internal::parallel_for(b.get_size(), [&](size_t i, size_t w) {
+	emds[i] = LowerThanEMD_v0(e, b[i], b.meta);
+      });
   }
 
 
@@ -532,19 +663,22 @@ namespace d2 {
   void LowerThanEMD_v1(const ElemType1 &e, const Block<ElemType2> &b,
 		       __OUT__ real_t* emds,
 		       __IN__ real_t* cache_mat) {
-    bool cache_mat_is_null = false;
-    if (cache_mat == NULL) {
-      cache_mat_is_null = true;
-      cache_mat = (real_t*) malloc(sizeof(real_t) * e.len * b.get_col());	
-    }
-    real_t *mat_ptr = cache_mat;
-
-    for (size_t i=0; i<b.get_size(); ++i) {
-      emds[i] = LowerThanEMD_v1(e, b[i], b.meta, mat_ptr);
-      mat_ptr += e.len * b[i].len;      
-    }
-
-    if (cache_mat_is_null) free(cache_mat);
+    internal::_Scratch scratch;
+    if (cache_mat == NULL) cache_mat = scratch.alloc<real_t>(e.len * b.get_col());
+    std::vector<size_t> mat_offset(b.get_size() + 1);
+    mat_offset[0] = 0;
+    for (size_t i=0; i<b.get_size(); ++i)
+      mat_offset[i+1] = mat_offset[i] + e.len * b[i].len;
+    size_t ld;
+    const real_t *et = internal::_dim_major(e, scratch, ld);
+
+    internal::parallel_for(b.get_size(), [&](size_t i, size_t w) {
+	real_t *mat = cache_mat + mat_offset[i];
+	if (internal::_pdist2_cached(e, b, i, 1, mat, et, ld))
+	  emds[i] = internal::_LowerThanEMD_v1_cost(e, b[i], mat);
+	else
+	  emds[i] = LowerThanEMD_v1(e, b[i], b.meta, mat);
+      });
   }
 
 
@@ -573,6 +707,8 @@ namespace d2 {
 					__OUT__ index_t* rank,
 					size_t n) {
       auto compare = [&](size_t i1, size_t i2) {return emds_approx[i1] < emds_approx[i2];};
+      k = std::min(k, b.get_size());
+      n = std::min(n, b.get_size());
 
       for (size_t i=0; i<b.get_size(); ++i) {
 	emds_approx[i] = lower0(e, b, i);
@@ -598,14 +734,90 @@ namespace d2 {
 	if (emds_approx[idx] < emds_approx[knn.top()]) {
 	  count ++;
 	  emds_approx[idx] = lambda(e, b, idx);
-	  if (emds_approx[idx] < emds_approx[knn.top()])
+	  if (emds_approx[idx] < emds_approx[knn.top()]) {
 	    knn.pop(); knn.push(idx);
+	  }
 	}
       }
-      std::sort(rank, rank + i + 1, compare);
+      // rank[i..] are bounded below by the k-th distance
+      std::sort(rank, rank + i, compare);
       return count; // how many EMD computed.
     }
 
+    /*!
+     * \brief the pruning of KNearestNeighbors_Batch for a single query, where
+     * candidates are visited in the order of their v0 lower bounds lb by 
+     * popping a heap, so that only the visited ones are ordered.
+     * \param cost fills mat with the cost matrix between e and b[idx]
+     * \param mat the scratch for the cost matrix
+     * \param cand the scratch for the heap of candidates
+     * \param knn the max-heap of the k nearest neighbors found so far, which
+     * is updated with the neighbors in b, numbered from offset
+     */
+    template <typename ElemType1, typename ElemType2, typename CostFunction>
+    size_t _KNearestNeighbors_Prune(const size_t k,
+				    const ElemType1 &e, const Block<ElemType2> &b,
+				    const real_t *lb, const size_t n,
+				    CostFunction &cost,
+				    real_t *mat, std::vector<index_t> &cand,
+				    d2_solver_context_t *ctx,
+				    std::vector<std::pair<real_t, index_t> > &knn,
+				    const size_t offset = 0) {
+      // no neighbors to find, and no k-th distance to prune with
+      if (k == 0) return 0;
+      auto greater = [&](index_t i1, index_t i2) {return lb[i1] > lb[i2];};
+      cand.resize(b.get_size());
+      for (size_t i=0; i<cand.size(); ++i) cand[i] = i;
+      std::make_heap(cand.begin(), cand.end(), greater);
+
+      size_t count = 0, end = cand.size();
+      for (size_t i=0; i<n && end > 0; ++i) {
+	std::pop_heap(cand.begin(), cand.begin() + end, greater);
+	const index_t idx = cand[--end];
+	if (knn.size() == k && lb[idx] >= knn.front().first) break;
+	cost(idx, mat);
+	if (knn.size() == k && _LowerThanEMD_v1_cost(e, b[idx], mat) >= knn.front().first) continue;
+	const real_t val = EMD(e, b[idx], b.meta, mat, NULL, NULL, true, ctx);
+	count ++;
+	if (knn.size() < k) {
+	  knn.push_back(std::make_pair(val, idx + offset));
+	  std::push_heap(knn.begin(), knn.end());
+	} else if (val < knn.front().first) {
+	  std::pop_heap(knn.begin(), knn.end());
+	  knn.back() = std::make_pair(val, idx + offset);
+	  std::push_heap(knn.begin(), knn.end());
+	}
+      }
+      return count;
+    }
+
+    /*! \brief the k nearest neighbors, nearest first, out of a max-heap */
+    inline void _KNearestNeighbors_Output(const size_t k,
+					  std::vector<std::pair<real_t, index_t> > &knn,
+					  __OUT__ real_t *dists, __OUT__ index_t *ids) {
+      std::sort_heap(knn.begin(), knn.end());
+      for (size_t i=0; i<k; ++i) {
+	dists[i] = i < knn.size() ? knn[i].first : std::numeric_limits<real_t>::max();
+	ids[i] = i < knn.size() ? knn[i].second : (index_t) -1;
+      }
+    }
+
+    template <typename ElemType1, typename ElemType2, typename CostFunction>
+    size_t _KNearestNeighbors_Batch_impl(const size_t k,
+					 const ElemType1 &e, const Block<ElemType2> &b,
+					 const real_t *lb, const size_t n,
+					 CostFunction &cost,
+					 real_t *mat, std::vector<index_t> &cand,
+					 d2_solver_context_t *ctx,
+					 __OUT__ real_t *dists, __OUT__ index_t *ids) {
+      // max-heap of the current k nearest neighbors
+      std::vector<std::pair<real_t, index_t> > knn;
+      knn.reserve(k);
+      const size_t count = _KNearestNeighbors_Prune(k, e, b, lb, n, cost, mat, cand, ctx, knn);
+      _KNearestNeighbors_Output(k, knn, dists, ids);
+      return count;
+    }
+
   }
 
 
@@ -613,9 +825,10 @@ namespace d2 {
   void KNearestNeighbors_Linear(size_t k,
 				const ElemType1 &e, const Block<ElemType2> &b,
 				__OUT__ real_t* emds_approx,
-				__OUT__ index_t* rank) {
-    auto lambda =  [](const ElemType1& e, const Block<ElemType2> &b, real_t* dist) {
-      EMD(e, b, dist, NULL, NULL, NULL);
+				__OUT__ index_t* rank,
+				d2_solver_context_t *ctx) {
+    auto lambda =  [&](const ElemType1& e, const Block<ElemType2> &b, real_t* dist) {
+      EMD(e, b, dist, NULL, NULL, NULL, false, ctx);
     };
     internal::_KNearestNeighbors_Linear_impl(k, e, b, lambda, emds_approx, rank);
   }
@@ -625,11 +838,12 @@ namespace d2 {
 				const ElemMultiPhase<Ts1...> &e,
 				const BlockMultiPhase<Ts2...> &b,
 				__OUT__ real_t* emds_approx,
-				__OUT__ index_t* rank) {
-    auto lambda = [](const ElemMultiPhase<Ts1...> &e, 
+				__OUT__ index_t* rank,
+				d2_solver_context_t *ctx = NULL) {
+    auto lambda = [&](const ElemMultiPhase<Ts1...> &e, 
 		     const BlockMultiPhase<Ts2...> &b, 
 		     real_t* dist) {
-      EMD(e, b, dist);
+      EMD(e, b, dist, ctx);
     };
     internal::_KNearestNeighbors_Linear_impl(k, e, b, lambda, emds_approx, rank);
   }
@@ -639,15 +853,24 @@ namespace d2 {
 				const ElemType1 &e, const Block<ElemType2> &b,
 				__OUT__ real_t* emds_approx,
 				__OUT__ index_t* rank,
-				size_t n) {
-    real_t *cache_mat = (real_t*) malloc(sizeof(real_t) * e.len * b.get_max_len());	
-    auto lambda = [&](const ElemType1& e, const Block<ElemType2> &b, const int idx) -> real_t {return EMD(e, b[idx], b.meta, cache_mat);};
+				size_t n,
+				d2_solver_context_t *ctx) {
+    internal::_Scratch scratch;
+    real_t *cache_mat = scratch.alloc<real_t>(e.len * b.get_max_len());
+    size_t ld;
+    const real_t *et = internal::_dim_major(e, scratch, ld);
+    auto lambda = [&](const ElemType1& e, const Block<ElemType2> &b, const int idx) -> real_t {
+      const bool computed = internal::_pdist2_cached(e, b, idx, 1, cache_mat, et, ld);
+      return EMD(e, b[idx], b.meta, cache_mat, NULL, NULL, computed, ctx);
+    };
     auto lower0 = [&](const ElemType1& e, const Block<ElemType2> &b, const int idx) -> real_t {return LowerThanEMD_v0(e, b[idx], b.meta);};
-    auto lower1 = [&](const ElemType1& e, const Block<ElemType2> &b, const int idx) -> real_t {return LowerThanEMD_v1(e, b[idx], b.meta, cache_mat);};
+    auto lower1 = [&](const ElemType1& e, const Block<ElemType2> &b, const int idx) -> real_t {
+      if (internal::_pdist2_cached(e, b, idx, 1, cache_mat, et, ld))
+	return internal::_LowerThanEMD_v1_cost(e, b[idx], cache_mat);
+      return LowerThanEMD_v1(e, b[idx], b.meta, cache_mat);
+    };
     if (n == 0) n = b.get_size();
-    size_t count = internal::_KNearestNeighbors_Simple_impl(k, e, b, lambda, lower0, lower1, emds_approx, rank, n);
-    free(cache_mat);
-    return count;
+    return internal::_KNearestNeighbors_Simple_impl(k, e, b, lambda, lower0, lower1, emds_approx, rank, n);
   }
 
 
@@ -657,17 +880,71 @@ namespace d2 {
 				const BlockMultiPhase<Ts2...> &b,
 				__OUT__ real_t* emds_approx,
 				__OUT__ index_t* rank,
-				size_t n) {
-    real_t *cache_mat = (real_t*) malloc(sizeof(real_t) * e.get_max_len() * b.get_max_len());
-    auto lambda = [&](const ElemMultiPhase<Ts1...> &e, const BlockMultiPhase<Ts2...> &b, const int idx) -> real_t {return internal::_EMD_impl(e, b, idx, cache_mat);};
+				size_t n,
+				d2_solver_context_t *ctx = NULL) {
+    internal::_Scratch scratch;
+    real_t *cache_mat = scratch.alloc<real_t>(e.get_max_len() * b.get_max_len());
+    auto lambda = [&](const ElemMultiPhase<Ts1...> &e, const BlockMultiPhase<Ts2...> &b, const int idx) -> real_t {return internal::_EMD_impl(e, b, idx, cache_mat, ctx);};
     auto lower0 = [&](const ElemMultiPhase<Ts1...> &e, const BlockMultiPhase<Ts2...> &b, const int idx) -> real_t {return internal::_LowerThanEMD_v0_impl(e, b, idx);};
     auto lower1 = [&](const ElemMultiPhase<Ts1...> &e, const BlockMultiPhase<Ts2...> &b, const int idx) -> real_t {return internal::_LowerThanEMD_v1_impl(e, b, idx, cache_mat);};
     if (n == 0) n = b.get_size();
-    size_t count = internal::_KNearestNeighbors_Simple_impl(k, e, b, lambda, lower0, lower1, emds_approx, rank, n);
-    free(cache_mat);
-    return count;
+    return internal::_KNearestNeighbors_Simple_impl(k, e, b, lambda, lower0, lower1, emds_approx, rank, n);
   }
 
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Batch(size_t k,
+				 const Block<ElemType1> &queries, const Block<ElemType2> &b,
+				 __OUT__ real_t* dists,
+				 __OUT__ index_t* ids,
+				 size_t n,
+				 d2_solver_context_t *ctx) {
+    const size_t dim = ElemType2::D;
+    const size_t nq = queries.get_size(), nb = b.get_size();
+    if (n == 0 || n > nb) n = nb;
+    if (nq == 0) return 0;
+
+    // centroids of all queries and candidates, from which v0 of all pairs
+    // is a single distance matrix
+    std::vector<real_t> cq(dim * nq), cb(dim * std::max(nb, (size_t) 1));
+    internal::_centroids(queries, b.meta, &cq[0]);
+    internal::_centroids(b, b.meta, &cb[0]);
+
+    // queries are processed in chunks to bound the size of the v0 matrix
+    const size_t chunk = std::max((size_t) 1, std::min(nq, ((size_t) 1 << 22) / std::max(nb, (size_t) 1)));
+    std::vector<real_t> lower0(nb * chunk);
+
+    const size_t num_workers = server::GetNumThreads();
+    const size_t mat_size = queries.get_max_len() * b.get_max_len();
+    std::vector<std::vector<index_t> > cand(num_workers);
+    std::vector<size_t> count(num_workers, 0);
+
+    for (size_t q0=0; q0<nq; q0 += chunk) {
+      const size_t q1 = std::min(nq, q0 + chunk);
+      if (nb > 0) _D2_FUNC(pdist2)(dim, nb, q1 - q0, &cb[0], &cq[dim * q0], &lower0[0]);
+      internal::parallel_for(q1 - q0, [&](size_t t, size_t w) {
+	  const size_t q = q0 + t;
+	  internal::_Scratch scratch;
+	  real_t *lb = &lower0[nb * t];
+	  for (size_t i=0; i<nb; ++i) lb[i] = internal::_LowerThanEMD_v0_sqdist(b[i], lb[i]);
+	  // the supports of the query dimension-major, kept by an aligned block
+	  size_t ld = queries.is_aligned() ? queries.get_aligned_ld(q) : 0;
+	  const real_t *et = queries.get_aligned_support_ptr(q);
+	  if (!et) et = internal::_dim_major(queries[q], scratch, ld);
+	  auto cost = [&](index_t idx, real_t *mat) {
+	    if (!internal::_pdist2_cached(queries[q], b, idx, 1, mat, et, ld))
+	      internal::_pdist2(queries[q].supp, queries[q].len, b[idx].supp, b[idx].len, b.meta, mat);
+	  };
+	  count[w] += internal::_KNearestNeighbors_Batch_impl(k, queries[q], b, lb, n, cost,
+							      scratch.alloc<real_t>(mat_size), cand[w],
+							      w == 0 ? ctx : NULL,
+							      dists + q * k, ids + q * k);
+	});
+    }
+
+    size_t total = 0;
+    for (size_t w=0; w<num_workers; ++w) total += count[w];
+    return total;
+  }
 
 }
 
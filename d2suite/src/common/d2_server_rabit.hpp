@@ -0,0 +1,125 @@
+#ifndef _D2_SERVER_RABIT_H_
+#define _D2_SERVER_RABIT_H_
+
+/*!
+ * \file d2_server_rabit.hpp
+ * \brief The k nearest neighbors search over a database partitioned across
+ * rabit workers.
+ *
+ * Every worker prunes its own part in the order of the version 0 bounds,
+ * as KNearestNeighbors_Simple does, in rounds of a few candidates. After
+ * each round the workers agree on the smallest of their local k-th
+ * distances, which is an upper bound of the global k-th distance, so each
+ * worker prunes with the best threshold found by any of them. The local
+ * top-k lists are finally gathered by an Allreduce and merged.
+ */
+
+#include <rabit/rabit.h>
+#include "d2_server.hpp"
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+namespace d2 {
+
+  namespace internal {
+    /* the number of candidates visited by each worker between two
+     * exchanges of the k-th distance */
+    static const size_t _knn_distributed_round = 32;
+  }
+
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Distributed(size_t k,
+				       const ElemType1 &e, const Block<ElemType2> &b,
+				       __OUT__ real_t* dists,
+				       __OUT__ index_t* ids,
+				       size_t n,
+				       d2_solver_context_t *ctx) {
+    using namespace rabit;
+    // k is the same on every worker, so all of them skip the collectives
+    if (k == 0) return 0;
+    const size_t world = GetWorldSize(), rank = GetRank(), size = b.get_size();
+    const real_t max = std::numeric_limits<real_t>::max();
+
+    // the global index of the first local element
+    std::vector<size_t> sizes(world, 0);
+    sizes[rank] = size;
+    Allreduce<op::Sum>(&sizes[0], world);
+    size_t offset = 0;
+    for (size_t r=0; r<rank; ++r) offset += sizes[r];
+    if (n == 0 || n > size) n = size;
+
+    std::vector<real_t> lower0(size);
+    std::vector<index_t> order(size);
+    for (size_t i=0; i<size; ++i) {
+      lower0[i] = LowerThanEMD_v0(e, b[i], b.meta);
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(),
+	      [&](index_t i1, index_t i2) {return lower0[i1] < lower0[i2];});
+
+    internal::_Scratch scratch;
+    real_t *cache_mat = scratch.alloc<real_t>(e.len * b.get_max_len());
+    size_t ld;
+    const real_t *et = internal::_dim_major(e, scratch, ld);
+    // max-heap of the local k nearest neighbors
+    std::vector<std::pair<real_t, index_t> > knn;
+    knn.reserve(k);
+    real_t shared = max;
+    size_t i = 0, count = 0;
+    bool active = n > 0;
+    while (true) {
+      const size_t end = std::min(n, i + internal::_knn_distributed_round);
+      for (; active && i < end; ++i) {
+	const index_t idx = order[i];
+	const real_t threshold = std::min(shared, knn.size() == k ? knn.front().first : max);
+	if (lower0[idx] >= threshold) {active = false; break;}
+	// the cost matrix of the bound is reused by the EMD
+	const bool computed = internal::_pdist2_cached(e, b, idx, 1, cache_mat, et, ld);
+	if ((computed ? internal::_LowerThanEMD_v1_cost(e, b[idx], cache_mat) :
+	     LowerThanEMD_v1(e, b[idx], b.meta, cache_mat)) >= threshold) continue;
+	const real_t val = EMD(e, b[idx], b.meta, cache_mat, NULL, NULL, true, ctx);
+	count ++;
+	if (knn.size() < k) {
+	  knn.push_back(std::make_pair(val, idx));
+	  std::push_heap(knn.begin(), knn.end());
+	} else if (val < knn.front().first) {
+	  std::pop_heap(knn.begin(), knn.end());
+	  knn.back() = std::make_pair(val, idx);
+	  std::push_heap(knn.begin(), knn.end());
+	}
+      }
+      if (i >= n) active = false;
+
+      // share the k-th distance, and whether any worker has candidates left
+      real_t buf[2] = {knn.size() == k ? knn.front().first : max, (real_t) (active ? -1 : 0)};
+      Allreduce<op::Min>(buf, 2);
+      shared = buf[0];
+      if (buf[1] == 0) break;
+    }
+
+    // gather all local top-k lists, each in its own slot, and merge them
+    std::sort_heap(knn.begin(), knn.end());
+    std::vector<real_t> all_dists(world * k, 0);
+    std::vector<index_t> all_ids(world * k, 0);
+    for (size_t j=0; j<k; ++j) {
+      all_dists[rank * k + j] = j < knn.size() ? knn[j].first : max;
+      all_ids[rank * k + j] = j < knn.size() ? knn[j].second + offset : (index_t) -1;
+    }
+    Allreduce<op::Sum>(&all_dists[0], world * k);
+    Allreduce<op::Sum>(&all_ids[0], world * k);
+    std::vector<std::pair<real_t, index_t> > merged(world * k);
+    for (size_t j=0; j<world * k; ++j) merged[j] = std::make_pair(all_dists[j], all_ids[j]);
+    std::partial_sort(merged.begin(), merged.begin() + k, merged.end());
+    for (size_t j=0; j<k; ++j) {
+      dists[j] = merged[j].first;
+      ids[j] = merged[j].second;
+    }
+
+    Allreduce<op::Sum>(&count, 1);
+    return count;
+  }
+
+}
+
+#endif /* _D2_SERVER_RABIT_H_ */
@@ -0,0 +1,214 @@
+#ifndef _D2_SINKHORN_H_
+#define _D2_SINKHORN_H_
+
+/*!
+ * \file d2_sinkhorn.hpp
+ * \brief Entropic EMD via Sinkhorn matrix scaling.
+ *
+ * The transport plans of a query against all elements of a block are stored
+ * side by side as one e.len x b.get_col() column-major matrix, which is the
+ * same layout as the concatenated cost matrices used by EMD(Elem, Block).
+ * Column scaling then runs as a single kernel call over the whole batch and
+ * only the row scaling is done element by element.
+ */
+
+#include "common.hpp"
+#include "d2.hpp"
+#include "blas_like.h"
+#include <cmath>
+#include <vector>
+#include <limits>
+
+namespace d2 {
+  namespace def {
+    /*! \brief all hyper parameters of the Sinkhorn EMD */
+    struct SINKHORN_PARAM {
+      real_t reg = 0.05; ///< the entropic regularization, relative to the largest ground distance of each pair
+      size_t max_iter = 100; ///< the maximum number of scaling iterations
+      real_t tol = 1E-6; ///< the tolerance of the (l1) violation of the marginals
+      bool log_domain = false; ///< whether to run the numerically stable log-domain iterations (forced if reg is too small for real_t)
+      size_t batch_col = 1 << 16; ///< the maximum number of columns solved in one batch
+    };
+  }
+
+  namespace internal {
+
+    /*!
+     * \brief Sinkhorn iterations for a batch of transportation problems
+     * sharing the same row weights
+     * \param n the number of rows (the length of the query)
+     * \param wa the row weights, length n
+     * \param size the number of problems in the batch
+     * \param lens the number of columns of each problem
+     * \param wb the concatenated column weights
+     * \param C the concatenated cost matrices, n x sum(lens)
+     * \param P the concatenated transport plans (output), n x sum(lens)
+     * \param emds the transport cost of each problem (output)
+     */
+    inline void _Sinkhorn_batch(const size_t n, const real_t *wa,
+				const size_t size, const size_t *lens,
+				const real_t *wb,
+				const real_t *C, __OUT__ real_t *P,
+				const def::SINKHORN_PARAM &param,
+				__OUT__ real_t *emds) {
+      size_t col = 0;
+      for (size_t i=0; i<size; ++i) col += lens[i];
+      std::vector<real_t> scale(std::max(n, col)), rs(n);
+
+      // per-problem temperatures
+      std::vector<real_t> temp(size);
+      for (size_t i=0, offset=0; i<size; offset += n * lens[i], ++i) {
+	real_t max_cost = 0;
+	for (size_t k=0; k<n*lens[i]; ++k) max_cost = std::max(max_cost, C[offset + k]);
+	temp[i] = param.reg * (max_cost > 0 ? max_cost : 1.);
+      }
+
+      // exp(-C / temp) reaches exp(-1 / reg), which has to stay far from
+      // underflow (e.g. reg < 0.023 is too small for single precision)
+      const bool log_domain = param.log_domain ||
+	1. / param.reg > -log(std::numeric_limits<real_t>::min()) / 2;
+      if (!log_domain) {
+	// P = exp(-C / temp)
+	for (size_t i=0, offset=0; i<size; offset += n * lens[i], ++i) {
+	  const real_t s = -1. / temp[i];
+	  for (size_t k=0; k<n*lens[i]; ++k) P[offset + k] = C[offset + k] * s;
+	}
+	_D2_FUNC(exp)(n * col, P);
+
+	for (size_t iter=0; iter < param.max_iter; ++iter) {
+	  // scale rows, element by element
+	  real_t err = 0;
+	  for (size_t i=0, offset=0; i<size; offset += n * lens[i], ++i) {
+	    _D2_FUNC(rsum)(n, lens[i], P + offset, &rs[0]);
+	    for (size_t r=0; r<n; ++r) {
+	      err += std::fabs(rs[r] - wa[r]);
+	      scale[r] = rs[r] > 0 ? wa[r] / rs[r] : 0;
+	    }
+	    _D2_FUNC(gcms)(n, lens[i], P + offset, &scale[0]);
+	  }
+	  if (iter > 0 && err < param.tol * size) break;
+
+	  // scale columns of the whole batch at once
+	  _D2_FUNC(csum)(n, col, P, &scale[0]);
+	  for (size_t j=0; j<col; ++j) scale[j] = scale[j] > 0 ? wb[j] / scale[j] : 0;
+	  _D2_FUNC(grms)(n, col, P, &scale[0]);
+	}
+      } else {
+	// log-domain iterations on the potentials f (rows) and g (columns)
+	std::vector<real_t> f(n * size, 0), g(col, 0), la(n), lb(col);
+	const real_t neg_inf = -std::numeric_limits<real_t>::infinity();
+	for (size_t r=0; r<n; ++r) la[r] = wa[r] > 0 ? log(wa[r]) : neg_inf;
+	for (size_t j=0; j<col; ++j) lb[j] = wb[j] > 0 ? log(wb[j]) : neg_inf;
+
+	for (size_t iter=0; iter < param.max_iter; ++iter) {
+	  real_t err = 0;
+	  for (size_t i=0, offset=0, c0=0; i<size; offset += n * lens[i], c0 += lens[i], ++i) {
+	    const size_t m = lens[i];
+	    const real_t t = temp[i];
+	    real_t *fi = &f[n * i];
+	    const real_t *Ci = C + offset;
+	    // g_j = t * (log b_j - logsumexp_r ((f_r - C_rj) / t))
+	    for (size_t j=0; j<m; ++j) {
+	      const real_t *c = Ci + j*n;
+	      real_t mx = neg_inf, s = 0;
+	      for (size_t r=0; r<n; ++r) mx = std::max(mx, fi[r] - c[r]);
+	      for (size_t r=0; r<n; ++r) s += exp((fi[r] - c[r] - mx) / t);
+	      g[c0 + j] = lb[c0 + j] == neg_inf ? neg_inf : t * lb[c0 + j] - mx - t * log(s);
+	    }
+	    // f_r = t * (log a_r - logsumexp_j ((g_j - C_rj) / t))
+	    for (size_t r=0; r<n; ++r) scale[r] = neg_inf;
+	    for (size_t j=0; j<m; ++j) {
+	      const real_t *c = Ci + j*n;
+	      for (size_t r=0; r<n; ++r) scale[r] = std::max(scale[r], g[c0 + j] - c[r]);
+	    }
+	    for (size_t r=0; r<n; ++r) rs[r] = 0;
+	    for (size_t j=0; j<m; ++j) {
+	      const real_t *c = Ci + j*n;
+	      for (size_t r=0; r<n; ++r) rs[r] += exp((g[c0 + j] - c[r] - scale[r]) / t);
+	    }
+	    for (size_t r=0; r<n; ++r) {
+	      // violation of the row marginals before the f-update
+	      if (fi[r] != neg_inf) err += std::fabs(exp((fi[r] + scale[r]) / t) * rs[r] - wa[r]);
+	      fi[r] = la[r] == neg_inf ? neg_inf : t * la[r] - scale[r] - t * log(rs[r]);
+	    }
+	  }
+	  if (iter > 0 && err < param.tol * size) break;
+	}
+
+	// P_rj = exp((f_r + g_j - C_rj) / t)
+	for (size_t i=0, offset=0, c0=0; i<size; offset += n * lens[i], c0 += lens[i], ++i) {
+	  const real_t t = temp[i];
+	  const real_t *fi = &f[n * i];
+	  for (size_t j=0; j<lens[i]; ++j)
+	    for (size_t r=0; r<n; ++r) {
+	      const size_t k = offset + j*n + r;
+	      P[k] = (fi[r] == neg_inf || g[c0 + j] == neg_inf) ? 0 :
+		exp((fi[r] + g[c0 + j] - C[k]) / t);
+	    }
+	}
+      }
+
+      for (size_t i=0, offset=0; i<size; offset += n * lens[i], ++i) {
+	double val = 0;
+	for (size_t k=0; k<n*lens[i]; ++k) val += P[offset + k] * C[offset + k];
+	emds[i] = val;
+      }
+    }
+  }
+
+  template <typename ElemType1, typename ElemType2>
+  real_t EMD(const ElemType1 &e1, const ElemType2 &e2,
+	     const Meta<ElemType2> &meta,
+	     const def::SINKHORN_PARAM &param,
+	     __IN_OUT__ real_t* cache_mat,
+	     __OUT__ real_t* cache_primal) {
+    const size_t mat_size = e1.len * e2.len;
+    internal::_Scratch scratch;
+    real_t *C = cache_mat ? cache_mat : scratch.alloc<real_t>(mat_size);
+    real_t *P = cache_primal ? cache_primal : scratch.alloc<real_t>(mat_size);
+    internal::_pdist2(e1.supp, e1.len, e2.supp, e2.len, meta, C);
+    const size_t len = e2.len;
+    real_t val;
+    internal::_Sinkhorn_batch(e1.len, e1.w, 1, &len, e2.w, C, P, param, &val);
+    return val;
+  }
+
+  template <typename ElemType1, typename ElemType2>
+  void EMD(const ElemType1 &e, const Block<ElemType2> &b,
+	   __OUT__ real_t* emds,
+	   const def::SINKHORN_PARAM &param,
+	   __OUT__ real_t* cache_primal) {
+    const size_t size = b.get_size();
+    if (size == 0) return;
+
+    // split the block into batches of at most param.batch_col columns
+    std::vector<size_t> batch_start(1, 0), lens(size);
+    for (size_t i=0, c=0; i<size; ++i) {
+      lens[i] = b[i].len;
+      if (c > 0 && c + lens[i] > param.batch_col) {batch_start.push_back(i); c = 0;}
+      c += lens[i];
+    }
+    batch_start.push_back(size);
+    const size_t num_batches = batch_start.size() - 1;
+
+    // cost matrices and (if not requested) plans from the arena of each worker
+    internal::_Scratch scratch_e;
+    size_t ld;
+    const real_t *et = internal::_dim_major(e, scratch_e, ld);
+    internal::parallel_for(num_batches, [&](size_t t, size_t w) {
+	const size_t i0 = batch_start[t], i1 = batch_start[t+1];
+	const size_t c0 = b[i0].w - b.get_weight_ptr();
+	size_t c = 0;
+	for (size_t i=i0; i<i1; ++i) c += lens[i];
+	internal::_Scratch scratch;
+	real_t *Ct = scratch.alloc<real_t>(e.len * c);
+	real_t *Pt = cache_primal ? cache_primal + e.len * c0 : scratch.alloc<real_t>(e.len * c);
+	if (!internal::_pdist2_cached(e, b, i0, i1 - i0, Ct, et, ld))
+	  internal::_pdist2(e.supp, e.len, b[i0].supp, c, b.meta, Ct);
+	internal::_Sinkhorn_batch(e.len, e.w, i1 - i0, &lens[i0], b[i0].w, Ct, Pt, param, emds + i0);
+      });
+  }
+
+}
+
+#endif /* _D2_SINKHORN_H_ */
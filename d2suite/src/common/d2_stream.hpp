@@ -0,0 +1,330 @@
+#ifndef _D2_STREAM_H_
+#define _D2_STREAM_H_
+
+/*!
+ * \file d2_stream.hpp
+ * \brief Reading a dataset as a stream of fixed-size chunks, for datasets
+ * that do not fit in memory.
+ *
+ * The file (text or .d2b) is mapped read-only and a background thread
+ * reads the next chunk into one of two blocks while the caller works on
+ * the other one. Pages of the file behind the chunks already read are
+ * dropped from the mapping, so only about two chunks are resident at a
+ * time. The EMD, LowerThanEMD_v0 and KNearestNeighbors_Simple overloads
+ * at the end consume a stream chunk by chunk.
+ */
+
+#include "d2_data.hpp"
+#include "d2_io_binary.hpp"
+#include "d2_io_text.hpp"
+#include "d2_server.hpp"
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace d2 {
+
+  /*!
+   * \brief a stream of blocks of at most chunk_size elements read from a
+   * file, in the order of the file.
+   *
+   * Example:
+   * \code{.cpp}
+   * BlockStream<Elem<def::Euclidean, 3> > stream ("data.d2", 10000, 8);
+   * while (const Block<Elem<def::Euclidean, 3> > *b = stream.next()) {
+   *   // b holds elements [stream.get_offset(), stream.get_offset() + b->get_size())
+   * }
+   * \endcode
+   */
+  template <typename ElemType>
+  class BlockStream {
+    typedef typename ElemType::T::type SuppType;
+    typedef Meta<ElemType> MetaType;
+  public:
+    /*! \brief open a text file (with the meta data in filename.meta0) or a
+     * .d2b file, and start reading the first chunk
+     * \param chunk_size the maximum number of elements per chunk
+     * \param thelen the estimated length of elements
+     */
+    BlockStream(const std::string &filename, const size_t chunk_size, const size_t thelen);
+    ~BlockStream();
+    BlockStream(const BlockStream&) = delete;
+    BlockStream& operator=(const BlockStream&) = delete;
+
+    /*! \brief the next chunk, or NULL at the end of the file. The chunk is
+     * valid until the next call, during which the one after it is read. */
+    const Block<ElemType>* next();
+    /*! \brief the index in the file of the first element of the last chunk */
+    inline size_t get_offset() const {return front_offset;}
+    /*! \brief start over from the beginning of the file */
+    void rewind();
+
+    /*! \brief the meta data shared by all chunks */
+    MetaType meta;
+
+  private:
+    /* fill block with the next chunk from pos; return its size */
+    size_t _read_chunk(Block<ElemType> &block);
+    size_t _read_chunk_text(Block<ElemType> &block);
+    size_t _read_chunk_binary(Block<ElemType> &block);
+    /* drop the pages of the mapping in [begin, end), rounded down to pages */
+    void _release(const size_t begin, const size_t end);
+    void _prefetch();
+
+    const size_t chunk_size;
+    Block<ElemType> buf0, buf1;
+    Block<ElemType> *front, *back;
+    size_t front_offset;
+
+    /* the mapping, and the state of the reader owned by the thread while
+     * back is not ready: pos is the byte position in a text file and the 
+     * column in a .d2b file, and index the element to read next */
+    char *data;
+    size_t file_size;
+    bool binary;
+    internal::_BinaryHeader header;
+    size_t pos, index;
+    size_t back_offset, back_size;
+
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool back_ready, stop;
+  };
+
+
+  template <typename ElemType>
+  BlockStream<ElemType>::BlockStream(const std::string &filename, const size_t chunk_size, const size_t thelen):
+    chunk_size(std::max(chunk_size, (size_t) 1)), buf0(chunk_size, thelen), buf1(chunk_size, thelen),
+    front(&buf0), back(&buf1), front_offset(0), data(NULL), file_size(0), binary(false),
+    pos(0), index(0), back_offset(0), back_size(0), back_ready(false), stop(false) {
+    using namespace std;
+    using namespace internal;
+    static_assert(_text_supported<Block<ElemType> >::value, "the element type cannot be streamed");
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    file_size = st.st_size;
+    void *p = file_size > 0 ? mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    assert(p != MAP_FAILED);
+    data = (char*) p;
+    if (data != NULL) madvise(data, file_size, MADV_SEQUENTIAL);
+
+    binary = file_size >= sizeof(_BinaryHeader) && std::equal(data, data + 4, _binary_magic);
+    if (binary) {
+      memcpy(&header, data, sizeof(header));
+      // the sections and the lengths are checked once, so that no chunk
+      // is copied from past the mapping
+      if (!_binary_valid<ElemType>(header, data, file_size)) {
+	cerr << getLogHeader() << " error: " << filename
+	     << " does not match the element type or is corrupted." << endl;
+	header.size = 0;
+      } else {
+	// the meta data stay in the mapping, and their pages are never dropped
+	_BinaryMeta<typename ElemType::T, ElemType::D>::map(meta, header.meta_size, (real_t*) (data + header.off_meta));
+      }
+    } else {
+      meta.read(filename + ".meta0");
+    }
+    buf0.meta = meta; buf0.meta.to_shared();
+    buf1.meta = meta; buf1.meta.to_shared();
+
+    thread = std::thread(&BlockStream<ElemType>::_prefetch, this);
+  }
+
+  template <typename ElemType>
+  BlockStream<ElemType>::~BlockStream() {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stop = true;
+    }
+    cv.notify_all();
+    thread.join();
+    if (data != NULL) munmap(data, file_size);
+  }
+
+  template <typename ElemType>
+  const Block<ElemType>* BlockStream<ElemType>::next() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]{return back_ready;});
+    if (back_size == 0) return NULL;
+    std::swap(front, back);
+    front_offset = back_offset;
+    back_ready = false;
+    lock.unlock();
+    cv.notify_all();
+    return front;
+  }
+
+  template <typename ElemType>
+  void BlockStream<ElemType>::rewind() {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]{return back_ready;});
+    pos = index = 0;
+    front_offset = 0;
+    back_ready = false;
+    lock.unlock();
+    cv.notify_all();
+  }
+
+  template <typename ElemType>
+  void BlockStream<ElemType>::_prefetch() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+      cv.wait(lock, [&]{return stop || !back_ready;});
+      if (stop) return;
+      lock.unlock();
+      back_offset = index;
+      back_size = _read_chunk(*back);
+      index += back_size;
+      lock.lock();
+      back_ready = true;
+      cv.notify_all();
+    }
+  }
+
+  template <typename ElemType>
+  size_t BlockStream<ElemType>::_read_chunk(Block<ElemType> &block) {
+    const size_t n = binary ? _read_chunk_binary(block) : _read_chunk_text(block);
+    if (n > 0) block.realign_vec();
+    return n;
+  }
+
+  /* the two passes of internal::_read_main over the records of one chunk */
+  template <typename ElemType>
+  size_t BlockStream<ElemType>::_read_chunk_text(Block<ElemType> &block) {
+    using namespace internal;
+    const char *p = data + pos, *end = data + file_size;
+    std::vector<size_t> lens, offsets;
+    const char *start = p;
+    for (size_t i=0; i<chunk_size; ++i)
+      if (!_scan_record(p, end, block, &lens)) break;
+    const size_t n = lens.size();
+    if (n == 0) return 0;
+    offsets.resize(n);
+    for (size_t i=0, c=0; i<n; c += lens[i], ++i) offsets[i] = c;
+    block.resize(n, &lens[0]);
+    for (size_t i=0; i<n; ++i) _parse_record(start, end, block, &offsets, i);
+    _release(pos, p - data);
+    pos = p - data;
+    return n;
+  }
+
+  /* copy the sections of the next elements out of the mapping */
+  template <typename ElemType>
+  size_t BlockStream<ElemType>::_read_chunk_binary(Block<ElemType> &block) {
+    if (index >= header.size) return 0;
+    const size_t n = std::min(chunk_size, (size_t) header.size - index);
+    const uint64_t *lens64 = (const uint64_t*) (data + header.off_len) + index;
+    std::vector<size_t> lens(lens64, lens64 + n);
+    block.resize(n, &lens[0]);
+    const size_t col = block.get_col(), col0 = pos;
+    const size_t supp0 = ElemType::T::step_stride(col0, ElemType::D);
+    memcpy(block.get_weight_ptr(), data + header.off_w + sizeof(real_t) * col0, sizeof(real_t) * col);
+    memcpy(block.get_label_ptr(), data + header.off_label + sizeof(real_t) * col0, sizeof(real_t) * col);
+    memcpy(block.get_support_ptr(), data + header.off_supp + sizeof(SuppType) * supp0,
+	   sizeof(SuppType) * ElemType::T::step_stride(col, ElemType::D));
+    pos += col;
+    const size_t supp1 = ElemType::T::step_stride(pos, ElemType::D);
+    _release(header.off_w + sizeof(real_t) * col0, header.off_w + sizeof(real_t) * pos);
+    _release(header.off_label + sizeof(real_t) * col0, header.off_label + sizeof(real_t) * pos);
+    _release(header.off_supp + sizeof(SuppType) * supp0, header.off_supp + sizeof(SuppType) * supp1);
+    return n;
+  }
+
+  /* the pages are only a hint of what is no longer needed: a page that is
+   * needed again is read from the file once more */
+  template <typename ElemType>
+  void BlockStream<ElemType>::_release(const size_t begin, const size_t end) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t b = begin / page * page, e = end / page * page;
+    if (e > b) madvise(data + b, e - b, MADV_DONTNEED);
+  }
+
+
+  /*!
+   * \brief compute EMD between an element and all elements of a stream, in
+   * the order of the file
+   * \param emds the EMDs, one per element of the stream
+   * \return the number of elements
+   */
+  template <typename ElemType1, typename ElemType2>
+  size_t EMD(const ElemType1 &e, BlockStream<ElemType2> &stream,
+	     __OUT__ real_t* emds,
+	     d2_solver_context_t *ctx = NULL) {
+    size_t size = 0;
+    while (const Block<ElemType2> *b = stream.next()) {
+      EMD(e, *b, emds + stream.get_offset(), NULL, NULL, NULL, false, ctx);
+      size = stream.get_offset() + b->get_size();
+    }
+    return size;
+  }
+
+  /*!
+   * \brief compute lower bound of EMD (version 0) between an element and all
+   * elements of a stream, in the order of the file
+   * \return the number of elements
+   */
+  template <typename ElemType1, typename ElemType2>
+  size_t LowerThanEMD_v0(const ElemType1 &e, BlockStream<ElemType2> &stream,
+			 __OUT__ real_t* emds) {
+    size_t size = 0;
+    while (const Block<ElemType2> *b = stream.next()) {
+      LowerThanEMD_v0(e, *b, emds + stream.get_offset());
+      size = stream.get_offset() + b->get_size();
+    }
+    return size;
+  }
+
+  /*!
+   * \brief the k nearest neighbors of an element among the elements of a
+   * stream. Within every chunk candidates are pruned as in
+   * KNearestNeighbors_Batch, with the k nearest neighbors found in the
+   * chunks before.
+   * \param dists the distances to the neighbors, nearest first
+   * \param ids the indices of the neighbors in the file (-1 if there are
+   * fewer than k elements)
+   * \return the number of EMD computed
+   */
+  template <typename ElemType1, typename ElemType2>
+  size_t KNearestNeighbors_Simple(size_t k,
+				  const ElemType1 &e, BlockStream<ElemType2> &stream,
+				  __OUT__ real_t* dists,
+				  __OUT__ index_t* ids,
+				  d2_solver_context_t *ctx = NULL) {
+    internal::_Scratch scratch;
+    size_t ld;
+    const real_t *et = internal::_dim_major(e, scratch, ld);
+    std::vector<std::pair<real_t, index_t> > knn;
+    knn.reserve(k);
+    std::vector<real_t> lb, mat;
+    std::vector<index_t> cand;
+    size_t count = 0;
+    while (const Block<ElemType2> *b = stream.next()) {
+      lb.resize(b->get_size());
+      LowerThanEMD_v0(e, *b, &lb[0]);
+      mat.resize(e.len * b->get_max_len());
+      auto cost = [&](index_t idx, real_t *mat) {
+	if (!internal::_pdist2_cached(e, *b, idx, 1, mat, et, ld))
+	  internal::_pdist2(e.supp, e.len, (*b)[idx].supp, (*b)[idx].len, b->meta, mat);
+      };
+      count += internal::_KNearestNeighbors_Prune(k, e, *b, &lb[0], b->get_size(), cost,
+						  &mat[0], cand, ctx, knn, stream.get_offset());
+    }
+    internal::_KNearestNeighbors_Output(k, knn, dists, ids);
+    return count;
+  }
+
+}
+
+#endif /* _D2_STREAM_H_ */
@@ -11,13 +11,43 @@ extern "C" {
 
 #define SCALAR d2::real_t
 
+  /*! \brief the opaque solver state (workspace, cached LP tasks, etc).
+   * A context must not be used by more than one thread at a time;
+   * independent EMDs can be solved concurrently with one context per thread.
+   */
+  typedef struct d2_solver_context d2_solver_context_t;
+
   void d2_solver_setup();
   void d2_solver_release();
   void d2_solver_debug();
 
+  d2_solver_context_t* d2_solver_context_create();
+  void d2_solver_context_release(d2_solver_context_t *ctx);
+
+  /*! \brief solve the transportation problem using the given context (or
+   * the context of the calling thread if NULL) */
+  double d2_match_by_distmat_ctx(d2_solver_context_t *ctx,
+				 int n, int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+				 /** OUT **/ SCALAR *x, /** OUT **/ SCALAR *lambda);
+
+  /*! \brief solve the transportation problem using the context of the calling thread */
   double d2_match_by_distmat(int n, int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY, 
 			     /** OUT **/ SCALAR *x, /** OUT **/ SCALAR *lambda, size_t index);
 
+  /*! \brief solve the transportation problem starting from the final basis
+   * of the last problem of the same size solved with ctx, or else from the
+   * dual solution (length n+m) of a similar problem, e.g. one with a slightly
+   * different cost matrix, which is given in lambda and is overwritten by
+   * the new dual solution (ctx may be NULL for the context of the calling thread) */
+  double d2_match_by_distmat_warm(d2_solver_context_t *ctx,
+				  int n, int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+				  /** OUT **/ SCALAR *x, /** IN_OUT **/ SCALAR *lambda);
+
+  /*! \brief the number of simplex pivots made with a context (or with the
+   * context of the calling thread if NULL) since it was created or reset */
+  size_t d2_solver_get_pivots(d2_solver_context_t *ctx);
+  void d2_solver_reset_pivots(d2_solver_context_t *ctx);
+
   double d2_match_by_distmat_qp(int n, int m, SCALAR *C, SCALAR *L, SCALAR rho, SCALAR *lw, SCALAR *rw, SCALAR *x0, /** OUT **/ SCALAR *x);
   
   double d2_qpsimple(int str, int count, SCALAR *q, /** OUT **/ SCALAR *w);
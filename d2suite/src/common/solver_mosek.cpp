@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include "blas_util.h"
 
+/* the environment is created once by d2_solver_setup() and is only read
+ * afterwards; LP tasks are owned by solver contexts, one per thread. */
 static MSKenv_t   env = NULL;
 //static MSKtask_t *task_seq = NULL;
 //static size_t task_seq_size = 0;
@@ -12,7 +14,33 @@ static MSKenv_t   env = NULL;
 using std::pair;
 using std::make_pair;
 using std::map;
-static map< pair<int, int>, MSKtask_t > task_mapper;
+
+struct d2_solver_context {
+  map< pair<int, int>, MSKtask_t > task_mapper;
+  size_t pivots = 0; ///< the number of simplex iterations since the last reset
+  ~d2_solver_context() {
+    for (map< pair<int, int>, MSKtask_t >::iterator it=task_mapper.begin(); it!=task_mapper.end(); ++it) MSK_deletetask(&(it->second));
+  }
+};
+
+/* MSK_getxx and MSK_gety write doubles; with single precision SCALAR the
+ * solution (of length len) goes through a double buffer */
+static MSKrescodee _get_solution(MSKtask_t task, MSKsoltypee whichsol, const int dual,
+				 const MSKint32t len, SCALAR *out) {
+#ifdef _D2_DOUBLE
+  return dual ? MSK_gety(task, whichsol, out) : MSK_getxx(task, whichsol, out);
+#else
+  MSKint32t i;
+  MSKrealt *buf = (MSKrealt *) malloc(len*sizeof(MSKrealt));
+  MSKrescodee r = dual ? MSK_gety(task, whichsol, buf) : MSK_getxx(task, whichsol, buf);
+  for (i=0; i<len; ++i) out[i] = buf[i];
+  free(buf);
+  return r;
+#endif
+}
+
+/* the context used by d2_match_by_distmat, one per thread */
+static thread_local d2_solver_context default_context;
 
 /* This function prints log output from MOSEK to the terminal. */
 static void MSKAPI printstr(void *handle,
@@ -52,14 +80,40 @@ void d2_solver_release() {
   for (i=0; i<task_seq_size; ++i) 
     if (task_seq[i] != NULL) MSK_deletetask(&task_seq [i]);
   */
-  for (map< pair<int, int>, MSKtask_t >::iterator it=task_mapper.begin(); it!=task_mapper.end(); ++it) MSK_deletetask(&(it->second));
+  /* tasks must be deleted before the environment: contexts owned by
+   * other threads have to be released before this call */
+  for (map< pair<int, int>, MSKtask_t >::iterator it=default_context.task_mapper.begin(); it!=default_context.task_mapper.end(); ++it) MSK_deletetask(&(it->second));
+  default_context.task_mapper.clear();
   MSK_deleteenv(&env);
 }
 
+size_t d2_solver_get_pivots(d2_solver_context_t *ctx) {
+  return (ctx ? ctx : &default_context)->pivots;
+}
+
+void d2_solver_reset_pivots(d2_solver_context_t *ctx) {
+  (ctx ? ctx : &default_context)->pivots = 0;
+}
+
+d2_solver_context_t* d2_solver_context_create() {
+  return new d2_solver_context;
+}
+
+void d2_solver_context_release(d2_solver_context_t *ctx) {
+  delete ctx;
+}
 
 double d2_match_by_distmat(const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
 			   __OUT__ SCALAR *x, __OUT__ SCALAR *lambda, size_t index) {
-  
+  return d2_match_by_distmat_ctx(&default_context, n, m, C, wX, wY, x, lambda);
+}
+
+
+double d2_match_by_distmat_ctx(d2_solver_context_t *ctx,
+			       const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+			       __OUT__ SCALAR *x, __OUT__ SCALAR *lambda) {
+  if (!ctx) ctx = &default_context;
+  map< pair<int, int>, MSKtask_t > &task_mapper = ctx->task_mapper;
   const MSKint32t numvar = n * m,
                   numcon = n + m;
   MSKtask_t    *p_task;
@@ -149,6 +203,12 @@ double d2_match_by_distmat(const int n, const int m, const SCALAR *C, const SCAL
 
       /* Run optimizer */
       r = MSK_optimizetrm(*p_task,&trmcode);      
+      {
+	MSKint32t primal_iter = 0, dual_iter = 0;
+	MSK_getintinf(*p_task, MSK_IINF_SIM_PRIMAL_ITER, &primal_iter);
+	MSK_getintinf(*p_task, MSK_IINF_SIM_DUAL_ITER, &dual_iter);
+	ctx->pivots += primal_iter + dual_iter;
+      }
 
       /* Print a summary containing information
          about the solution for debugging purposes. */
@@ -167,11 +227,9 @@ double d2_match_by_distmat(const int n, const int m, const SCALAR *C, const SCAL
 	    MSK_getprimalobj(*p_task, MSK_SOL_BAS, &fval);
             if ( x )
             {
-#ifdef _D2_DOUBLE
-              MSK_getxx(*p_task,
-                        MSK_SOL_BAS,    /* Request the basic solution. */
-                        x);        
-#endif
+              _get_solution(*p_task,
+			    MSK_SOL_BAS,    /* Request the basic solution. */
+			    0, numvar, x);
               //printf("Optimal primal solution\n");
               //for(j=0; j<numvar; ++j) printf("x[%d]: %e\n",j,xx[j]);
 
@@ -180,11 +238,9 @@ double d2_match_by_distmat(const int n, const int m, const SCALAR *C, const SCAL
 
 	    if (lambda) 
 	    {
-#ifdef _D2_DOUBLE
-	      MSK_gety (*p_task,
-                        MSK_SOL_BAS,    /* Request the dual solution: be careful about exact +- of variables */
-                        lambda);
-#endif
+	      _get_solution(*p_task,
+			    MSK_SOL_BAS,    /* Request the dual solution: be careful about exact +- of variables */
+			    1, numcon, lambda);
 	    }	    
             else 
               r = MSK_RES_ERR_SPACE;
@@ -228,6 +284,15 @@ double d2_match_by_distmat(const int n, const int m, const SCALAR *C, const SCAL
 
 
 
+/* the task of each problem size is kept in the context and the simplex
+ * restarts from its last basis, so the given duals are not needed */
+double d2_match_by_distmat_warm(d2_solver_context_t *ctx,
+				const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+				__OUT__ SCALAR *x, __IN_OUT__ SCALAR *lambda) {
+  return d2_match_by_distmat_ctx(ctx ? ctx : &default_context, n, m, C, wX, wY, x, lambda);
+}
+
+
 /**
  * Main codes ends and extra codes begins.
  */
@@ -420,11 +485,9 @@ double d2_qpsimple(int n, int count, SCALAR *c, /** OUT **/ SCALAR *w) {
 	  case MSK_SOL_STA_NEAR_OPTIMAL:
 	    MSK_getprimalobj(task, MSK_SOL_ITR, &fval);
 	    if ( w ) {
-#ifdef _D2_DOUBLE
-	      MSK_getxx(task,
-			MSK_SOL_ITR,
-			w);
-#endif
+	      _get_solution(task,
+			    MSK_SOL_ITR,
+			    0, numvar, w);
 	    }
 	    break;
           case MSK_SOL_STA_DUAL_INFEAS_CER:
@@ -0,0 +1,397 @@
+#include "solver.h"
+#include <stdio.h>
+#include <math.h>
+
+/*
+ * A dependency-free solver for the transportation problem
+ *
+ *     min  sum_ij C_ij x_ij
+ *     s.t. sum_j x_ij = wX_i,  sum_i x_ij = wY_j,  x_ij >= 0
+ *
+ * specialized for the bipartite n x m structure. It is a primal
+ * network simplex, where the basis is a spanning tree over n row nodes
+ * (indexed by 0..n-1) and m column nodes (indexed by n..n+m-1)
+ * and every basic arc corresponds to a cell (i,j) of the flow matrix.
+ *
+ * The initial basic feasible tree is built by the least-cost rule,
+ * entering arcs are priced by block search (a partial Dantzig rule),
+ * and only the subtree cut off by the leaving arc is re-hung after
+ * each pivot. A warm start (d2_match_by_distmat_warm) restarts from the
+ * final basis of the last problem solved in the same context, if it has the
+ * same size and its flows are still feasible, or else from the spanning tree
+ * of the cells of least reduced costs under given dual potentials.
+ *
+ * All working memory lives in a d2_solver_context, so that one context per
+ * thread allows EMDs to be solved concurrently.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace {
+  struct _TransportArc {
+    int row, col;
+    double flow;
+  };
+
+  struct _TransportWorkspace {
+    std::vector<double> cost, supply, demand, pot, cost_tmp;
+    std::vector<int> order;
+    std::vector<_TransportArc> arcs;
+    std::vector< std::vector<int> > adj;
+    std::vector<int> parent, parent_arc, depth;
+    std::vector<int> path_u, path_v, stack;
+    std::vector<bool> alive;
+    int n = 0, m = 0; // the size of the last problem, whose final basis is in arcs
+  };
+
+  inline int _other_end(const _TransportArc &a, const int node, const int n) {
+    return node < n ? a.col + n : a.row;
+  }
+
+  inline void _remove_adj(std::vector<int> &adj, const int arc) {
+    for (size_t k=0; k<adj.size(); ++k)
+      if (adj[k] == arc) {adj[k] = adj.back(); adj.pop_back(); return;}
+  }
+
+  /* (re-)compute parent, depth and potentials for the subtree hung at node
+   * x, whose parent node is p via the basic arc a (a = -1 if x is the root) */
+  void _hang_subtree(_TransportWorkspace &ws, const int n, int x, int p, int a) {
+    std::vector<int> &stack = ws.stack;
+    stack.clear();
+    ws.parent[x] = p; ws.parent_arc[x] = a;
+    if (a < 0) {
+      ws.depth[x] = 0; ws.pot[x] = 0;
+    } else {
+      const _TransportArc &arc = ws.arcs[a];
+      ws.depth[x] = ws.depth[p] + 1;
+      ws.pot[x] = ws.cost[arc.row + arc.col * n] - ws.pot[p];
+    }
+    stack.push_back(x);
+    while (!stack.empty()) {
+      const int u = stack.back(); stack.pop_back();
+      const std::vector<int> &adj = ws.adj[u];
+      for (size_t k=0; k<adj.size(); ++k) {
+	const int e = adj[k];
+	if (e == ws.parent_arc[u]) continue;
+	const _TransportArc &arc = ws.arcs[e];
+	const int v = _other_end(arc, u, n);
+	ws.parent[v] = u;
+	ws.parent_arc[v] = e;
+	ws.depth[v] = ws.depth[u] + 1;
+	ws.pot[v] = ws.cost[arc.row + arc.col * n] - ws.pot[u];
+	stack.push_back(v);
+      }
+    }
+  }
+
+  /* sort the cells by cost, or by reduced cost under the potentials pot0 */
+  void _sort_cells(_TransportWorkspace &ws, const int n, const int m, const SCALAR *pot0) {
+    const int nm = n*m;
+    std::vector<int> &order = ws.order;
+    order.resize(nm);
+    for (int k=0; k<nm; ++k) order[k] = k;
+    if (pot0) {
+      // the reduced costs, which are kept in ws.pot as scratch
+      ws.pot.resize(nm);
+      for (int k=0; k<nm; ++k) ws.pot[k] = ws.cost[k] - pot0[k % n] - pot0[n + k / n];
+    }
+    const double *cost = pot0 ? &ws.pot[0] : &ws.cost[0];
+    std::sort(order.begin(), order.end(),
+	      [cost](int k1, int k2) {return cost[k1] < cost[k2];});
+  }
+
+  /* build an initial basic feasible tree by the least-cost rule: visit cells
+   * in the sorted order and ship as much as possible, eliminating
+   * exactly one row or column per visited cell (the last cell eliminates both)
+   * so that n+m-1 arcs are produced even for degenerate problems. */
+  void _init_least_cost(_TransportWorkspace &ws, const int n, const int m) {
+    const int nm = n*m;
+    const std::vector<int> &order = ws.order;
+    ws.alive.assign(n+m, true);
+    ws.arcs.clear();
+    int rows_alive = n, cols_alive = m;
+    for (int k=0; k<nm && rows_alive + cols_alive > 0; ++k) {
+      const int i = order[k] % n, j = order[k] / n;
+      if (!ws.alive[i] || !ws.alive[n+j]) continue;
+      double &s = ws.supply[i], &d = ws.demand[j];
+      _TransportArc arc;
+      arc.row = i; arc.col = j; arc.flow = std::min(s, d);
+      s -= arc.flow; d -= arc.flow;
+      ws.arcs.push_back(arc);
+      if (rows_alive == 1 && cols_alive == 1) {
+	ws.alive[i] = ws.alive[n+j] = false; rows_alive = cols_alive = 0;
+      } else if (cols_alive == 1 || (rows_alive > 1 && s <= d)) {
+	ws.alive[i] = false; --rows_alive;
+      } else {
+	ws.alive[n+j] = false; --cols_alive;
+      }
+    }
+  }
+
+  inline int _find_root(std::vector<int> &root, int x) {
+    while (root[x] != x) x = root[x] = root[root[x]];
+    return x;
+  }
+
+  /* the spanning tree of the cells taken in the sorted order, so that by
+   * reduced costs the optimal basis of a similar problem comes first */
+  void _init_spanning_tree(_TransportWorkspace &ws, const int n, const int m) {
+    const int nm = n*m, num_nodes = n+m;
+    std::vector<int> &root = ws.parent;
+    root.resize(num_nodes);
+    for (int k=0; k<num_nodes; ++k) root[k] = k;
+    ws.arcs.clear();
+    for (int k=0; k<nm && (int) ws.arcs.size() < num_nodes - 1; ++k) {
+      const int i = ws.order[k] % n, j = ws.order[k] / n;
+      const int ri = _find_root(root, i), rj = _find_root(root, n+j);
+      if (ri == rj) continue;
+      root[ri] = rj;
+      _TransportArc arc;
+      arc.row = i; arc.col = j; arc.flow = 0;
+      ws.arcs.push_back(arc);
+    }
+  }
+
+  /* compute the unique flows of the spanning tree ws.arcs by eliminating
+   * leaves. Return false, with the supplies and demands intact, if the
+   * arcs do not form a spanning tree or the flows are not feasible. */
+  bool _init_tree_flows(_TransportWorkspace &ws, const int n, const int m, const double tol) {
+    const int num_nodes = n+m;
+    if ((int) ws.arcs.size() != num_nodes - 1) return false;
+    std::vector<int> &degree = ws.depth;
+    degree.assign(num_nodes, 0);
+    ws.adj.resize(num_nodes);
+    for (int k=0; k<num_nodes; ++k) ws.adj[k].clear();
+    for (int k=0; k<(int) ws.arcs.size(); ++k) {
+      const _TransportArc &arc = ws.arcs[k];
+      if (arc.row >= n || arc.col >= m) return false;
+      ws.adj[arc.row].push_back(k); ++degree[arc.row];
+      ws.adj[arc.col + n].push_back(k); ++degree[arc.col + n];
+    }
+    // the remaining supply of each node (demands of columns are negative)
+    std::vector<double> &rest = ws.cost_tmp;
+    rest.resize(num_nodes);
+    for (int i=0; i<n; ++i) rest[i] = ws.supply[i];
+    for (int j=0; j<m; ++j) rest[n+j] = -ws.demand[j];
+    std::vector<int> &leaves = ws.stack;
+    leaves.clear();
+    for (int k=0; k<num_nodes; ++k) if (degree[k] == 1) leaves.push_back(k);
+    ws.alive.assign(ws.arcs.size(), true);
+    int count = 0;
+    while (!leaves.empty()) {
+      const int x = leaves.back(); leaves.pop_back();
+      if (degree[x] != 1) continue;
+      int a = -1;
+      for (size_t t=0; t<ws.adj[x].size(); ++t) if (ws.alive[ws.adj[x][t]]) {a = ws.adj[x][t]; break;}
+      _TransportArc &arc = ws.arcs[a];
+      const int y = _other_end(arc, x, n);
+      // the flow from the row end to the column end
+      arc.flow = x < n ? rest[x] : -rest[x];
+      if (arc.flow < -tol) return false;
+      if (arc.flow < 0) arc.flow = 0;
+      rest[y] += rest[x];
+      rest[x] = 0;
+      ws.alive[a] = false;
+      --degree[x];
+      if (--degree[y] == 1) leaves.push_back(y);
+      ++count;
+    }
+    return count == num_nodes - 1;
+  }
+}
+
+struct d2_solver_context {
+  _TransportWorkspace ws;
+  size_t pivots = 0; ///< the number of pivots since the last reset
+};
+
+/* the context used by d2_match_by_distmat, one per thread */
+static thread_local d2_solver_context default_context;
+
+void d2_solver_setup() {
+}
+
+void d2_solver_release() {
+  _TransportWorkspace empty;
+  std::swap(default_context.ws, empty);
+}
+
+void d2_solver_debug() {
+}
+
+size_t d2_solver_get_pivots(d2_solver_context_t *ctx) {
+  return (ctx ? ctx : &default_context)->pivots;
+}
+
+void d2_solver_reset_pivots(d2_solver_context_t *ctx) {
+  (ctx ? ctx : &default_context)->pivots = 0;
+}
+
+d2_solver_context_t* d2_solver_context_create() {
+  return new d2_solver_context;
+}
+
+void d2_solver_context_release(d2_solver_context_t *ctx) {
+  delete ctx;
+}
+
+double d2_match_by_distmat(const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+			   __OUT__ SCALAR *x, __OUT__ SCALAR *lambda, size_t index) {
+  return d2_match_by_distmat_ctx(&default_context, n, m, C, wX, wY, x, lambda);
+}
+
+static double _match_by_distmat(d2_solver_context_t *ctx,
+				const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+				__OUT__ SCALAR *x, __IN_OUT__ SCALAR *lambda, const bool warm) {
+  _TransportWorkspace &ws = ctx->ws;
+  const int nm = n*m, num_nodes = n+m;
+  int i, j, k;
+  if (n <= 0 || m <= 0) return 0.0;
+
+  ws.cost.resize(nm);
+  ws.supply.resize(n);
+  ws.demand.resize(m);
+  double max_cost = 0.;
+  for (k=0; k<nm; ++k) {
+    ws.cost[k] = C[k];
+    max_cost = std::max(max_cost, fabs(ws.cost[k]));
+  }
+  for (i=0; i<n; ++i) ws.supply[i] = wX[i];
+  for (j=0; j<m; ++j) ws.demand[j] = wY[j];
+  const double tol = 1E-12 * (max_cost > 0 ? max_cost : 1.);
+
+  /* initial basic feasible tree: when warm started, the last basis of this
+   * context if it is still feasible, else the spanning tree by reduced costs,
+   * else the least-cost rule */
+  bool init = warm && ws.n == n && ws.m == m && _init_tree_flows(ws, n, m, tol);
+  if (!init) {
+    _sort_cells(ws, n, m, warm ? lambda : NULL);
+    if (warm) {
+      _init_spanning_tree(ws, n, m);
+      init = _init_tree_flows(ws, n, m, tol);
+    }
+    if (!init) _init_least_cost(ws, n, m);
+  }
+  ws.n = n; ws.m = m;
+  ws.adj.resize(num_nodes);
+  for (k=0; k<num_nodes; ++k) ws.adj[k].clear();
+  for (k=0; k<(int) ws.arcs.size(); ++k) {
+    ws.adj[ws.arcs[k].row].push_back(k);
+    ws.adj[ws.arcs[k].col + n].push_back(k);
+  }
+  ws.parent.resize(num_nodes);
+  ws.parent_arc.resize(num_nodes);
+  ws.depth.resize(num_nodes);
+  ws.pot.resize(num_nodes);
+  _hang_subtree(ws, n, 0, -1, -1);
+
+  /* primal simplex iterations */
+  const int block_size = std::max((int) sqrt((double) nm), std::min(nm, 16));
+  const size_t max_pivots = 100 * (size_t) nm + 1000;
+  size_t pivots = 0;
+  int pi = 0, pj = 0; // the pricing position
+  for (;;) {
+    /* block search for the entering arc */
+    double best = -tol;
+    int in_i = -1, in_j = -1, count = 0;
+    for (k=0; k<nm; ++k) {
+      const double r = ws.cost[pi + pj*n] - ws.pot[pi] - ws.pot[n+pj];
+      if (r < best) {best = r; in_i = pi; in_j = pj;}
+      if (++pi == n) {pi = 0; if (++pj == m) pj = 0;}
+      if (++count == block_size) {
+	if (in_i >= 0) break;
+	count = 0;
+      }
+    }
+    if (in_i < 0) break; // optimal
+
+    if (++pivots > max_pivots) {
+      fprintf(stderr, "d2_match_by_distmat: warning: maximum number of pivots (%zd) reached.\n", max_pivots);
+      break;
+    }
+
+    /* find the cycle closed by arc (in_i, in_j) */
+    int u = in_i, v = in_j + n;
+    ws.path_u.clear(); ws.path_v.clear();
+    while (ws.depth[u] > ws.depth[v]) {ws.path_u.push_back(ws.parent_arc[u]); u = ws.parent[u];}
+    while (ws.depth[v] > ws.depth[u]) {ws.path_v.push_back(ws.parent_arc[v]); v = ws.parent[v];}
+    while (u != v) {
+      ws.path_u.push_back(ws.parent_arc[u]); u = ws.parent[u];
+      ws.path_v.push_back(ws.parent_arc[v]); v = ws.parent[v];
+    }
+
+    /* arcs at odd distance from either end of the entering arc lose flow */
+    double theta = std::numeric_limits<double>::max();
+    int leaving = -1; bool leaving_on_u = true;
+    for (k=0; k<(int) ws.path_u.size(); k+=2) {
+      const double f = ws.arcs[ws.path_u[k]].flow;
+      if (f < theta) {theta = f; leaving = ws.path_u[k]; leaving_on_u = true;}
+    }
+    for (k=0; k<(int) ws.path_v.size(); k+=2) {
+      const double f = ws.arcs[ws.path_v[k]].flow;
+      if (f <= theta) {theta = f; leaving = ws.path_v[k]; leaving_on_u = false;}
+    }
+    for (k=0; k<(int) ws.path_u.size(); ++k)
+      ws.arcs[ws.path_u[k]].flow += (k % 2 == 0) ? -theta : theta;
+    for (k=0; k<(int) ws.path_v.size(); ++k)
+      ws.arcs[ws.path_v[k]].flow += (k % 2 == 0) ? -theta : theta;
+
+    /* replace the leaving arc by the entering arc and re-hang the cut subtree */
+    _TransportArc &arc = ws.arcs[leaving];
+    _remove_adj(ws.adj[arc.row], leaving);
+    _remove_adj(ws.adj[arc.col + n], leaving);
+    arc.row = in_i; arc.col = in_j; arc.flow = theta;
+    ws.adj[in_i].push_back(leaving);
+    ws.adj[in_j + n].push_back(leaving);
+    if (leaving_on_u)
+      _hang_subtree(ws, n, in_i, in_j + n, leaving);
+    else
+      _hang_subtree(ws, n, in_j + n, in_i, leaving);
+  }
+
+  /* collect primal and dual solutions */
+  double fval = 0.0;
+  if (x) for (k=0; k<nm; ++k) x[k] = 0;
+  for (k=0; k<(int) ws.arcs.size(); ++k) {
+    const _TransportArc &arc = ws.arcs[k];
+    fval += arc.flow * ws.cost[arc.row + arc.col * n];
+    if (x) x[arc.row + arc.col * n] = arc.flow;
+  }
+  if (lambda) for (k=0; k<num_nodes; ++k) lambda[k] = ws.pot[k];
+  ctx->pivots += pivots;
+
+  return fval;
+}
+
+double d2_match_by_distmat_ctx(d2_solver_context_t *ctx,
+			       const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+			       __OUT__ SCALAR *x, __OUT__ SCALAR *lambda) {
+  return _match_by_distmat(ctx ? ctx : &default_context, n, m, C, wX, wY, x, lambda, false);
+}
+
+double d2_match_by_distmat_warm(d2_solver_context_t *ctx,
+				const int n, const int m, const SCALAR *C, const SCALAR *wX, const SCALAR *wY,
+				__OUT__ SCALAR *x, __IN_OUT__ SCALAR *lambda) {
+  return _match_by_distmat(ctx ? ctx : &default_context, n, m, C, wX, wY, x, lambda, lambda != NULL);
+}
+
+
+/**
+ * Main codes ends and extra codes begins.
+ */
+
+double d2_match_by_distmat_qp(int n, int m,
+			      SCALAR *C, SCALAR *L, SCALAR rho,
+			      SCALAR *lw, SCALAR *rw,
+			      SCALAR *x0,
+			      /** OUT **/ SCALAR *x) {
+  fprintf(stderr, "d2_match_by_distmat_qp: error: QP is only supported by the MOSEK solver.\n");
+  return 0.0;
+}
+
+double d2_qpsimple(int n, int count, SCALAR *c, /** OUT **/ SCALAR *w) {
+  fprintf(stderr, "d2_qpsimple: error: QP is only supported by the MOSEK solver.\n");
+  return 0.0;
+}
@@ -4,6 +4,7 @@
 #include "../common/common.hpp"
 #include "../common/blas_like.h"
 #include "../common/cblas.h"
+#include "../common/d2_scratch.hpp"
 #include "lbfgs.h"
 #include <random>
 #include <assert.h>
@@ -38,14 +39,15 @@ namespace d2 {
 
     int fit(const real_t *X, const real_t *y, const real_t *sample_weight, const size_t n, bool sparse = false) {
 
+      internal::_Scratch scratch;
       // convert sparse data to dense
       real_t *XX, *yy, *ss;
       if (sparse) {
 	size_t nz = 0;
 	for (size_t i = 0; i<n; ++i) nz += sample_weight[i] > 0;
-	XX = new real_t [nz * dim];
-	yy = new real_t [nz];
-	ss = new real_t [nz];
+	XX = scratch.alloc<real_t>(nz * dim);
+	yy = scratch.alloc<real_t>(nz);
+	ss = scratch.alloc<real_t>(nz);
 	size_t count = 0;
 	for (size_t i = 0; i<n; ++i)
 	  if (sample_weight[i] > 0) {	  
@@ -64,18 +66,17 @@ namespace d2 {
 	this->sample_weight = sample_weight;
 	sample_size = n;
       }
-      cache= new real_t [n_class*sample_size + sample_size];
-      assert(sizeof(lbfgsfloatval_t) == sizeof(real_t));
-
       size_t N = n_class*dim+n_class;
+      // the last N entries keep the gradient, since lbfgsfloatval_t (double)
+      // can be wider than real_t
+      cache= scratch.alloc<real_t>(n_class*sample_size + sample_size + N);
+
       lbfgsfloatval_t fx;      
       lbfgsfloatval_t *x = lbfgs_malloc(N);
       lbfgs_parameter_t param;
       lbfgs_parameter_init(&param);
 
-      std::memcpy(x, coeff, sizeof(real_t) * N);
-      A = x;
-      b = x + n_class*dim;
+      for (size_t i=0; i<N; ++i) x[i] = coeff[i];
 
       current_lr = this;
       //int ret = lbfgs(N, x, &fx, evaluate_, progress_, NULL, &param);
@@ -83,23 +84,17 @@ namespace d2 {
       // printf("loss: %lf\n", fx);
       if (ret < 0) printf("L-BFGS optimization terminated with status code = %d\n", ret);
       
-      std::memcpy(coeff, x, sizeof(real_t) * N);
-      A = coeff;
-      b = coeff + n_class*dim;
+      for (size_t i=0; i<N; ++i) coeff[i] = x[i];
 
       lbfgs_free(x);
       current_lr = NULL;
-      delete [] cache;
-      if (sparse) {
-	delete [] XX;
-	delete [] yy;
-	delete [] ss;
-      }
+      cache = NULL;
       return ret;
     }
     void predict(const real_t *X, const size_t n, real_t *y) const {
-      real_t *v = new real_t[n*n_class];
-      real_t *sv= new real_t[n];
+      internal::_Scratch scratch;
+      real_t *v = scratch.alloc<real_t>(n*n_class);
+      real_t *sv= scratch.alloc<real_t>(n);
 
       forward_(A, b, X, n, v, sv);
       for (size_t i=0; i<n; ++i) {
@@ -112,8 +107,6 @@ namespace d2 {
 	  }
 	y[i] = kk;
       }
-      delete [] v;
-      delete [] sv;
     }
     /*
     real_t eval(const real_t *X, const real_t y) const {
@@ -170,32 +163,31 @@ namespace d2 {
     }
     */
     void evals(const real_t *X, const real_t *y, const size_t n, real_t *loss, const size_t leading, const size_t stride = 1) const {
-      real_t *v = new real_t[n*n_class];
-      real_t *sv= new real_t[n];
+      internal::_Scratch scratch;
+      real_t *v = scratch.alloc<real_t>(n*n_class);
+      real_t *sv= scratch.alloc<real_t>(n);
 
       forward_(A, b, X, n, v, sv);
       for (size_t i=0; i<n; ++i) {
 	loss[i*leading] = -log (v[i*n_class + (size_t) y[i*stride]]);
       }
-      delete [] v;
-      delete [] sv;
     }
     void evals_alllabel(const real_t *X, const size_t n, real_t *loss, const size_t leading, const size_t stride) const {
-      real_t *v = new real_t[n*n_class];
-      real_t *sv= new real_t[n];
+      internal::_Scratch scratch;
+      real_t *v = scratch.alloc<real_t>(n*n_class);
+      real_t *sv= scratch.alloc<real_t>(n);
 
       forward_(A, b, X, n, v, sv);
       for (size_t i=0; i<n; ++i) {
 	for (size_t j=0; j<n_class; ++j)
 	  loss[i*leading+j*stride] = -log (v[i*n_class + j]);
       }
-      delete [] v;
-      delete [] sv;
     }
     
     void evals_min(const real_t *X, const size_t n, real_t *loss, const size_t leading) const {
-      real_t *v = new real_t[n*n_class];
-      real_t *sv= new real_t[n];
+      internal::_Scratch scratch;
+      real_t *v = scratch.alloc<real_t>(n*n_class);
+      real_t *sv= scratch.alloc<real_t>(n);
 
       forward_(A, b, X, n, v, sv);
       for (size_t i=0; i<n; ++i) {
@@ -204,8 +196,6 @@ namespace d2 {
 	  if (max_prob < v[j]) max_prob = v[j];
 	loss[i*leading] = -log (max_prob);
       }
-      delete [] v;
-      delete [] sv;
     }
 
 #ifdef RABIT_RABIT_H_    
@@ -248,7 +238,7 @@ namespace d2 {
       real_t *sv= cache + n*n_class;
       real_t *gradA = grad;
       real_t *gradb = grad + n_class * dim;
-      real_t loss = 0.0;
+      double loss = 0.0;
 
       forward_(A, b, X, n, v, sv);
       real_t sample_wsum;
@@ -314,8 +304,11 @@ namespace d2 {
 			      ) {
       int i;
       lbfgsfloatval_t fx;
+      real_t *grad = current_lr->cache + (n_class + 1) * current_lr->sample_size;
 
-      fx = current_lr->gradient_(g);
+      for (i=0; i<n; ++i) current_lr->coeff[i] = x[i];
+      fx = current_lr->gradient_(grad);
+      for (i=0; i<n; ++i) g[i] = grad[i];
 	
       return fx;
     }
@@ -20,6 +20,7 @@ namespace d2 {
       real_t termination_tol = 5E-5;
       bool   bootstrap = false; ///< whether using bootstrap samples to initialize classifers
       bool   communicate = false;
+      bool   compact = false; ///< whether to keep only the plan and the multipliers, and recompute the cost in every badmm iteration
     };
   }
   
@@ -63,8 +64,9 @@ namespace d2 {
       for (size_t jj=0; jj<data.get_col(); ++jj) {
 	C[ii + jj*learner.len] += param.beta * Ctmp[jj + ii*data.get_col()];
       }
+    // the matching does not depend on the class
+    EMD(learner, data, NULL, C, Pi, NULL, true);
     for (size_t i=0; i<LearnerType::NUMBER_OF_CLASSES; ++i) {
-      EMD(learner, data, NULL, C, Pi, NULL, true);
       _pdist2_label(predictor.supp, predictor.len,
 		    data.get_support_ptr(), i, data.get_col(),
 		    data.meta, Cnew);
@@ -77,7 +79,7 @@ namespace d2 {
       real_t *pp = Pi;
       for (size_t ii=0; ii<data.get_size(); ++ii) {
 	size_t matsize = data[ii].len * learner.len;
-	ee[ii] = _D2_CBLAS_FUNC(dot)(matsize, pp, 1, cc, 1);
+	ee[ii] = _D2_CBLAS_DOT(matsize, pp, 1, cc, 1);
 	pp += matsize;
 	cc += matsize;
       }
@@ -147,6 +149,9 @@ namespace d2 {
       assert((write_label && scores) || !write_label);
       emds = new real_t [data.get_size() * LearnerType::NUMBER_OF_CLASSES];
     }
+    // cost matrices of different classes share the matchmaker part, so
+    // each class starts from the duals of the previous one
+    real_t *dual = new real_t [data.get_col() + data.get_size() * learner.len];
     _pdist2_alllabel(&matchmaker, 1, data.get_support_ptr(), data.get_col(), data.meta, Ctmp);
     for (size_t i=0; i<LearnerType::NUMBER_OF_CLASSES; ++i) {
       _pdist2_label(learner.supp, learner.len,
@@ -156,8 +161,9 @@ namespace d2 {
 	for (size_t jj=0; jj<data.get_col(); ++jj) {
 	  C[ii + jj*learner.len] += param.beta * Ctmp[jj + ii*data.get_col()];
 	}
-      EMD(learner, data, emds + data.get_size() * i, C, NULL, NULL, true);
+      EMD(learner, data, emds + data.get_size() * i, C, NULL, dual, true, NULL, i > 0);
     }
+    delete [] dual;
 
 
     real_t accuracy = 0.0;    
@@ -346,6 +352,25 @@ namespace d2 {
     }
 #endif
 
+    /*!
+     * \brief the columns [col, col+n) of data in the dense form of
+     * get_dense_if_need, built in scratch if need
+     */
+    template <size_t D>
+    const real_t* _get_dense_cols(const Block<Elem<def::WordVec, D> > &data,
+				  size_t col, size_t n, _Scratch &scratch) {
+      real_t *X = scratch.alloc<real_t>(D * n);
+      for (size_t i=0; i<n; ++i)
+	std::memcpy(X + i*D, &data.meta.embedding[D*data.get_support_ptr()[col + i]], D * sizeof(real_t));
+      return X;
+    }
+
+    template <size_t D>
+    const real_t* _get_dense_cols(const Block<Elem<def::Euclidean, D> > &data,
+				  size_t col, size_t n, _Scratch &scratch) {
+      return data.get_support_ptr() + D * col;
+    }
+
     template <typename ElemType>
     size_t _get_sample_size(const Block<ElemType> &data, size_t num_of_copies)
     {return data.get_col();}
@@ -420,17 +445,17 @@ namespace d2 {
     internal::BADMMCache badmm_cache_arr;
     real_t rho = param.rho;
     //assert(learner.len > 1);
-    allocate_badmm_cache(learner, data, badmm_cache_arr);
+    // the cost goes tile by tile into Ctmp, and then to its exponential for
+    // all badmm iterations of an outer iteration, unless it is recomputed
+    allocate_badmm_cache(learner, data, badmm_cache_arr, false, !param.compact);
     
     // initialization
     for (size_t j=0; j<data.get_col() * learner.len; ++j)
       badmm_cache_arr.Lambda[j] = 0;
 
     for (size_t k=0, l=0; k<data.get_col(); ++k)
-      for (size_t j=0; j<learner.len; ++j, ++l) {
+      for (size_t j=0; j<learner.len; ++j, ++l)
 	badmm_cache_arr.Pi2[l] = data.get_weight_ptr()[k] * learner.w[j];
-	badmm_cache_arr.Pi1[l] = badmm_cache_arr.Pi2[l];
-      }
 
     real_t prim_res = 1., dual_res = 1., totalC = 0.;
     real_t old_prim_res, old_dual_res, old_totalC;
@@ -456,8 +481,9 @@ namespace d2 {
 	std::cout << "Initializing parameters using bootstrap samples ... " << std::endl;
       }  
       const size_t sample_size = internal::_get_sample_size(data, LearnerType::NUMBER_OF_CLASSES);
-      real_t *bootstrap_weight = new real_t[sample_size];
-      real_t *sample_weight = new real_t[sample_size];
+      internal::_Scratch scratch;
+      real_t *bootstrap_weight = scratch.alloc<real_t>(sample_size);
+      real_t *sample_weight = scratch.alloc<real_t>(sample_size);
       internal::_get_sample_weight(data, badmm_cache_arr.Pi2, learner.len, sample_weight, sample_size);
       for (size_t j=0, old_j=0; j<learner.len; ++j) {
 	if (j % rabit::GetWorldSize() == rabit::GetRank()) {
@@ -480,8 +506,6 @@ namespace d2 {
 	  old_j = j+1;
 	}
       }
-      delete [] sample_weight;
-      delete [] bootstrap_weight;
     }
     
     if (GetRank() == 0) {
@@ -495,29 +519,39 @@ namespace d2 {
 		<< "va_acc  " << std::endl;
     }    
 
-    real_t loss;
-    real_t train_accuracy_1, train_accuracy_2, validate_accuracy_1, validate_accuracy_2;
-    for (size_t iter=0; iter < param.max_iter; ++iter) {
-      /* ************************************************
-       * compute cost matrix
-       */
+    // the cost of the columns [col, col+n) of data in the current iteration,
+    // as a learner.len x n matrix
+    size_t iter;
+    auto cost = [&](size_t col, size_t n, real_t *C) {
       _pdist2(learner.supp, learner.len,
-	      data.get_support_ptr(), data.get_col(),
-	      data.meta, badmm_cache_arr.C);
-
+	      data.get_support_ptr() + ElemType::T::step_stride(col, ElemType::D), n,
+	      data.meta, C);
       if (iter > 0) {
-	real_t *X_tmp;
-	internal::get_dense_if_need(data, &X_tmp);
-	matchmaker.evals_alllabel(X_tmp, data.get_col(), badmm_cache_arr.Ctmp,
+	internal::_Scratch scratch;
+#ifdef _USE_SPARSE_ACCELERATE_
+	const real_t *X_tile = internal::_get_dense_cols(data, col, n, scratch);
+#else
+	const real_t *X_tile = X + col * ElemType::D;
+#endif
+	real_t *C_mm = scratch.alloc<real_t>(n * learner.len);
+	matchmaker.evals_alllabel(X_tile, n, C_mm,
 				  MatchmakerType::NUMBER_OF_CLASSES, 1);
-	internal::release_dense_if_need(data, &X_tmp);
-
-	for (size_t i=0; i<data.get_col() * learner.len; ++i)
-	  badmm_cache_arr.C[i] += param.beta * badmm_cache_arr.Ctmp[i];
+	for (size_t i=0; i<n * learner.len; ++i) C[i] += param.beta * C_mm[i];
       } else {
-	for (size_t i=0; i<data.get_col() * learner.len; ++i)
-	  badmm_cache_arr.C[i] -= param.beta * log(1./learner.len);
+	for (size_t i=0; i<n * learner.len; ++i) C[i] -= param.beta * log(1./learner.len);
       }
+    };
+
+    real_t loss, asumC;
+    real_t train_accuracy_1, train_accuracy_2, validate_accuracy_1, validate_accuracy_2;
+    for (iter=0; iter < param.max_iter; ++iter) {
+      /* ************************************************
+       * compute cost matrix
+       */
+      // the tiles are only summed in the compact mode, and recomputed in
+      // every badmm iteration
+      internal::_BADMM_cost_sums(learner, data, badmm_cache_arr, cost, &asumC, &loss,
+				 param.compact ? NULL : badmm_cache_arr.Ctmp);
       /* ************************************************
        * rescale badmm parameters
        */
@@ -525,7 +559,7 @@ namespace d2 {
 	old_totalC = totalC * rho;
 	if (prim_res < 0.5 *dual_res) { rho /=2;}
 	if (dual_res < 0.5 *prim_res) { rho *=2;}
-	totalC = _D2_CBLAS_FUNC(asum)(data.get_col() * learner.len, badmm_cache_arr.C, 1);
+	totalC = asumC;
 	Allreduce<op::Sum>(&totalC, 1);
 	totalC /= global_col * learner.len;
       }
@@ -534,17 +568,18 @@ namespace d2 {
 	old_totalC = 0;
       }
       
-      _D2_CBLAS_FUNC(scal)(data.get_col() * learner.len, 1./ (rho*totalC), badmm_cache_arr.C, 1);
       _D2_CBLAS_FUNC(scal)(data.get_col() * learner.len, old_totalC / (totalC * rho), badmm_cache_arr.Lambda, 1);
+      // the exponential of the cost is the same for all badmm iterations below
+      if (!param.compact)
+	internal::_badmm_exp_cost(data.get_col() * learner.len, badmm_cache_arr.Ctmp,
+				  badmm_cache_arr.Ctmp, 1./ (rho*totalC));
 
       /* ************************************************
        * compute current loss
        */
-      loss = _D2_CBLAS_FUNC(dot)(data.get_col() * learner.len,
-				 badmm_cache_arr.C, 1,
-				 badmm_cache_arr.Pi2, 1);
+      // the loss of the unscaled cost, summed along with asumC
       Allreduce<op::Sum>(&loss, 1);
-      loss = loss / global_size * totalC * rho;
+      loss = loss / global_size;
 
 
       /* ************************************************
@@ -580,25 +615,14 @@ namespace d2 {
       prim_res = 0;
       dual_res = 0;
       for (size_t badmm_ii = 0; badmm_ii < param.badmm_iter; ++badmm_ii) {
-	internal::BADMMCache badmm_cache_ptr = badmm_cache_arr;
-	for (size_t i=0; i<data.get_size();++i) {
-	  const size_t matsize = data[i].len * learner.len;
-	  real_t p_res, d_res;
-	  EMD_BADMM(learner, data[i], badmm_cache_ptr, 1, &p_res, &d_res);
-
-	  badmm_cache_ptr.C += matsize;
-	  badmm_cache_ptr.Ctmp += matsize;
-	  badmm_cache_ptr.Pi1 += matsize;
-	  badmm_cache_ptr.Pi2 += matsize;
-	  badmm_cache_ptr.Lambda += matsize;
-	  badmm_cache_ptr.Ltmp += matsize;
-	  badmm_cache_ptr.buffer += matsize;
-	  badmm_cache_ptr.Pi_buffer += matsize;
-	  badmm_cache_ptr.w_sync += learner.len;
-
-	  prim_res += p_res;
-	  dual_res += d_res;
-	}
+	real_t p_res, d_res;
+	if (param.compact)
+	  internal::_BADMM_sweep_tiled(learner, data, badmm_cache_arr, cost, 1./ (rho*totalC),
+				       1, &p_res, &d_res);
+	else
+	  internal::_BADMM_sweep(learner, data, badmm_cache_arr, 1, &p_res, &d_res);
+	prim_res += p_res;
+	dual_res += d_res;
 
 	// w update by rule 2
 	for (size_t i=0; i<data.get_size() * learner.len; ++i) {
@@ -626,8 +650,9 @@ namespace d2 {
       /* ************************************************
        * re-fit classifiers (matchmaker)
        */
+      internal::_Scratch scratch;
       const size_t sample_size_mm = internal::_get_sample_size_mm(data, MatchmakerType::NUMBER_OF_CLASSES);
-      real_t *sample_weight_mm = new real_t[sample_size_mm];
+      real_t *sample_weight_mm = scratch.alloc<real_t>(sample_size_mm);
       internal::_get_sample_weight_mm(data, badmm_cache_arr.Pi2, learner.len, sample_weight_mm, sample_size_mm);
       int err_code = 0;
 #ifdef _USE_SPARSE_ACCELERATE_
@@ -639,7 +664,6 @@ namespace d2 {
       matchmaker.sync(0);
 #endif
       assert(err_code >= 0);
-      delete [] sample_weight_mm;
 
       
       /* ************************************************
@@ -647,11 +671,12 @@ namespace d2 {
        */
       const size_t sample_size = internal::_get_sample_size(data, LearnerType::NUMBER_OF_CLASSES);
 #ifdef _USE_SPARSE_ACCELERATE_      
-      real_t *sample_weight_local = new real_t[sample_size];
+      real_t *sample_weight_local = scratch.alloc<real_t>(sample_size);
 #endif
+      // the weights of one learner at a time, which fit() only reads
+      real_t *sample_weight = scratch.alloc<real_t>(sample_size);
       for (size_t i=0, old_i=0; i<learner.len; ++i)
       {
-	real_t *sample_weight = new real_t[sample_size];
 	internal::_get_sample_weight(data, badmm_cache_arr.Pi2 + i, learner.len, sample_weight, sample_size);
 	//learner.supp[i].init();
 #ifdef _USE_SPARSE_ACCELERATE_      
@@ -703,12 +728,8 @@ namespace d2 {
 	  printf("\b\b\b\b\b\b\b%3zd/%3zd", (i+1), learner.len);
 	  fflush(stdout);
 	}	  	
-	delete [] sample_weight;
 
       }
-#ifdef _USE_SPARSE_ACCELERATE_      
-      delete [] sample_weight_local;
-#endif
       Barrier();
       
       
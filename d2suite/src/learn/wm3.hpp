@@ -89,6 +89,9 @@ namespace d2 {
     Allreduce<op::Sum>(&mC, 1);
     mC /= (data.get_col() * m) * rabit::GetWorldSize();
 #endif
+    // the duals of the objective evaluation, from which the next one starts
+    std::vector<real_t> obj_dual(m*n + data.get_col());
+    bool obj_warm = false;
     int avg_iterations = 0;
     for (size_t iter=0, accelerator=1; iter < max_epoch; ++iter) {  
       sac_b = sac;
@@ -186,9 +189,11 @@ namespace d2 {
 			     beta, K,
 			     0.0,
 			     mixture_data.get_weight_ptr(), m);    
-	for (size_t i=0; i<n; ++i) {    
-	  emds[i]=EMD(mixture_data[i], data[i], data.meta, cache_mat);
+	for (size_t i=0, offset=0; i<n; offset += m + data[i].len, ++i) {    
+	  emds[i]=EMD(mixture_data[i], data[i], data.meta, cache_mat, NULL, &obj_dual[offset],
+		      false, NULL, obj_warm);
 	}
+	obj_warm = true;
 	obj_old=obj;
 	obj = _D2_CBLAS_FUNC(asum)(n, emds, 1);
 #ifdef RABIT_RABIT_H_
@@ -205,8 +210,8 @@ namespace d2 {
       }
       
 
-      dual_obj = _D2_CBLAS_FUNC(dot)(n*m, sac._dual1, 1, mixture_data.get_weight_ptr(), 1) - _D2_CBLAS_FUNC(dot)(data.get_col(), sac._dual2, 1, data.get_weight_ptr(), 1);
-      db_obj = _D2_CBLAS_FUNC(dot)(n*m, sac._U, 1, mixture_data.get_weight_ptr(), 1) - _D2_CBLAS_FUNC(dot)(data.get_col(), sac._L, 1, data.get_weight_ptr(), 1);
+      dual_obj = _D2_CBLAS_DOT(n*m, sac._dual1, 1, mixture_data.get_weight_ptr(), 1) - _D2_CBLAS_DOT(data.get_col(), sac._dual2, 1, data.get_weight_ptr(), 1);
+      db_obj = _D2_CBLAS_DOT(n*m, sac._U, 1, mixture_data.get_weight_ptr(), 1) - _D2_CBLAS_DOT(data.get_col(), sac._L, 1, data.get_weight_ptr(), 1);
 #ifdef RABIT_RABIT_H_
       Allreduce<op::Sum>(&dual_obj, 1);      
       Allreduce<op::Sum>(&db_obj, 1);      
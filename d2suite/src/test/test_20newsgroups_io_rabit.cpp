@@ -10,26 +10,34 @@ int main(int argc, char** argv) {
   size_t len = 100, size=20000;
   std::string filename("data/20newsgroups/20newsgroups_clean/20newsgroups.d2s");
 
-  /* load full data */
-  BlockMultiPhase<Elem<def::WordVec, 100> > data_retrieve (size, &len);
-  data_retrieve.read(filename, size);
+  /* load full data, from which queries are taken */
+  BlockMultiPhase<Elem<def::WordVec, 100> > data_query (size, &len);
+  data_query.read(filename, size);
 
   /* load distributed data*/
-  DistributedBlockMultiPhase<Elem<def::WordVec, 100> > data_query (size, &len);
-  data_query.read(filename, size);
+  DistributedBlockMultiPhase<Elem<def::WordVec, 100> > data_retrieve (size, &len);
+  data_retrieve.read(filename, size);
 
-  // test nearest neighbors (simple)
-  std::vector<real_t> emds(data_retrieve.get_size());
-  std::vector<index_t> ranks(data_retrieve.get_size());
+  auto & block0 = data_query.get_block<0>();
+  auto & block1 = data_retrieve.get_block<0>();
+  const size_t k = 2, nq = 10;
+  std::vector<real_t> dists(k);
+  std::vector<index_t> ids(k);
 
+  // nearest neighbors of the first entries of the query queue, with the
+  // retrieval database partitioned across workers
   double startTime = getRealTime();
-  //  for (int i=0; i<data_query.get_size(); ++i) {
-  int i=0; // select the first entry from query queue
-    auto & block0 = data_query.get_block<0>();
-    auto & block1 = data_retrieve.get_block<0>();
-    std::cout << getLogHeader()  << "number of EMDs: " << KNearestNeighbors_Simple(2, block0[i], block1, &emds[0], &ranks[0]) << std::endl;
-    //  }
+  size_t count = 0;
+  for (size_t i=0; i<nq; ++i) {
+    count += KNearestNeighbors_Distributed(k, block0[i], block1, &dists[0], &ids[0]);
+    if (rabit::GetRank() == 0)
+      std::cout << getLogHeader() << " query #" << i << ": nearest neighbor #" << ids[0]
+		<< " at " << dists[0] << ", #" << ids[1] << " at " << dists[1] << std::endl;
+  }
   double totalTime = getRealTime() - startTime;
+  if (rabit::GetRank() == 0)
+    std::cout << getLogHeader() << " number of EMDs: " << count << " in "
+	      << totalTime << "s" << std::endl;
 
   server::Finalize();
   return 0;
@@ -0,0 +1,251 @@
+#include "../common/d2.hpp"
+#include "../common/d2_badmm.hpp"
+#include <vector>
+#include <random>
+#include <limits>
+
+using namespace d2;
+
+/* the BADMM iterations as separate passes over full matrices */
+template <typename ElemType1, typename ElemType2>
+void BADMM_reference(const ElemType1 &a, const ElemType2 &b, const real_t *C,
+		     real_t *Pi2, real_t *Lambda, real_t *w_sync, size_t niter,
+		     real_t *prim_res, real_t *dual_res) {
+  const size_t mat_size = a.len * b.len;
+  std::vector<real_t> Ctmp(mat_size), Ltmp(mat_size), Pi1(mat_size), Pi_buffer(mat_size),
+    buffer(std::max(a.len, b.len));
+  for (size_t i=0; i<mat_size; ++i) Ctmp[i] = exp(C[i]);
+  for (size_t iter=0; iter < niter; ++iter) {
+    for (size_t i=0; i<mat_size; ++i) Pi_buffer[i] = Pi2[i];
+    for (size_t i=0; i<mat_size; ++i) Ltmp[i] = exp(Lambda[i]);
+    for (size_t i=0; i<mat_size; ++i) Pi1[i] = Pi2[i] / Ltmp[i] + eps;
+    real_t w_sync_sum;
+    _D2_FUNC(rsum)(a.len, b.len, &Pi1[0], w_sync);
+    _D2_FUNC(cnorm)(a.len, 1, w_sync, &w_sync_sum);
+    _D2_FUNC(rnorm)(a.len, b.len, &Pi1[0], &buffer[0]);
+    _D2_FUNC(gcms)(a.len, b.len, &Pi1[0], a.w);
+    for (size_t i=0; i<mat_size; ++i) Pi2[i] = Pi1[i] * Ltmp[i] / Ctmp[i] + eps;
+    _D2_FUNC(cnorm)(a.len, b.len, Pi2, &buffer[0]);
+    _D2_FUNC(grms)(a.len, b.len, Pi2, b.w);
+    for (size_t i=0; i<mat_size; ++i) Lambda[i] += Pi1[i] - Pi2[i];
+  }
+  real_t Pi2_norm = 0;
+  *prim_res = 0; *dual_res = 0;
+  for (size_t i=0; i<mat_size; ++i) {
+    Pi2_norm += fabs(Pi2[i]);
+    *prim_res += fabs(Pi1[i] - Pi2[i]);
+    *dual_res += fabs(Pi_buffer[i] - Pi2[i]);
+  }
+  *prim_res /= Pi2_norm; *dual_res /= Pi2_norm;
+}
+
+static real_t max_rel_diff(const std::vector<real_t> &x, const std::vector<real_t> &y) {
+  real_t err = 0;
+  for (size_t i=0; i<x.size(); ++i)
+    err = std::max(err, std::fabs(x[i] - y[i]) / std::max(std::fabs(y[i]), (real_t) 1E-3));
+  return err;
+}
+
+/* run BADMM on pairs of the test data, with the fused iterations and with
+ * the reference ones, and compare plans, multipliers and residuals */
+int main(int argc, char** argv) {
+  bool pass = true;
+  const size_t size = 100, len = 8, calls = 20;
+  const real_t tol = std::numeric_limits<real_t>::epsilon() < 1E-10 ? 1E-9 : 1E-3;
+
+  Block<Elem<def::Euclidean, 3> > data (size, len);
+  data.read("data/test/euclidean_testdata.d2", size);
+  const Elem<def::Euclidean, 3> &a = data[0];
+
+  internal::BADMMCache cache;
+  internal::allocate_badmm_cache(a, data, cache);
+  const size_t n = data.get_col() * a.len;
+  std::vector<real_t> Pi2_ref(n), Lambda_ref(n, 0), w_sync_ref(a.len * size);
+  for (size_t i=0, l=0; i<size; ++i) {
+    const size_t offset = data[i].w - data.get_weight_ptr();
+    internal::_pdist2(a.supp, a.len, data[i].supp, data[i].len, data.meta, cache.C + offset * a.len);
+    for (size_t k=0; k<data[i].len; ++k)
+      for (size_t j=0; j<a.len; ++j, ++l) {
+	cache.C[l] /= 10.;
+	Pi2_ref[l] = cache.Pi2[l] = data[i].w[k] * a.w[j];
+	cache.Lambda[l] = 0;
+      }
+  }
+
+  real_t max_err = 0;
+  double time_fused = 0, time_ref = 0;
+  for (size_t c=0; c<calls; ++c) {
+    const size_t niter = c % 4 + 1;
+    real_t prim = 0, dual = 0, prim_ref = 0, dual_ref = 0;
+    double startTime = getRealTime();
+    internal::BADMMCache ptr = cache;
+    for (size_t i=0; i<size; ++i) {
+      const size_t matsize = a.len * data[i].len;
+      real_t p_res, d_res;
+      EMD_BADMM(a, data[i], ptr, niter, &p_res, &d_res);
+      prim += p_res; dual += d_res;
+      ptr.C += matsize; ptr.Ctmp += matsize; ptr.Pi2 += matsize; ptr.Lambda += matsize;
+      ptr.w_sync += a.len;
+    }
+    time_fused += getRealTime() - startTime;
+
+    startTime = getRealTime();
+    for (size_t i=0, l=0; i<size; ++i) {
+      real_t p_res, d_res;
+      BADMM_reference(a, data[i], cache.C + l, &Pi2_ref[l], &Lambda_ref[l], &w_sync_ref[i * a.len],
+		      niter, &p_res, &d_res);
+      prim_ref += p_res; dual_ref += d_res;
+      l += a.len * data[i].len;
+    }
+    time_ref += getRealTime() - startTime;
+
+    max_err = std::max(max_err, std::fabs(prim - prim_ref) / prim_ref);
+    max_err = std::max(max_err, std::fabs(dual - dual_ref) / dual_ref);
+  }
+  max_err = std::max(max_err, max_rel_diff(std::vector<real_t>(cache.Pi2, cache.Pi2 + n), Pi2_ref));
+  max_err = std::max(max_err, max_rel_diff(std::vector<real_t>(cache.Lambda, cache.Lambda + n), Lambda_ref));
+  max_err = std::max(max_err, max_rel_diff(std::vector<real_t>(cache.w_sync, cache.w_sync + a.len * size), w_sync_ref));
+
+  std::cerr << "fused BADMM\tmax relative difference: " << max_err
+	    << "\t" << time_fused << "s (fused) " << time_ref << "s (reference)" << std::endl;
+  if (!(max_err < tol)) pass = false;
+
+  /* sweep over the block on 1 and on 4 threads from the same state; the
+   * results must be identical */
+  {
+    const std::vector<real_t> Pi2(cache.Pi2, cache.Pi2 + n), Lambda(cache.Lambda, cache.Lambda + n);
+    std::vector<real_t> Pi2_out[2], Lambda_out[2], w_sync_out[2];
+    real_t prim[2], dual[2];
+    double totalTime[2];
+    const size_t num_threads[2] = {1, 4};
+    internal::_badmm_exp_cost(n, cache.C, cache.Ctmp);
+    for (size_t t=0; t<2; ++t) {
+      std::copy(Pi2.begin(), Pi2.end(), cache.Pi2);
+      std::copy(Lambda.begin(), Lambda.end(), cache.Lambda);
+      server::SetNumThreads(num_threads[t]);
+      double startTime = getRealTime();
+      internal::_BADMM_sweep(a, data, cache, 3, &prim[t], &dual[t]);
+      totalTime[t] = getRealTime() - startTime;
+      server::SetNumThreads(1);
+      Pi2_out[t].assign(cache.Pi2, cache.Pi2 + n);
+      Lambda_out[t].assign(cache.Lambda, cache.Lambda + n);
+      w_sync_out[t].assign(cache.w_sync, cache.w_sync + a.len * size);
+      std::cerr << "BADMM sweep with " << num_threads[t] << " thread(s)\t" << totalTime[t] << "s" << std::endl;
+    }
+    if (prim[0] != prim[1] || dual[0] != dual[1] || Pi2_out[0] != Pi2_out[1] ||
+	Lambda_out[0] != Lambda_out[1] || w_sync_out[0] != w_sync_out[1]) pass = false;
+  }
+
+  /* the same sweep with the cost recomputed tile by tile in a compact
+   * cache; the results must be identical to those of the full cache, and
+   * on 1 and on 4 threads */
+  {
+    const real_t scale = .5;
+    const std::vector<real_t> Pi2(cache.Pi2, cache.Pi2 + n), Lambda(cache.Lambda, cache.Lambda + n);
+    for (size_t i=0; i<n; ++i) cache.Ctmp[i] = -(cache.C[i] * scale);
+    _D2_FUNC(exp)(n, cache.Ctmp);
+    real_t prim_ref, dual_ref;
+    internal::_BADMM_sweep(a, data, cache, 3, &prim_ref, &dual_ref);
+
+    internal::BADMMCache compact;
+    internal::allocate_badmm_cache(a, data, compact, false, false);
+    auto cost = [&](size_t col, size_t num, real_t *C) {
+      std::copy(cache.C + col * a.len, cache.C + (col + num) * a.len, C);
+    };
+    const size_t num_threads[2] = {1, 4};
+    for (size_t t=0; t<2; ++t) {
+      std::copy(Pi2.begin(), Pi2.end(), compact.Pi2);
+      std::copy(Lambda.begin(), Lambda.end(), compact.Lambda);
+      server::SetNumThreads(num_threads[t]);
+      real_t prim, dual;
+      double startTime = getRealTime();
+      internal::_BADMM_sweep_tiled(a, data, compact, cost, scale, 3, &prim, &dual);
+      std::cerr << "tiled BADMM sweep with " << num_threads[t] << " thread(s)\t"
+		<< getRealTime() - startTime << "s" << std::endl;
+      server::SetNumThreads(1);
+      if (prim != prim_ref || dual != dual_ref ||
+	  !std::equal(compact.Pi2, compact.Pi2 + n, cache.Pi2) ||
+	  !std::equal(compact.Lambda, compact.Lambda + n, cache.Lambda) ||
+	  !std::equal(compact.w_sync, compact.w_sync + a.len * size, cache.w_sync)) pass = false;
+    }
+
+    real_t asum, dot, asum_ref = 0, dot_ref = 0;
+    internal::_BADMM_cost_sums(a, data, compact, cost, &asum, &dot);
+    for (size_t i=0; i<n; ++i) {asum_ref += std::fabs(cache.C[i]); dot_ref += cache.C[i] * cache.Pi2[i];}
+    if (!(std::fabs(asum - asum_ref) < tol * asum_ref && std::fabs(dot - dot_ref) < tol * dot_ref)) pass = false;
+    // the same sums with the tiles kept, as a full cost matrix
+    std::vector<real_t> C(n);
+    real_t asum_kept, dot_kept;
+    internal::_BADMM_cost_sums(a, data, compact, cost, &asum_kept, &dot_kept, &C[0]);
+    if (asum_kept != asum || dot_kept != dot || !std::equal(C.begin(), C.end(), cache.C)) pass = false;
+    internal::deallocate_badmm_cache(compact);
+  }
+  internal::deallocate_badmm_cache(cache);
+
+  /* a block of elements of the same length goes in batches; compare with
+   * the iterations element by element, and on 1 and on 4 threads */
+  {
+    const size_t num = 5000, n = 3;
+    std::mt19937 rnd_gen(0);
+    std::uniform_real_distribution<real_t> unif(0.1, 1.);
+    Block<Elem<def::Euclidean, 3> > uniform (num, n);
+    uniform.initialize(num, n);
+    for (size_t i=0; i<num; ++i) {
+      real_t sum = 0;
+      for (size_t j=0; j<n; ++j) sum += (uniform[i].w[j] = unif(rnd_gen));
+      for (size_t j=0; j<n; ++j) uniform[i].w[j] /= sum;
+    }
+    const size_t n_all = num * n * a.len;
+    std::vector<real_t> expC(n_all), Pi2(n_all), Lambda(n_all, 0), w_sync(num * a.len);
+    for (auto &x : expC) x = exp(-unif(rnd_gen));
+    for (size_t i=0, l=0; i<num; ++i)
+      for (size_t j=0; j<n; ++j)
+	for (size_t k=0; k<a.len; ++k, ++l) Pi2[l] = uniform[i].w[j] * a.w[k];
+
+    internal::BADMMCache batch_cache;
+    internal::allocate_badmm_cache(a, uniform, batch_cache);
+    std::vector<real_t> Pi2_out[2], Lambda_out[2];
+    real_t prim[2], dual[2];
+    const size_t num_threads[2] = {1, 4};
+    for (size_t t=0; t<2; ++t) {
+      std::copy(expC.begin(), expC.end(), batch_cache.Ctmp);
+      std::copy(Pi2.begin(), Pi2.end(), batch_cache.Pi2);
+      std::copy(Lambda.begin(), Lambda.end(), batch_cache.Lambda);
+      server::SetNumThreads(num_threads[t]);
+      double startTime = getRealTime();
+      for (size_t r=0; r<5; ++r)
+	internal::_BADMM_sweep(a, uniform, batch_cache, 2, &prim[t], &dual[t]);
+      std::cerr << "batched BADMM sweeps with " << num_threads[t] << " thread(s)\t"
+		<< getRealTime() - startTime << "s" << std::endl;
+      server::SetNumThreads(1);
+      Pi2_out[t].assign(batch_cache.Pi2, batch_cache.Pi2 + n_all);
+      Lambda_out[t].assign(batch_cache.Lambda, batch_cache.Lambda + n_all);
+    }
+    if (prim[0] != prim[1] || dual[0] != dual[1] ||
+	Pi2_out[0] != Pi2_out[1] || Lambda_out[0] != Lambda_out[1]) pass = false;
+
+    real_t prim_ref = 0, dual_ref = 0;
+    double startTime = getRealTime();
+    for (size_t r=0; r<5; ++r) {
+      prim_ref = dual_ref = 0;
+      for (size_t i=0; i<num; ++i) {
+	const size_t offset = i * n * a.len;
+	real_t p_res, d_res;
+	internal::_BADMM_fused(a, uniform[i], &expC[offset], &Pi2[offset], &Lambda[offset],
+			       &w_sync[i * a.len], 2, &p_res, &d_res);
+	prim_ref += p_res; dual_ref += d_res;
+      }
+    }
+    std::cerr << "BADMM sweeps element by element\t" << getRealTime() - startTime << "s" << std::endl;
+    real_t err = std::max(std::fabs(prim[0] - prim_ref) / prim_ref, std::fabs(dual[0] - dual_ref) / dual_ref);
+    err = std::max(err, max_rel_diff(Pi2_out[0], Pi2));
+    err = std::max(err, max_rel_diff(Lambda_out[0], Lambda));
+    err = std::max(err, max_rel_diff(std::vector<real_t>(batch_cache.w_sync, batch_cache.w_sync + num * a.len), w_sync));
+    std::cerr << "batched BADMM\tmax relative difference: " << err << std::endl;
+    if (!(err < tol)) pass = false;
+    internal::deallocate_badmm_cache(batch_cache);
+  }
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+#include "../common/d2.hpp"
+#include <random>
+
+using namespace d2;
+
+template <typename ElemType>
+bool same_block(const Block<ElemType> &a, const Block<ElemType> &b) {
+  typedef typename ElemType::T::type SuppType;
+  if (a.get_size() != b.get_size() || a.get_col() != b.get_col() ||
+      a.get_max_len() != b.get_max_len()) return false;
+  for (size_t i=0; i<a.get_size(); ++i)
+    if (a[i].len != b[i].len) return false;
+  const size_t col = a.get_col();
+  return
+    memcmp(a.get_weight_ptr(), b.get_weight_ptr(), sizeof(real_t) * col) == 0 &&
+    memcmp(a.get_label_ptr(), b.get_label_ptr(), sizeof(real_t) * col) == 0 &&
+    memcmp(a.get_support_ptr(), b.get_support_ptr(),
+	   sizeof(SuppType) * ElemType::T::step_stride(col, ElemType::D)) == 0;
+}
+
+/* round trip blocks through the .d2b format, and compare the time of
+ * parsing text with that of mapping the binary file */
+int main(int argc, char** argv) {
+  bool pass = true;
+  double startTime;
+
+  {
+    size_t len = 8, size = 100;
+    Block<Elem<def::Euclidean, 3> > data (size, len);
+    startTime = getRealTime();
+    data.read("data/test/euclidean_testdata.d2", size);
+    std::cerr << "parse text\t" << getRealTime() - startTime << "s" << std::endl;
+    for (size_t i=0; i<data.get_col(); ++i) data.get_label_ptr()[i] = i % 7;
+    data.write_binary("data/test/euclidean_testdata.d2b");
+
+    Block<Elem<def::Euclidean, 3> > data_binary (1, 1);
+    startTime = getRealTime();
+    data_binary.read("data/test/euclidean_testdata.d2b", size);
+    std::cerr << "map binary\t" << getRealTime() - startTime << "s" << std::endl;
+    if (!same_block(data, data_binary)) pass = false;
+
+    std::vector<real_t> emds(size), emds_binary(size);
+    EMD(data[0], data, &emds[0]);
+    EMD(data_binary[0], data_binary, &emds_binary[0]);
+    if (emds != emds_binary) pass = false;
+
+    // the mapping is private: writing into the block leaves the file intact
+    data_binary.get_weight_ptr()[0] = -1;
+    Block<Elem<def::Euclidean, 3> > data_again (1, 1);
+    data_again.read_binary("data/test/euclidean_testdata.d2b", 10);
+    if (data_again.get_size() != 10 || data_again.get_weight_ptr()[0] != data.get_weight_ptr()[0])
+      pass = false;
+
+    // the element type is checked
+    Block<Elem<def::Euclidean, 2> > data_wrong (1, 1);
+    if (data_wrong.read_binary("data/test/euclidean_testdata.d2b", size) == 0) pass = false;
+
+    // so are lengths that do not add up to the columns, and the block is
+    // left as it was
+    std::ifstream in("data/test/euclidean_testdata.d2b", std::ifstream::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    internal::_BinaryHeader h;
+    memcpy(&h, &bytes[0], sizeof(h));
+    uint64_t len0;
+    memcpy(&len0, &bytes[h.off_len], sizeof(len0));
+    len0 += 1;
+    memcpy(&bytes[h.off_len], &len0, sizeof(len0));
+    std::ofstream out("data/test/euclidean_corrupted.d2b", std::ofstream::binary);
+    out.write(&bytes[0], bytes.size());
+    out.close();
+    if (data_again.read_binary("data/test/euclidean_corrupted.d2b", size) == 0 ||
+	data_again.get_size() != 10) pass = false;
+  }
+
+  {
+    // word vectors carry their embedding as meta data
+    const size_t size = 50, len = 6, vocab = 20;
+    std::mt19937 rnd_gen(0);
+    std::uniform_real_distribution<real_t> unif(0., 1.);
+    std::ofstream fs("data/test/wordvec_testdata.d2s");
+    for (size_t i=0; i<size; ++i) {
+      fs << 4 << std::endl << len << std::endl;
+      for (size_t j=0; j<len; ++j) fs << unif(rnd_gen) << " ";
+      fs << std::endl;
+      for (size_t j=0; j<len; ++j) fs << rnd_gen() % vocab + 1 << " ";
+      fs << std::endl;
+    }
+    fs.close();
+    fs.open("data/test/wordvec_testdata.d2s.meta0");
+    fs << 4 << std::endl << vocab << std::endl;
+    for (size_t i=0; i<vocab*4; ++i) fs << unif(rnd_gen) << " ";
+    fs.close();
+
+    Block<Elem<def::WordVec, 4> > data (size, len);
+    data.read("data/test/wordvec_testdata.d2s", size);
+    data.write_binary("data/test/wordvec_testdata.d2b");
+    Block<Elem<def::WordVec, 4> > data_binary (1, 1);
+    data_binary.read("data/test/wordvec_testdata.d2b", size);
+    if (!same_block(data, data_binary) || data_binary.meta.size != vocab ||
+	memcmp(data.meta.embedding, data_binary.meta.embedding, sizeof(real_t) * vocab * 4) != 0)
+      pass = false;
+    std::vector<real_t> cache_mat(len * len);
+    if (EMD(data[1], data[2], data.meta, &cache_mat[0]) !=
+	EMD(data_binary[1], data_binary[2], data_binary.meta, &cache_mat[0]))
+      pass = false;
+  }
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+#include "../common/d2.hpp"
+#include <random>
+#include <vector>
+#include <limits>
+
+using namespace d2;
+
+typedef void (*reduce_t)(size_t, size_t, const real_t*, real_t*);
+typedef void (*update_t)(size_t, size_t, real_t*, const real_t*);
+
+static const real_t tol = 1E3 * std::numeric_limits<real_t>::epsilon();
+
+static real_t rel_err(const std::vector<real_t> &a, const std::vector<real_t> &b) {
+  real_t err = 0;
+  for (size_t i=0; i<a.size(); ++i)
+    err = std::max(err, std::fabs(a[i] - b[i]) / std::max(std::fabs(a[i]), (real_t) 1.));
+  return err;
+}
+
+/* time a call with the scalar and then the simd kernels and compare the
+ * results; returns false if they disagree */
+template <typename F>
+static bool compare(const char *name, size_t m, size_t n,
+		    const std::vector<real_t> &input, size_t out_len, F f) {
+  const size_t repeat = std::max((size_t) 1, (size_t) (1E7 / (m*n)));
+  std::vector<real_t> a[2], b[2];
+  double time[2];
+  for (int simd = 0; simd < 2; ++simd) {
+    if (_d2_simd_enable(simd) != simd) return true;
+    a[simd] = input; b[simd].resize(std::max(out_len, (size_t) 1), 1.);
+    f(&a[simd][0], &b[simd][0]);
+    double startTime = getRealTime();
+    for (size_t r=0; r<repeat; ++r) f(&a[simd][0], &b[simd][0]);
+    time[simd] = (getRealTime() - startTime) / repeat;
+    // check one clean call, since the updates accumulate over repeats
+    a[simd] = input; b[simd].assign(std::max(out_len, (size_t) 1), 1.);
+    f(&a[simd][0], &b[simd][0]);
+  }
+  const real_t err = std::max(rel_err(a[0], a[1]), rel_err(b[0], b[1]));
+  std::cerr << name << "\t" << m << "\t" << n << "\t"
+	    << time[0] << "\t" << time[1] << "\t" << time[0] / time[1]
+	    << (err > tol ? "\tmismatch" : "") << std::endl;
+  return err <= tol;
+}
+
+/* micro-benchmark of the scalar and the simd versions of the blas_like
+ * row/column primitives */
+int main(int argc, char** argv) {
+  const size_t shapes[][2] = {{3, 5}, {8, 8}, {16, 100}, {33, 65}, {100, 1000}, {1000, 100}};
+  std::mt19937 rnd_gen(0);
+  std::uniform_real_distribution<real_t> unif(0.1, 1.);
+  bool pass = true;
+
+  if (!_d2_simd_enable(1)) {
+    std::cerr << "no simd kernels on this cpu" << std::endl;
+    std::cerr << "passed" << std::endl;
+    return 0;
+  }
+
+  const struct {const char *name; reduce_t f; bool by_col;} reduces[] = {
+    {"cmax", _D2_FUNC(cmax), true}, {"cmin", _D2_FUNC(cmin), true},
+    {"csum", _D2_FUNC(csum), true}, {"rmax", _D2_FUNC(rmax), false},
+    {"rmin", _D2_FUNC(rmin), false}, {"rsum", _D2_FUNC(rsum), false}};
+  const struct {const char *name; update_t f; bool by_col;} updates[] = {
+    {"gcmv", _D2_FUNC(gcmv), false}, {"gcmv2", _D2_FUNC(gcmv2), false},
+    {"gcms", _D2_FUNC(gcms), false}, {"icms", _D2_FUNC(icms), false},
+    {"grmv", _D2_FUNC(grmv), true}, {"grms", _D2_FUNC(grms), true},
+    {"irms", _D2_FUNC(irms), true}};
+
+  std::cerr << "op\tm\tn\tscalar\t\tsimd\t\tspeedup" << std::endl;
+  for (auto &s : shapes) {
+    const size_t m = s[0], n = s[1];
+    std::vector<real_t> a(m*n), v(std::max(m, n));
+    for (auto &x : a) x = unif(rnd_gen);
+    for (auto &x : v) x = unif(rnd_gen);
+
+    for (auto &op : reduces)
+      pass = compare(op.name, m, n, a, op.by_col ? n : m,
+		     [&](real_t *pa, real_t *pb) {op.f(m, n, pa, pb);}) && pass;
+    for (auto &op : updates) {
+      // b is the vector operand and is left untouched
+      std::vector<real_t> b(v.begin(), v.begin() + (op.by_col ? n : m));
+      pass = compare(op.name, m, n, a, 0,
+		     [&](real_t *pa, real_t *) {op.f(m, n, pa, &b[0]);}) && pass;
+    }
+    // the fused reductions, whose vector operand is left untouched as well
+    std::vector<real_t> rv(v.begin(), v.begin() + n), cv(v.begin(), v.begin() + m);
+    pass = compare("grmv_rmin", m, n, a, m,
+		   [&](real_t *pa, real_t *pb) {_D2_FUNC(grmv_rmin)(m, n, pa, &rv[0], pb);}) && pass;
+    pass = compare("gcmv2_cmax", m, n, a, n,
+		   [&](real_t *pa, real_t *pb) {_D2_FUNC(gcmv2_cmax)(m, n, pa, &cv[0], pb);}) && pass;
+
+    // exp of non-positive inputs, as in the entropic kernels
+    std::vector<real_t> e(m*n);
+    for (auto &x : e) x = -50. * unif(rnd_gen);
+    pass = compare("exp", m, n, e, 0,
+		   [&](real_t *pa, real_t *) {_D2_FUNC(exp)(m*n, pa);}) && pass;
+    pass = compare("exprnd", m, n, e, 0,
+		   [&](real_t *pa, real_t *) {_D2_FUNC(exprnd)(m*n, 7, m, pa);}) && pass;
+
+    // the fused reductions give the same as the update followed by the reduction
+    std::vector<real_t> t = a, r(std::max(m, n)), r_ref(std::max(m, n));
+    _D2_FUNC(grmv)(m, n, &t[0], &rv[0]);
+    _D2_FUNC(rmin)(m, n, &t[0], &r_ref[0]);
+    _D2_FUNC(grmv_rmin)(m, n, &a[0], &rv[0], &r[0]);
+    if (r != r_ref) {std::cerr << "grmv_rmin differs from grmv + rmin" << std::endl; pass = false;}
+    t = a;
+    _D2_FUNC(gcmv2)(m, n, &t[0], &cv[0]);
+    _D2_FUNC(cmax)(m, n, &t[0], &r_ref[0]);
+    _D2_FUNC(gcmv2_cmax)(m, n, &a[0], &cv[0], &r[0]);
+    if (r != r_ref) {std::cerr << "gcmv2_cmax differs from gcmv2 + cmax" << std::endl; pass = false;}
+  }
+
+  // exponential variates: a draw depends on its counter only, and the
+  // moments are those of the standard exponential distribution
+  {
+    const size_t n = 1000000, shift = 5;
+    std::vector<real_t> x(n), y(n - shift);
+    _D2_FUNC(exprnd)(n, 42, 0, &x[0]);
+    _D2_FUNC(exprnd)(n - shift, 42, shift, &y[0]);
+    double mean = 0, var = 0;
+    for (size_t i=0; i<n; ++i) mean += x[i];
+    mean /= n;
+    for (size_t i=0; i<n; ++i) var += (x[i] - mean) * (x[i] - mean);
+    var /= n;
+    std::cerr << "exprnd	mean " << mean << "	variance " << var << std::endl;
+    if (!std::equal(y.begin(), y.end(), x.begin() + shift) ||
+	std::fabs(mean - 1.) > 5E-3 || std::fabs(var - 1.) > 2E-2) pass = false;
+  }
+
+  // special values of exp
+  const real_t big = std::log(std::numeric_limits<real_t>::max());
+  std::vector<real_t> e = {0., -1., 1., -1E5, 1E5, (real_t) (-0.99 * big), (real_t) (0.99 * big)};
+  std::vector<real_t> e_ref = e;
+  _d2_simd_enable(1);
+  _D2_FUNC(exp)(e.size(), &e[0]);
+  for (auto &x : e_ref) x = exp(x);
+  for (size_t i=0; i<e.size(); ++i)
+    if (std::fabs(e[i] - e_ref[i]) > tol * std::max(e_ref[i], (real_t) 1.) &&
+	!(std::isinf(e[i]) && std::isinf(e_ref[i]))) {
+      std::cerr << "exp(" << e_ref[i] << ") mismatch" << std::endl;
+      pass = false;
+    }
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -1,5 +1,6 @@
 #include "../common/d2.hpp"
 #include "time.h"
+#include <limits>
 
 int main(int argc, char** argv) {
   using namespace d2;
@@ -68,7 +69,43 @@ int main(int argc, char** argv) {
 	    << ": " << emds[ranks[1]] 
 	    << "\t\t" << totalTime << "s"
 	    << std::endl;
-  
+
+
+  // test parallel EMD
+  std::cout << "Parallel EMD Test" << std::endl;
+  std::vector<real_t> emds_parallel(data.get_size());
+  EMD(*data.get_multiphase_elem(i1), data, &emds[0]);
+  server::SetNumThreads(4);
+  startTime = getRealTime();
+  EMD(*data.get_multiphase_elem(i1), data, &emds_parallel[0]);
+  totalTime = getRealTime() - startTime;
+  server::SetNumThreads(1);
+  real_t max_diff = 0;
+  for (size_t i=0; i<data.get_size(); ++i)
+    max_diff = std::max(max_diff, std::fabs(emds[i] - emds_parallel[i]));
+  std::cerr << "both phase - max difference to serial EMD with "
+	    << 4 << " threads: " << max_diff
+	    << "\t\t" << totalTime << "s"
+	    << std::endl;
+
+  // scratch buffers are drawn from the thread-local arena, which does not
+  // grow once it has served the same calls
+  const size_t arena_capacity = internal::_ScratchArena::local().capacity();
+  EMD(*data.get_multiphase_elem(i1), data, &emds[0]);
+  std::cerr << "scratch arena: " << arena_capacity << " bytes"
+	    << (internal::_ScratchArena::local().capacity() == arena_capacity ? "" : ", grown")
+	    << std::endl;
+
+  // and does not keep the peak of a large call once it is empty again
+  {
+    internal::_Scratch scratch;
+    scratch.alloc<char>(arena_capacity + (1 << 27));
+  }
+  std::cerr << "scratch arena after a large call: "
+	    << internal::_ScratchArena::local().capacity() << " bytes"
+	    << (internal::_ScratchArena::local().capacity() <= std::max(arena_capacity, (size_t) 1 << 26) ? "" : ", mismatch")
+	    << std::endl;
+
 
   // test nearest neighbors (simple)
   std::cout << "Nearest Neighbors Test (Simple)" << std::endl;
@@ -99,6 +136,80 @@ int main(int argc, char** argv) {
 	    << std::endl;
 
 
+  // test the cascade of lower bounds against the linear scan
+  std::cout << "Nearest Neighbors Test (Cascade)" << std::endl;
+  {
+    const size_t k = 3;
+    std::vector<real_t> emds_ref(block0.get_size());
+    std::vector<index_t> ranks_ref(block0.get_size());
+    def::KNN_PARAM param;
+    def::KNN_STATS stats, total;
+    bool match = true;
+    // the EMDs of both searches agree up to the precision of the solver
+    const real_t tol = std::sqrt(std::numeric_limits<real_t>::epsilon());
+    size_t count_simple = 0;
+    startTime = getRealTime();
+    for (size_t q=0; q<block0.get_size(); ++q) {
+      KNearestNeighbors_Cascade(k, block0[q], block0, &emds[0], &ranks[0], param, &stats);
+      total.pruned_v0 += stats.pruned_v0;
+      total.pruned_projection += stats.pruned_projection;
+      total.pruned_v1 += stats.pruned_v1;
+      total.emd += stats.emd;
+      if (q % 9 == 0) {
+	KNearestNeighbors_Linear(k, block0[q], block0, &emds_ref[0], &ranks_ref[0]);
+	for (size_t j=0; j<k; ++j)
+	  if (std::fabs(emds[ranks[j]] - emds_ref[ranks_ref[j]]) > tol * std::max(emds_ref[ranks_ref[j]], (real_t) 1.))
+	    match = false;
+      }
+    }
+    totalTime = getRealTime() - startTime;
+    // the projection bound can be skipped
+    param.num_projections = 0;
+    KNearestNeighbors_Cascade(k, block0[0], block0, &emds[0], &ranks[0], param, &stats);
+    KNearestNeighbors_Linear(k, block0[0], block0, &emds_ref[0], &ranks_ref[0]);
+    for (size_t j=0; j<k; ++j)
+      if (std::fabs(emds[ranks[j]] - emds_ref[ranks_ref[j]]) > tol * std::max(emds_ref[ranks_ref[j]], (real_t) 1.) ||
+	  stats.pruned_projection != 0)
+	match = false;
+    for (size_t q=0; q<block0.get_size(); ++q)
+      count_simple += KNearestNeighbors_Simple(k, block0[q], block0, &emds[0], &ranks[0]);
+    std::cerr << "phase 0 - pruned by v0/projection/v1: " << total.pruned_v0 << "/"
+	      << total.pruned_projection << "/" << total.pruned_v1 << ", "
+	      << total.emd << " EMD computed (" << count_simple << " by simple)"
+	      << (match ? "" : ", mismatch")
+	      << "\t\t" << totalTime << "s" << std::endl;
+  }
+
+
+  // test batched nearest neighbors against the linear scan
+  std::cout << "Nearest Neighbors Test (Batch)" << std::endl;
+  {
+    const size_t k = 3, nq = block0.get_size();
+    std::vector<real_t> dists(nq * k);
+    std::vector<index_t> ids(nq * k);
+    bool match = true;
+    for (size_t num_threads : {1, 4}) {
+      server::SetNumThreads(num_threads);
+      startTime = getRealTime();
+      size_t count = KNearestNeighbors_Batch(k, block0, block0, &dists[0], &ids[0]);
+      totalTime = getRealTime() - startTime;
+      for (size_t q=0; q<nq; q += 9) {
+	KNearestNeighbors_Linear(k, block0[q], block0, &emds[0], &ranks[0]);
+	for (size_t j=0; j<k; ++j)
+	  if (std::fabs(dists[q*k + j] - emds[ranks[j]]) > 1E-8 * std::max(emds[ranks[j]], (real_t) 1.))
+	    match = false;
+      }
+      std::cerr << "phase 0 - " << k << " nearest neighbors of " << nq << " queries with "
+		<< num_threads << " thread(s), " << count << " EMD computed"
+		<< (match ? "" : ", mismatch")
+		<< "\t\t" << totalTime << "s" << std::endl;
+    }
+    server::SetNumThreads(1);
+    // no neighbors asked, so nothing to prune against and no EMD computed
+    if (KNearestNeighbors_Batch(0, block0, block0, &dists[0], &ids[0]) != 0)
+      std::cerr << "phase 0 - 0 nearest neighbors, mismatch" << std::endl;
+  }
+
   // test multi-phase
   auto mele = data.get_multiphase_elem(i1);
   std::cerr << mele->get_phase<0>() << block0[i1]
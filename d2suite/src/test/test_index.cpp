@@ -0,0 +1,78 @@
+#include "../common/d2.hpp"
+
+using namespace d2;
+
+/* build an index over the test data, compare its nearest neighbors with
+ * those of KNearestNeighbors_Batch, and round trip it through a file */
+int main(int argc, char** argv) {
+  bool pass = true;
+  double startTime;
+  const size_t size = 100, len = 8, k = 3;
+
+  Block<Elem<def::Euclidean, 3> > data (size, len);
+  data.read("data/test/euclidean_testdata.d2", size);
+  const size_t nq = data.get_size();
+
+  std::vector<real_t> dists(nq * k), dists_ref(nq * k);
+  std::vector<index_t> ids(nq * k), ids_ref(nq * k);
+  startTime = getRealTime();
+  size_t count_ref = KNearestNeighbors_Batch(k, data, data, &dists_ref[0], &ids_ref[0]);
+  std::cerr << "batch\t" << count_ref << " EMD computed\t" << getRealTime() - startTime << "s" << std::endl;
+
+  Index<Elem<def::Euclidean, 3> > index (data);
+  index.build();
+  startTime = getRealTime();
+  size_t count = index.KNearestNeighbors(k, data, &dists[0], &ids[0]);
+  std::cerr << "index\t" << count << " EMD computed\t" << getRealTime() - startTime << "s" << std::endl;
+  for (size_t i=0; i<nq * k; ++i)
+    if (std::fabs(dists[i] - dists_ref[i]) > 1E-8 * std::max(dists_ref[i], (real_t) 1.)) pass = false;
+  if (count > count_ref) pass = false;
+
+  // queries kept in the aligned layout give the same answers
+  Block<Elem<def::Euclidean, 3> > queries (size, len);
+  queries.read("data/test/euclidean_testdata.d2", size);
+  queries.set_aligned(true);
+  for (size_t i=0; i<nq; ++i) {
+    const real_t *supp = queries.get_aligned_support_ptr(i);
+    const size_t ld = queries.get_aligned_ld(i);
+    if ((size_t) supp % _D2_ALIGN != 0 || ld < queries[i].len) pass = false;
+    for (size_t j=0; j<queries[i].len; ++j)
+      for (size_t d=0; d<3; ++d)
+	if (supp[d*ld + j] != queries[i].supp[j*3 + d]) pass = false;
+  }
+  std::vector<real_t> dists_aligned(nq * k);
+  std::vector<index_t> ids_aligned(nq * k);
+  index.KNearestNeighbors(k, queries, &dists_aligned[0], &ids_aligned[0]);
+  for (size_t i=0; i<nq * k; ++i)
+    if (std::fabs(dists_aligned[i] - dists_ref[i]) > 1E-8 * std::max(dists_ref[i], (real_t) 1.)) pass = false;
+
+  // the loaded index gives the same answers
+  if (index.save("data/test/euclidean_testdata.d2i") != 0) pass = false;
+  Index<Elem<def::Euclidean, 3> > index_loaded (data);
+  if (index_loaded.load("data/test/euclidean_testdata.d2i") != 0) pass = false;
+  std::vector<real_t> dists_loaded(nq * k);
+  std::vector<index_t> ids_loaded(nq * k);
+  index_loaded.KNearestNeighbors(k, data, &dists_loaded[0], &ids_loaded[0]);
+  if (dists_loaded != dists || ids_loaded != ids) pass = false;
+
+  // the index of another block is rejected
+  Block<Elem<def::Euclidean, 3> > data_small (size, len);
+  data_small.read("data/test/euclidean_testdata.d2", size / 2);
+  Index<Elem<def::Euclidean, 3> > index_wrong (data_small);
+  if (index_wrong.load("data/test/euclidean_testdata.d2i") == 0) pass = false;
+
+  // so is a file whose count of support norms is neither 0 nor col
+  std::ifstream in("data/test/euclidean_testdata.d2i", std::ifstream::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  in.close();
+  const size_t norm_offset = sizeof(internal::_IndexHeader) + sizeof(real_t) * (3 + 2) * data.get_size();
+  const uint64_t norm_count = data.get_col() - 1;
+  memcpy(&bytes[norm_offset], &norm_count, sizeof(norm_count));
+  std::ofstream out("data/test/euclidean_corrupted.d2i", std::ofstream::binary);
+  out.write(&bytes[0], bytes.size());
+  out.close();
+  if (index_loaded.load("data/test/euclidean_corrupted.d2i") == 0) pass = false;
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
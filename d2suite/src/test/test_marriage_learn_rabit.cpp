@@ -34,6 +34,9 @@ int main(int argc, char** argv) {
   TCLAP::ValueArg<size_t>
     sizeArg("n","size","number of samples to read",true,1000,"size_t");
   cmd.add(sizeArg);
+  TCLAP::SwitchArg
+    compactArg("","compact","keep only the badmm state and recompute the cost in every badmm iteration",false);
+  cmd.add(compactArg);
   //  TCLAP::ValueArg<size_t>
   //    cnumArg("c","cnum","number of classifiers",true,4,"size_t");
   //  cmd.add(cnumArg);
@@ -44,6 +47,7 @@ int main(int argc, char** argv) {
 /***********************************************************************************/
   using namespace d2;
   set_param();
+  param.compact = compactArg.getValue();
   std::string prefix_name(nameArg.getValue());
   const size_t start = 1;
   const real_t propo = 0.5;
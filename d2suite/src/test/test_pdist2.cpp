@@ -0,0 +1,66 @@
+#include "../common/d2.hpp"
+#include <random>
+#include <vector>
+
+/* check the direct, the dimension-major and the gemm-based squared 
+ * Euclidean distance kernels against the naive triple loop, and time them
+ * to show the crossover that _D2_PDIST2_USE_GEMM is set from */
+int main(int argc, char** argv) {
+  using namespace d2;
+
+  const size_t shapes[][3] = {{3, 8, 8}, {3, 13, 7}, {3, 32, 32}, {3, 64, 512}, {3, 64, 4096},
+			      {8, 16, 16}, {8, 32, 64}, {8, 64, 512},
+			      {16, 8, 8}, {16, 16, 16}, {16, 32, 64}, {16, 64, 512},
+			      {64, 16, 16}, {64, 32, 64}, {64, 64, 512},
+			      {300, 8, 8}, {300, 32, 64}, {300, 64, 512}};
+  std::mt19937 rnd_gen(0);
+  std::uniform_real_distribution<real_t> unif(0., 1.);
+  bool pass = true;
+
+  std::cerr << "d\tn\tm\tdirect\t\tdim-major\tgemm\t\t(seconds per call)" << std::endl;
+  for (auto &s : shapes) {
+    const size_t d = s[0], n = s[1], m = s[2];
+    std::vector<real_t> A(d*n), B(d*m), C0(n*m), C1(n*m), C2(n*m), C3(n*m), Bn(m);
+    for (auto &a : A) a = unif(rnd_gen);
+    internal::_Scratch scratch;
+    const size_t lda = _D2_ALIGN_LEN(n, sizeof(real_t));
+    real_t *At = scratch.alloc<real_t>(d * lda);
+    for (size_t i=0; i<n; ++i)
+      for (size_t k=0; k<d; ++k) At[k*lda + i] = A[i*d + k];
+    for (auto &b : B) b = unif(rnd_gen);
+    for (size_t j=0; j<m; ++j)
+      for (size_t i=0; i<n; ++i) {
+	real_t v = 0;
+	for (size_t k=0; k<d; ++k) v += (A[i*d+k] - B[j*d+k]) * (A[i*d+k] - B[j*d+k]);
+	C0[j*n+i] = v;
+      }
+    _D2_FUNC(csqnorm)(d, m, &B[0], &Bn[0]);
+
+    const size_t repeat = std::max((size_t) 1, (size_t) (1E7 / (d*n*m)));
+    double startTime, directTime, dmajorTime, gemmTime;
+    startTime = getRealTime();
+    for (size_t r=0; r<repeat; ++r) _D2_FUNC(pdist2_direct)(d, n, m, &A[0], &B[0], &C1[0]);
+    directTime = (getRealTime() - startTime) / repeat;
+    startTime = getRealTime();
+    for (size_t r=0; r<repeat; ++r) _D2_FUNC(pdist2_dmajor)(d, n, m, At, lda, &B[0], &C3[0]);
+    dmajorTime = (getRealTime() - startTime) / repeat;
+    startTime = getRealTime();
+    for (size_t r=0; r<repeat; ++r) _D2_FUNC(pdist2_norm)(d, n, m, &A[0], &B[0], NULL, &Bn[0], &C2[0]);
+    gemmTime = (getRealTime() - startTime) / repeat;
+
+    real_t err = 0;
+    for (size_t i=0; i<n*m; ++i) {
+      err = std::max(err, std::fabs(C1[i] - C0[i]));
+      err = std::max(err, std::fabs(C3[i] - C0[i]));
+      err = std::max(err, std::fabs(C2[i] - C0[i]) / d);
+    }
+    if (err > 1E-4) pass = false;
+    std::cerr << d << "\t" << n << "\t" << m << "\t"
+	      << directTime << "\t" << dmajorTime << "\t" << gemmTime
+	      << (_D2_PDIST2_USE_GEMM(d, n, m) ? "\t(gemm)" : "\t(direct)")
+	      << std::endl;
+  }
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+#include <rabit/rabit.h>
+#include "../common/d2.hpp"
+
+/* parallel program: workers start with parts of different sizes and report
+ * speeds proportional to rank+1; after rebalancing, the data must be the
+ * same as a whole, every element must keep its id, and the work of each
+ * worker must follow its speed */
+int main(int argc, char** argv) {
+  using namespace d2;
+  server::Init(argc, argv);
+  bool pass = true;
+  const size_t world = rabit::GetWorldSize(), rank = rabit::GetRank(), len = 8;
+
+  // worker r holds the first 10 (r+1) elements of the test data
+  DistributedBlock<Elem<def::Euclidean, 3> > data (10 * world, len);
+  data.Block<Elem<def::Euclidean, 3> >::read("data/test/euclidean_testdata.d2", 10 * (rank + 1));
+
+  // the number of elements and columns, and the sums of weights and supports
+  auto checksum = [&](double *sums) {
+    sums[0] = data.get_size(); sums[1] = data.get_col(); sums[2] = sums[3] = 0;
+    for (size_t i=0; i<data.get_col(); ++i) sums[2] += data.get_weight_ptr()[i];
+    for (size_t i=0; i<3 * data.get_col(); ++i) sums[3] += data.get_support_ptr()[i];
+    rabit::Allreduce<rabit::op::Sum>(sums, 4);
+  };
+  // the count and the sum of weights of every element by its global id,
+  // which is its index in the order of ranks before the rebalance
+  const size_t global_size = 5 * world * (world + 1), offset = 5 * rank * (rank + 1);
+  auto by_id = [&](std::vector<double> &count, std::vector<double> &w, const size_t *ids) {
+    count.assign(global_size, 0); w.assign(global_size, 0);
+    for (size_t i=0; i<data.get_size(); ++i) {
+      const size_t id = ids ? ids[i] : offset + i;
+      count[id] += 1;
+      for (size_t j=0; j<data[i].len; ++j) w[id] += data[i].w[j];
+    }
+    rabit::Allreduce<rabit::op::Sum>(&count[0], global_size);
+    rabit::Allreduce<rabit::op::Sum>(&w[0], global_size);
+  };
+  double before[4], after[4];
+  std::vector<double> count_before, count_after, w_before, w_after;
+  checksum(before);
+  by_id(count_before, w_before, NULL);
+  size_t max_len = data.get_max_len();
+  rabit::Allreduce<rabit::op::Max>(&max_len, 1);
+
+  // the time of worker r makes its speed (rank+1) columns per unit
+  data.rebalance((double) data.get_col() / (rank + 1));
+  checksum(after);
+  for (size_t j=0; j<4; ++j)
+    if (std::fabs(after[j] - before[j]) > 1E-6 * std::max(std::fabs(before[j]), 1.)) pass = false;
+
+  // every element keeps its id
+  by_id(count_after, w_after, data.get_ids().data());
+  for (size_t i=0; i<global_size; ++i)
+    if (count_after[i] != 1 || std::fabs(w_after[i] - w_before[i]) > 1E-6) pass = false;
+
+  // the columns of each worker are its share of the total, up to the
+  // elements that do not split evenly
+  const double target = before[1] * (rank + 1) / (world * (world + 1) / 2);
+  if (std::fabs(data.get_col() - target) > world * max_len) pass = false;
+  int failed = pass ? 0 : 1;
+  rabit::Allreduce<rabit::op::Max>(&failed, 1);
+
+  if (rank == 0)
+    std::cerr << (failed ? "failed" : "passed") << std::endl;
+  server::Finalize();
+  return failed;
+}
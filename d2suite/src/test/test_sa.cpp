@@ -0,0 +1,58 @@
+#include "../common/d2.hpp"
+
+using namespace d2;
+
+/* run the Gibbs sampler on pairs of the test data with a fixed seed, check
+ * that the sampled duals do not depend on the number of threads, and that
+ * they give lower bounds of the EMDs */
+int main(int argc, char** argv) {
+  bool pass = true;
+  const size_t size = 100, len = 8, pairs = 40, niter = 5;
+  const real_t T = .01;
+
+  Block<Elem<def::Euclidean, 3> > data (size, len);
+  data.read("data/test/euclidean_testdata.d2", size);
+  const Block<Elem<def::Euclidean, 3> > a (data, 0, pairs), b (data, pairs, pairs);
+
+  std::vector<real_t> dual1[2], L[2];
+  int iterations[2];
+  double totalTime[2];
+  const size_t num_threads[2] = {1, 4};
+  for (size_t t=0; t<2; ++t) {
+    internal::SACache sac;
+    internal::allocate_sa_cache(a, b, sac, true, 7);
+    for (size_t i=0, offset=0; i<pairs; offset += a[i].len * b[i].len, ++i)
+      internal::_pdist2(a[i].supp, a[i].len, b[i].supp, b[i].len, data.meta, sac._m + offset);
+    server::SetNumThreads(num_threads[t]);
+    real_t A, B, D;
+    double startTime = getRealTime();
+    iterations[t] = EMD_SA(a, b, T, niter, sac, A, B, D, true);
+    totalTime[t] = getRealTime() - startTime;
+    server::SetNumThreads(1);
+    dual1[t].assign(sac._dual1, sac._dual1 + a.get_col());
+    L[t].assign(sac._L, sac._L + b.get_col());
+    internal::deallocate_sa_cache(sac);
+    std::cerr << num_threads[t] << " thread(s)\t" << iterations[t] << " sweeps\t\t"
+	      << totalTime[t] << "s" << std::endl;
+  }
+  if (iterations[0] != iterations[1] || dual1[0] != dual1[1] || L[0] != L[1]) pass = false;
+
+  // dual1(i) - L(j) <= M(i,j), so the duals give a lower bound of each EMD
+  real_t max_violation = 0, gap = 0, total = 0;
+  for (size_t i=0; i<pairs; ++i) {
+    const real_t emd = EMD(a[i], b[i], data.meta);
+    const size_t c1 = a[i].w - a.get_weight_ptr(), c2 = b[i].w - b.get_weight_ptr();
+    real_t bound = 0;
+    for (size_t j=0; j<a[i].len; ++j) bound += dual1[0][c1 + j] * a[i].w[j];
+    for (size_t j=0; j<b[i].len; ++j) bound -= L[0][c2 + j] * b[i].w[j];
+    max_violation = std::max(max_violation, bound - emd);
+    gap += emd - bound;
+    total += emd;
+  }
+  std::cerr << "max violation of the lower bounds: " << max_violation
+	    << "\trelative gap: " << gap / total << std::endl;
+  if (max_violation > 1E-4 * total / pairs) pass = false;
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#include "../common/d2.hpp"
+
+/* compare Sinkhorn EMD (both the plain and the log-domain iterations) with
+ * the exact EMD of a query against a block */
+int main(int argc, char** argv) {
+  using namespace d2;
+
+  size_t len = 8, size = 100;
+  Block<Elem<def::Euclidean, 3> > data (size, len);
+  data.read("data/test/euclidean_testdata.d2", size);
+
+  server::Init(argc, argv);
+  bool pass = true;
+
+  std::vector<real_t> emds(data.get_size()), emds_sinkhorn(data.get_size());
+  double startTime, totalTime;
+  startTime = getRealTime();
+  EMD(data[0], data, &emds[0]);
+  totalTime = getRealTime() - startTime;
+  std::cerr << "exact EMD\t\t\t\t\t" << totalTime << "s" << std::endl;
+
+  def::SINKHORN_PARAM param;
+  param.max_iter = 1000;
+  const real_t regs[] = {0.1, 0.01};
+  std::vector<real_t> emds_plain[2];
+  for (int log_domain = 0; log_domain < 2; ++log_domain) {
+    param.log_domain = log_domain;
+    for (int r = 0; r < 2; ++r) {
+      const real_t reg = regs[r];
+      param.reg = reg;
+      startTime = getRealTime();
+      EMD(data[0], data, &emds_sinkhorn[0], param);
+      totalTime = getRealTime() - startTime;
+
+      real_t err = 0, total = 0;
+      for (size_t i=0; i<data.get_size(); ++i) {
+	// batched and single-pair results agree up to the stopping tolerance
+	real_t val = EMD(data[0], data[i], data.meta, param);
+	if (std::fabs(val - emds_sinkhorn[i]) > 1E-4 * std::max(val, (real_t) 1.)) pass = false;
+	err += std::fabs(emds_sinkhorn[i] - emds[i]);
+	total += emds[i];
+	// the plain and the log-domain iterations should agree
+	if (log_domain && std::fabs(emds_sinkhorn[i] - emds_plain[r][i]) > 1E-4 * std::max(emds_plain[r][i], (real_t) 1.)) pass = false;
+      }
+      if (!log_domain) emds_plain[r] = emds_sinkhorn;
+      std::cerr << (log_domain ? "log-domain " : "") << "Sinkhorn with reg=" << reg
+		<< "\trelative error: " << err / total
+		<< "\t\t" << totalTime << "s"
+		<< std::endl;
+      if (reg < 0.05 && err / total > 0.05) pass = false;
+    }
+  }
+
+  server::Finalize();
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include "../common/d2.hpp"
+#include <random>
+#include <vector>
+#include <thread>
+#include <limits>
+
+/* check optimality of d2_match_by_distmat on random transportation problems
+ * via primal feasibility, dual feasibility and zero duality gap */
+int main(int argc, char** argv) {
+  using namespace d2;
+  server::Init(argc, argv);
+
+  const int sizes[][2] = {{1, 1}, {1, 5}, {8, 8}, {8, 32}, {50, 20}, {100, 100}, {200, 200}};
+  const size_t repeat = 10;
+  std::mt19937 rnd_gen(0);
+  std::uniform_real_distribution<real_t> unif(0., 1.);
+  bool pass = true;
+  // tolerances of double precision, relaxed for single precision builds
+  const real_t tol = std::numeric_limits<real_t>::epsilon() < 1E-10 ? 1E-12 : 1E-6;
+
+  for (auto &s : sizes) {
+    const int n = s[0], m = s[1];
+    std::vector<real_t> C(n*m), wX(n), wY(m), x(n*m), lambda(n+m);
+    real_t max_err = 0;
+    double totalTime = 0;
+    for (size_t r=0; r<repeat; ++r) {
+      for (auto &c : C) c = unif(rnd_gen);
+      for (auto &w : wX) w = (unif(rnd_gen) < .1) ? 0 : unif(rnd_gen);
+      for (auto &w : wY) w = unif(rnd_gen);
+      real_t sX = 0, sY = 0;
+      for (auto &w : wX) sX += w;
+      for (auto &w : wY) sY += w;
+      if (sX == 0) {wX[0] = 1; sX = 1;}
+      for (auto &w : wX) w /= sX;
+      for (auto &w : wY) w /= sY;
+
+      double startTime = getRealTime();
+      real_t fval = d2_match_by_distmat(n, m, &C[0], &wX[0], &wY[0], &x[0], &lambda[0], 0);
+      totalTime += getRealTime() - startTime;
+
+      real_t err = 0, dual = 0;
+      for (int i=0; i<n; ++i) {
+	real_t rs = 0;
+	for (int j=0; j<m; ++j) {
+	  rs += x[i + j*n];
+	  err = std::max(err, -x[i + j*n]);
+	  err = std::max(err, lambda[i] + lambda[n+j] - C[i + j*n]);
+	}
+	err = std::max(err, std::fabs(rs - wX[i]));
+	dual += lambda[i] * wX[i];
+      }
+      for (int j=0; j<m; ++j) {
+	real_t cs = 0;
+	for (int i=0; i<n; ++i) cs += x[i + j*n];
+	err = std::max(err, std::fabs(cs - wY[j]));
+	dual += lambda[n+j] * wY[j];
+      }
+      err = std::max(err, std::fabs(fval - dual));
+      max_err = std::max(max_err, err);
+    }
+    std::cerr << "n=" << n << " m=" << m
+	      << "\tmax violation: " << max_err
+	      << "\t\t" << totalTime / repeat << "s"
+	      << std::endl;
+    if (max_err > std::max((real_t) 1E-6, 10 * tol)) pass = false;
+  }
+
+  /* solve the same problems concurrently, one solver context per thread
+   * (its own context for every other thread, given as NULL) */
+  {
+    const int n = 60, m = 40, num = 64, num_threads = 4;
+    std::vector<real_t> C(num*n*m), wX(n, 1./n), wY(m, 1./m);
+    for (auto &c : C) c = unif(rnd_gen);
+    std::vector<real_t> fval_seq(num), fval_par(num);
+    for (int p=0; p<num; ++p)
+      fval_seq[p] = d2_match_by_distmat(n, m, &C[p*n*m], &wX[0], &wY[0], NULL, NULL, 0);
+    std::vector<std::thread> threads;
+    for (int t=0; t<num_threads; ++t)
+      threads.push_back(std::thread([&, t]() {
+	    d2_solver_context_t *ctx = t % 2 ? d2_solver_context_create() : NULL;
+	    for (int p=t; p<num; p+=num_threads)
+	      fval_par[p] = d2_match_by_distmat_ctx(ctx, n, m, &C[p*n*m], &wX[0], &wY[0], NULL, NULL);
+	    if (ctx) d2_solver_context_release(ctx);
+	  }));
+    for (auto &th : threads) th.join();
+    real_t max_err = 0;
+    for (int p=0; p<num; ++p) max_err = std::max(max_err, std::fabs(fval_seq[p] - fval_par[p]));
+    std::cerr << "concurrent (" << num_threads << " threads)"
+	      << "\tmax difference: " << max_err << std::endl;
+    if (max_err > tol) pass = false;
+  }
+
+  /* re-solve problems whose cost matrices are slightly perturbed, starting
+   * from the previous basis and duals, and compare the number of pivots */
+  {
+    const int n = 100, m = 100, num = 20;
+    std::vector<real_t> C(n*m), wX(n, 1./n), wY(m), lambda(n+m), lambda_warm(n+m);
+    for (auto &w : wY) w = unif(rnd_gen);
+    real_t sY = 0;
+    for (auto &w : wY) sY += w;
+    for (auto &w : wY) w /= sY;
+    for (auto &c : C) c = unif(rnd_gen);
+    d2_solver_context_t *ctx = d2_solver_context_create();
+    d2_match_by_distmat_ctx(ctx, n, m, &C[0], &wX[0], &wY[0], NULL, &lambda_warm[0]);
+    size_t pivots_cold = 0, pivots_warm = 0;
+    real_t max_err = 0;
+    for (int p=0; p<num; ++p) {
+      for (auto &c : C) c += .01 * (unif(rnd_gen) - .5);
+      d2_solver_reset_pivots(NULL);
+      real_t fval_cold = d2_match_by_distmat(n, m, &C[0], &wX[0], &wY[0], NULL, &lambda[0], 0);
+      pivots_cold += d2_solver_get_pivots(NULL);
+      d2_solver_reset_pivots(ctx);
+      real_t fval_warm = d2_match_by_distmat_warm(ctx, n, m, &C[0], &wX[0], &wY[0], NULL, &lambda_warm[0]);
+      pivots_warm += d2_solver_get_pivots(ctx);
+      max_err = std::max(max_err, std::fabs(fval_cold - fval_warm));
+    }
+    d2_solver_context_release(ctx);
+    std::cerr << "warm start\tmax difference: " << max_err
+	      << "\tpivots per solve: " << pivots_cold / num << " (cold) "
+	      << pivots_warm / num << " (warm)" << std::endl;
+    if (max_err > 100 * tol || pivots_warm > pivots_cold) pass = false;
+  }
+
+  server::Finalize();
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#include "../common/d2.hpp"
+
+using namespace d2;
+
+/* read the test data as streams of small chunks, from the text and from
+ * the binary file, and compare EMDs, lower bounds and nearest neighbors
+ * with those computed on the whole block */
+int main(int argc, char** argv) {
+  bool pass = true;
+  const size_t size = 200, len = 8, k = 3, chunk = 7;
+
+  Block<Elem<def::Euclidean, 3> > data (size, len);
+  data.read("data/test/euclidean_testdata.d2", size);
+  data.write_binary("data/test/euclidean_stream.d2b");
+  const size_t n = data.get_size();
+
+  std::vector<real_t> emds_ref(n), lower_ref(n), dists_ref(k);
+  std::vector<index_t> ranks(n), ids_ref(k);
+  const size_t q = 3;
+  EMD(data[q], data, &emds_ref[0]);
+  LowerThanEMD_v0(data[q], data, &lower_ref[0]);
+  std::vector<real_t> emds_linear(n);
+  KNearestNeighbors_Linear(k, data[q], data, &emds_linear[0], &ranks[0]);
+  for (size_t j=0; j<k; ++j) dists_ref[j] = emds_ref[ranks[j]];
+
+  for (const char *filename : {"data/test/euclidean_testdata.d2", "data/test/euclidean_stream.d2b"}) {
+    BlockStream<Elem<def::Euclidean, 3> > stream (filename, chunk, len);
+    size_t count = 0, col = 0;
+    while (const Block<Elem<def::Euclidean, 3> > *b = stream.next()) {
+      if (stream.get_offset() != count || b->get_size() > chunk) pass = false;
+      for (size_t i=0; i<b->get_size(); ++i)
+	if ((*b)[i].len != data[count + i].len ||
+	    memcmp((*b)[i].supp, data[count + i].supp, sizeof(real_t) * 3 * (*b)[i].len) != 0)
+	  pass = false;
+      count += b->get_size();
+      col += b->get_col();
+    }
+    if (count != n || col != data.get_col()) pass = false;
+
+    std::vector<real_t> emds(n), lower(n), dists(k);
+    std::vector<index_t> ids(k);
+    double startTime = getRealTime();
+    stream.rewind();
+    if (EMD(data[q], stream, &emds[0]) != n) pass = false;
+    stream.rewind();
+    if (LowerThanEMD_v0(data[q], stream, &lower[0]) != n) pass = false;
+    stream.rewind();
+    size_t num_emds = KNearestNeighbors_Simple(k, data[q], stream, &dists[0], &ids[0]);
+    double totalTime = getRealTime() - startTime;
+    for (size_t i=0; i<n; ++i)
+      if (std::fabs(emds[i] - emds_ref[i]) > 1E-8 * std::max(emds_ref[i], (real_t) 1.) ||
+	  lower[i] != lower_ref[i])
+	pass = false;
+    for (size_t j=0; j<k; ++j)
+      if (std::fabs(dists[j] - dists_ref[j]) > 1E-8 * std::max(dists_ref[j], (real_t) 1.) ||
+	  std::fabs(emds_ref[ids[j]] - dists[j]) > 1E-8 * std::max(dists[j], (real_t) 1.))
+	pass = false;
+    std::cerr << filename << "\tchunks of " << chunk << ", " << num_emds
+	      << " EMD computed for " << k << " nearest neighbors\t" << totalTime << "s" << std::endl;
+  }
+
+  // a binary file whose lengths do not add up to its columns gives no
+  // chunks at all
+  {
+    std::ifstream in("data/test/euclidean_stream.d2b", std::ifstream::binary);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    internal::_BinaryHeader h;
+    memcpy(&h, &bytes[0], sizeof(h));
+    uint64_t len0;
+    memcpy(&len0, &bytes[h.off_len], sizeof(len0));
+    len0 += 1;
+    memcpy(&bytes[h.off_len], &len0, sizeof(len0));
+    std::ofstream out("data/test/euclidean_stream_corrupted.d2b", std::ofstream::binary);
+    out.write(&bytes[0], bytes.size());
+    out.close();
+    BlockStream<Elem<def::Euclidean, 3> > stream ("data/test/euclidean_stream_corrupted.d2b", chunk, len);
+    if (stream.next() != NULL) pass = false;
+  }
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}
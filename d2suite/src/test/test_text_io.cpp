@@ -0,0 +1,118 @@
+#include "../common/d2.hpp"
+#include <random>
+
+using namespace d2;
+
+template <typename ElemType>
+bool same_block(const Block<ElemType> &a, const Block<ElemType> &b) {
+  typedef typename ElemType::T::type SuppType;
+  if (a.get_size() != b.get_size() || a.get_col() != b.get_col() ||
+      a.get_max_len() != b.get_max_len()) return false;
+  for (size_t i=0; i<a.get_size(); ++i)
+    if (a[i].len != b[i].len || a[i].w - a.get_weight_ptr() != b[i].w - b.get_weight_ptr())
+      return false;
+  const size_t col = a.get_col();
+  // def::Histogram keeps no supports, and its support pointers may be NULL
+  const size_t supp_count = ElemType::T::step_stride(col, ElemType::D);
+  return
+    memcmp(a.get_weight_ptr(), b.get_weight_ptr(), sizeof(real_t) * col) == 0 &&
+    (supp_count == 0 ||
+     memcmp(a.get_support_ptr(), b.get_support_ptr(), sizeof(SuppType) * supp_count) == 0);
+}
+
+/* read the same file with the istream reader and with the parallel text
+ * reader (with 1 and 4 threads), and compare the blocks and the time */
+template <typename BlockType>
+bool compare(const char *name, const std::string &filename, size_t size, size_t len,
+	     bool (*same)(const BlockType&, const BlockType&)) {
+  double startTime;
+  BlockType data_ref (size, len);
+  startTime = getRealTime();
+  internal::_read_main(data_ref, filename, size, std::false_type());
+  const double ref_time = getRealTime() - startTime;
+
+  bool pass = true;
+  for (size_t num_threads : {1, 4}) {
+    server::SetNumThreads(num_threads);
+    BlockType data (size / 4, len); // too small on purpose
+    startTime = getRealTime();
+    data.read_main(filename, size + 10);
+    std::cerr << name << "\tistream " << ref_time << "s\t" << num_threads << " thread(s) "
+	      << getRealTime() - startTime << "s" << std::endl;
+    if (!same(data_ref, data)) pass = false;
+  }
+  server::SetNumThreads(1);
+  return pass;
+}
+
+bool same_multiphase(const BlockMultiPhase<Elem<def::Euclidean, 3>, Elem<def::Euclidean, 3> > &a,
+		     const BlockMultiPhase<Elem<def::Euclidean, 3>, Elem<def::Euclidean, 3> > &b) {
+  auto &aa = const_cast<BlockMultiPhase<Elem<def::Euclidean, 3>, Elem<def::Euclidean, 3> > &>(a);
+  auto &bb = const_cast<BlockMultiPhase<Elem<def::Euclidean, 3>, Elem<def::Euclidean, 3> > &>(b);
+  return a.get_size() == b.get_size() &&
+    same_block(aa.get_block<0>(), bb.get_block<0>()) &&
+    same_block(aa.get_block<1>(), bb.get_block<1>());
+}
+
+int main(int argc, char** argv) {
+  bool pass = true;
+  std::mt19937 rnd_gen(0);
+  std::uniform_real_distribution<real_t> unif(0., 1.);
+
+  // the multi-phase test data
+  {
+    const size_t len[2] = {8, 8};
+    typedef BlockMultiPhase<Elem<def::Euclidean, 3>, Elem<def::Euclidean, 3> > BlockType;
+    double startTime;
+    BlockType data_ref (100, len);
+    internal::_read_main(data_ref, "data/test/euclidean_testdata.d2", 100, std::false_type());
+    BlockType data (10, len);
+    startTime = getRealTime();
+    data.read_main("data/test/euclidean_testdata.d2", 100);
+    std::cerr << "multi-phase\t" << getRealTime() - startTime << "s" << std::endl;
+    if (!same_multiphase(data_ref, data)) pass = false;
+  }
+
+  // synthetic data of every type with a text parser, and lengths that vary
+  const size_t size = 20000, vocab = 1000;
+  {
+    std::ofstream fs("data/test/euclidean_large.d2");
+    for (size_t i=0; i<size; ++i) {
+      const size_t len = 1 + rnd_gen() % 20;
+      fs << 5 << "\n" << len << "\n";
+      for (size_t j=0; j<len; ++j) fs << unif(rnd_gen) << " ";
+      fs << "\n";
+      for (size_t j=0; j<len*5; ++j) fs << (j % 3 ? "-" : "") << unif(rnd_gen) * 100 << (j % 5 == 4 ? "\n" : " ");
+    }
+  }
+  pass = compare<Block<Elem<def::Euclidean, 5> > >("Euclidean", "data/test/euclidean_large.d2", size, 10,
+						    same_block) && pass;
+  {
+    std::ofstream fs("data/test/wordvec_large.d2s");
+    for (size_t i=0; i<size; ++i) {
+      const size_t len = 1 + rnd_gen() % 50;
+      fs << 10 << "\n" << len << "\n";
+      for (size_t j=0; j<len; ++j) fs << (int) (unif(rnd_gen) * 10 + 1) << " ";
+      fs << "\n";
+      for (size_t j=0; j<len; ++j) fs << rnd_gen() % vocab + 1 << " ";
+      fs << "\n";
+    }
+  }
+  pass = compare<Block<Elem<def::WordVec, 10> > >("WordVec", "data/test/wordvec_large.d2s", size, 20,
+						  same_block) && pass;
+  pass = compare<Block<Elem<def::SparseHistogram, 0> > >("SparseHistogram", "data/test/wordvec_large.d2s",
+							 size, 20, same_block) && pass;
+  {
+    std::ofstream fs("data/test/histogram_large.d2");
+    for (size_t i=0; i<size; ++i) {
+      fs << 0 << "\n" << 32 << "\n";
+      for (size_t j=0; j<32; ++j) fs << unif(rnd_gen) << " ";
+      fs << "\n";
+    }
+  }
+  pass = compare<Block<Elem<def::Histogram, 0> > >("Histogram", "data/test/histogram_large.d2", size, 32,
+						   same_block) && pass;
+
+  std::cerr << (pass ? "passed" : "failed") << std::endl;
+  return pass ? 0 : 1;
+}